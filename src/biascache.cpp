@@ -0,0 +1,199 @@
+//
+//  biascache.cpp
+//  express
+//
+//  Created by agent on 10/19/26.
+//  Copyright 2026 agent. All rights reserved.
+//
+
+#include "biascache.h"
+#include "main.h"
+#include <boost/filesystem.hpp>
+#include <cstring>
+#include <fstream>
+
+using namespace std;
+namespace fs = boost::filesystem;
+namespace ip = boost::interprocess;
+
+const char CACHE_MAGIC[8] = {'X', 'P', 'R', 'S', 'B', 'C', 'H', '\0'};
+const boost::uint32_t CACHE_VERSION = 2;
+
+/**
+ * The CacheHeader struct is stored at the start of a bias cache file. It is
+ * followed by the records and then, if has_bias, the 5' bias arrays of all
+ * targets followed by the 3' bias arrays.
+ */
+struct CacheHeader {
+  char magic[8];
+  boost::uint32_t version;
+  boost::uint32_t has_bias;
+  boost::uint64_t fasta_hash;
+  boost::uint64_t param_hash;
+  boost::uint64_t num_targets;
+  boost::uint64_t total_length;
+};
+
+/**
+ * The CacheRecord struct stores the fixed-size part of an entry on disk.
+ */
+struct CacheRecord {
+  boost::uint64_t name_hash;
+  boost::uint64_t length;
+  double avg_bias;
+  double eff_len;
+};
+
+boost::uint64_t BiasCache::hash(const char* data, size_t len) {
+  boost::uint64_t h = 0xCBF29CE484222325ULL ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    boost::uint64_t w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+  }
+  for (; i < len; ++i) {
+    h = (h ^ (unsigned char)data[i]) * 0x100000001B3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return h;
+}
+
+boost::uint64_t BiasCache::hash_file(const string& file_name) {
+  ifstream infile(file_name.c_str(), ios::in | ios::binary);
+  if (!infile.is_open()) {
+    return 0;
+  }
+  const size_t CHUNK = 1 << 20;
+  vector<char> buff(CHUNK);
+  boost::uint64_t h = 0;
+  while (infile.good()) {
+    infile.read(&buff[0], CHUNK);
+    size_t n = (size_t)infile.gcount();
+    h = (h * 0x9E3779B97F4A7C15ULL) ^ hash(&buff[0], n);
+  }
+  return h;
+}
+
+bool BiasCache::write(const string& file_name, boost::uint64_t fasta_hash,
+                      boost::uint64_t param_hash,
+                      const vector<BiasCacheEntry>& entries) {
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.has_bias = entries.size() && entries[0].start_bias;
+  header.fasta_hash = fasta_hash;
+  header.param_hash = param_hash;
+  header.num_targets = entries.size();
+
+  vector<CacheRecord> records(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    records[i].name_hash = entries[i].name_hash;
+    records[i].length = entries[i].length;
+    records[i].avg_bias = entries[i].avg_bias;
+    records[i].eff_len = entries[i].eff_len;
+    header.total_length += entries[i].length;
+  }
+
+  // Write to a temporary file and rename it, so that concurrent runs never
+  // see a partial cache.
+  boost::system::error_code ec;
+  fs::path tmp_path = fs::unique_path(file_name + ".%%%%-%%%%", ec);
+  if (ec) {
+    return false;
+  }
+  string tmp_name = tmp_path.string();
+  {
+    ofstream out(tmp_name.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out.is_open()) {
+      return false;
+    }
+    out.write((const char*)&header, sizeof(header));
+    if (records.size()) {
+      out.write((const char*)&records[0], records.size()*sizeof(records[0]));
+    }
+    if (header.has_bias) {
+      foreach (const BiasCacheEntry& entry, entries) {
+        out.write((const char*)entry.start_bias, entry.length*sizeof(float));
+      }
+      foreach (const BiasCacheEntry& entry, entries) {
+        out.write((const char*)entry.end_bias, entry.length*sizeof(float));
+      }
+    }
+    out.close();
+    if (out.fail()) {
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+  }
+  fs::rename(tmp_path, file_name, ec);
+  if (ec) {
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+bool BiasCache::open(const string& file_name, boost::uint64_t fasta_hash,
+                     boost::uint64_t param_hash, bool with_bias) {
+  boost::system::error_code ec;
+  if (!fs::exists(file_name, ec)) {
+    return false;
+  }
+  try {
+    _file.reset(new ip::file_mapping(file_name.c_str(), ip::read_only));
+    _region.reset(new ip::mapped_region(*_file, ip::read_only));
+  } catch (ip::interprocess_exception& e) {
+    return false;
+  }
+
+  const char* data = (const char*)_region->get_address();
+  size_t size = _region->get_size();
+  const CacheHeader* header = (const CacheHeader*)data;
+  if (size < sizeof(CacheHeader) ||
+      memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+      header->version != CACHE_VERSION ||
+      header->fasta_hash != fasta_hash || header->param_hash != param_hash ||
+      (bool)header->has_bias != with_bias) {
+    return false;
+  }
+
+  size_t num_targets = (size_t)header->num_targets;
+  size_t total_length = (size_t)header->total_length;
+  size_t expected = sizeof(CacheHeader) + num_targets*sizeof(CacheRecord);
+  if (with_bias) {
+    expected += 2*total_length*sizeof(float);
+  }
+  if (size != expected) {
+    return false;
+  }
+
+  const CacheRecord* records = (const CacheRecord*)(data +
+                                                    sizeof(CacheHeader));
+  size_t sum_length = 0;
+  for (size_t i = 0; i < num_targets; ++i) {
+    sum_length += (size_t)records[i].length;
+  }
+  if (sum_length != total_length) {
+    return false;
+  }
+  const float* start_bias = (const float*)(records + num_targets);
+  const float* end_bias = start_bias + total_length;
+  _entries.resize(num_targets);
+  for (size_t i = 0; i < num_targets; ++i) {
+    BiasCacheEntry& entry = _entries[i];
+    entry.name_hash = records[i].name_hash;
+    entry.length = (size_t)records[i].length;
+    entry.avg_bias = records[i].avg_bias;
+    entry.eff_len = records[i].eff_len;
+    entry.start_bias = (with_bias) ? start_bias : NULL;
+    entry.end_bias = (with_bias) ? end_bias : NULL;
+    start_bias += entry.length;
+    end_bias += entry.length;
+  }
+  return true;
+}
@@ -0,0 +1,116 @@
+/**
+ *  biascache.h
+ *  express
+ *
+ *  Created by agent on 10/19/26.
+ *  Copyright 2026 agent. All rights reserved.
+ */
+
+#ifndef express_biascache_h
+#define express_biascache_h
+
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * The BiasCacheEntry struct stores the precomputed bias and effective length
+ * of a single target.
+ */
+struct BiasCacheEntry {
+  /**
+   * A public 64-bit hash of the target name, for validation.
+   */
+  boost::uint64_t name_hash;
+  /**
+   * A public size_t for the length of the target.
+   */
+  size_t length;
+  /**
+   * A public double for the (logged) average bias of the target.
+   */
+  double avg_bias;
+  /**
+   * A public double for the (logged) effective length of the target, without
+   * bias.
+   */
+  double eff_len;
+  /**
+   * Public pointers to the (logged) 5' and 3' bias at each position of the
+   * target, or NULL if bias correction is disabled.
+   */
+  const float* start_bias;
+  const float* end_bias;
+};
+
+/**
+ * The BiasCache class reads and writes an on-disk cache of the per-target
+ * bias arrays and effective lengths computed from fixed auxiliary parameters.
+ * These only depend on the target sequences and the parameter file, so the
+ * cache is keyed by hashes of the two and can be reused by every run with the
+ * same reference and parameters. The cache is memory mapped when read.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class BiasCache {
+  /**
+   * A private pointer to the mapping of the cache file.
+   */
+  boost::scoped_ptr<boost::interprocess::file_mapping> _file;
+  /**
+   * A private pointer to the mapped region of the cache file.
+   */
+  boost::scoped_ptr<boost::interprocess::mapped_region> _region;
+  /**
+   * A private vector of the entries, pointing into the mapped region.
+   */
+  std::vector<BiasCacheEntry> _entries;
+
+ public:
+  /**
+   * A static member function that hashes a range of bytes.
+   * @param data a pointer to the bytes to hash.
+   * @param len the number of bytes to hash.
+   * @return The 64-bit hash.
+   */
+  static boost::uint64_t hash(const char* data, size_t len);
+  /**
+   * A static member function that hashes the contents of a file.
+   * @param file_name the path to the file.
+   * @return The 64-bit hash, or 0 if the file cannot be read.
+   */
+  static boost::uint64_t hash_file(const std::string& file_name);
+  /**
+   * A static member function that atomically writes a cache file.
+   * @param file_name the path of the cache file.
+   * @param fasta_hash the hash identifying the target sequences.
+   * @param param_hash the hash of the auxiliary parameter file.
+   * @param entries the entries to write, in target order.
+   * @return True iff the cache was written.
+   */
+  static bool write(const std::string& file_name, boost::uint64_t fasta_hash,
+                    boost::uint64_t param_hash,
+                    const std::vector<BiasCacheEntry>& entries);
+  /**
+   * A member function that maps a cache file if it exists and was built from
+   * the given files.
+   * @param file_name the path of the cache file.
+   * @param fasta_hash the hash identifying the target sequences.
+   * @param param_hash the hash of the auxiliary parameter file.
+   * @param with_bias a bool that is true iff bias arrays are required.
+   * @return True iff a matching cache was found and mapped.
+   */
+  bool open(const std::string& file_name, boost::uint64_t fasta_hash,
+            boost::uint64_t param_hash, bool with_bias);
+  /**
+   * An accessor for the entries of the cache, in target order.
+   * @return A reference to the vector of entries.
+   */
+  const std::vector<BiasCacheEntry>& entries() const { return _entries; }
+};
+
+#endif
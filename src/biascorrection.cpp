@@ -96,26 +96,49 @@ void SeqWeightTable::copy_expected(const SeqWeightTable& other) {
   _expected = other._expected;
 }
 
-void SeqWeightTable::increment_expected(const Sequence& seq, double mass,
+template <class SequenceT>
+void SeqWeightTable::increment_expected(const SequenceT& seq, double mass,
                                         const vector<double>& fl_cdf) {
   _expected.fast_learn(seq, mass, fl_cdf);
 }
 
+void SeqWeightTable::increment_expected(const boost::uint64_t* counts,
+                                        bool rev) {
+  _expected.learn_counts(counts, rev);
+}
+
 void SeqWeightTable::normalize_expected() {
   _expected.calc_marginals();
 }
 
-void SeqWeightTable::increment_observed(const Sequence& seq, size_t i,
+template <class SequenceT>
+void SeqWeightTable::increment_observed(const SequenceT& seq, size_t i,
                                         double mass) {
   int left = (int)i - SURROUND;
   _observed.update(seq, left, mass);
 }
 
-double SeqWeightTable::get_weight(const Sequence& seq, size_t i) const {
+template <class SequenceT>
+double SeqWeightTable::get_weight(const SequenceT& seq, size_t i) const {
   int left = (int)i - SURROUND;
   return _observed.seq_prob(seq, left) - _expected.seq_prob(seq, left);
 }
 
+template void SeqWeightTable::increment_expected(const SequenceFwd& seq,
+                                                 double mass,
+                                                 const vector<double>& fl_cdf);
+template void SeqWeightTable::increment_expected(const SequenceRev& seq,
+                                                 double mass,
+                                                 const vector<double>& fl_cdf);
+template void SeqWeightTable::increment_observed(const SequenceFwd& seq,
+                                                 size_t i, double mass);
+template void SeqWeightTable::increment_observed(const SequenceRev& seq,
+                                                 size_t i, double mass);
+template double SeqWeightTable::get_weight(const SequenceFwd& seq,
+                                           size_t i) const;
+template double SeqWeightTable::get_weight(const SequenceRev& seq,
+                                           size_t i) const;
+
 void SeqWeightTable::append_output(ofstream& outfile) const {
   char buff[200];
   string header = "";
@@ -211,15 +234,24 @@ void BiasBoss::update_expectations(const Target& targ, double mass,
   }
 
   if (direction != R) {
-    const Sequence& seq_fwd = targ.seq(0);
+    const SequenceFwd& seq_fwd = targ.seq_fwd();
     _5_seq_bias.increment_expected(seq_fwd, mass, fl_cdf);
   }
   if (direction != F) {
-    const Sequence& seq_rev = targ.seq(1);
+    const SequenceRev& seq_rev = targ.seq_rev();
     _3_seq_bias.increment_expected(seq_rev, mass, fl_cdf);
   }
 }
 
+void BiasBoss::update_expectations(const boost::uint64_t* counts) {
+  if (direction != R) {
+    _5_seq_bias.increment_expected(counts, false);
+  }
+  if (direction != F) {
+    _3_seq_bias.increment_expected(counts, true);
+  }
+}
+
 void BiasBoss::normalize_expectations() {
   _5_seq_bias.normalize_expected();
   _3_seq_bias.normalize_expected();
@@ -229,8 +261,8 @@ void BiasBoss::update_observed(const FragHit& hit, double normalized_mass)
 {
   assert (hit.pair_status() != PAIRED || (int)hit.length() > WINDOW);
 
-  const Sequence& t_seq_fwd = hit.target()->seq(0);
-  const Sequence& t_seq_rev = hit.target()->seq(1);
+  const SequenceFwd& t_seq_fwd = hit.target()->seq_fwd();
+  const SequenceRev& t_seq_rev = hit.target()->seq_rev();
 
   if (hit.pair_status() != RIGHT_ONLY) {
     _5_seq_bias.increment_observed(t_seq_fwd, hit.left(), normalized_mass);
@@ -247,8 +279,8 @@ double BiasBoss::get_target_bias(std::vector<float>& start_bias,
   double tot_start = LOG_0;
   double tot_end = LOG_0;
 
-  const Sequence& t_seq_fwd = targ.seq(0);
-  const Sequence& t_seq_rev = targ.seq(1);
+  const SequenceFwd& t_seq_fwd = targ.seq_fwd();
+  const SequenceRev& t_seq_rev = targ.seq_rev();
 
   for (size_t i = 0; i < targ.length(); ++i) {
     start_bias[i] = _5_seq_bias.get_weight(t_seq_fwd, i);
@@ -85,13 +85,24 @@ public:
   void copy_expected(const SeqWeightTable& other);
   /**
    * A member function that increments the expected counts for a sliding window
-   * through the given target sequence by some mass.
+   * through the given target sequence by some mass. Templated on the sequence
+   * direction (SequenceFwd or SequenceRev).
    * @param seq the target sequence.
    * @param mass the amount to increment by in the parameter table.
    * @param fl_cdf the fragment length CDF.
    */
-  void increment_expected(const Sequence& seq, double mass,
+  template <class SequenceT>
+  void increment_expected(const SequenceT& seq, double mass,
                           const std::vector<double>& fl_cdf);
+  /**
+   * A member function that increments the expected counts by precomputed
+   * k-mer counts of the target sequences, as if increment_expected had been
+   * called on each of them with a mass of 1 (logged 0).
+   * @param counts an array of 4^(order+1) forward-strand k-mer counts.
+   * @param rev a bool that is true iff the counts should be reverse
+   *        complemented (for the 3' end).
+   */
+  void increment_expected(const boost::uint64_t* counts, bool rev);
   /**
    * A member function that normalizes the expected counts and fills in the
    * lower-ordered marginals.
@@ -99,23 +110,27 @@ public:
   void normalize_expected();
   /**
    * A member function that increments the observed counts for the given
-   * fragment sequence by some (logged) mass.
+   * fragment sequence by some (logged) mass. Templated on the sequence
+   * direction (SequenceFwd or SequenceRev).
    * @param seq the target sequence (possibly reverse complemented) to which the
    *        fragment end maps.
    * @param i the index into the sequence at which to center the bias window, ie
    *        where the fragment starts/ends.
    * @param mass the amount to increment by (logged)
    */
-   void increment_observed(const Sequence& seq, size_t i, double mass);
+   template <class SequenceT>
+   void increment_observed(const SequenceT& seq, size_t i, double mass);
   /**
    * A member function that calculates the bias weight (logged) of a window.
    * This is the ratio of the observed and expected weights given by the two
-   * Markov models.
+   * Markov models. Templated on the sequence direction (SequenceFwd or
+   * SequenceRev).
    * @param seq the target sequence.
    * @param i the central point of the bias window, ie the fragment end.
    * @return The bias weight for the window.
    */
-   double get_weight(const Sequence& seq, size_t i) const;
+   template <class SequenceT>
+   double get_weight(const SequenceT& seq, size_t i) const;
   /**
    * A member function that appends the marginal and conditional probabilities
    * for the foreground and background Markov models to the given file,
@@ -195,6 +210,13 @@ public:
    void update_expectations(const Target& targ,
                             double mass = 0,
                             const std::vector<double>& fl_cdf = std::vector<double>());
+  /**
+   * A member function that updates the expectation parameters from
+   * precomputed k-mer counts over a set of targets, with the same result as
+   * calling update_expectations on each of them with the default mass.
+   * @param counts an array of 4^(order+1) forward-strand k-mer counts.
+   */
+  void update_expectations(const boost::uint64_t* counts);
   /**
    * A member function that normalizes the expected counts and fills in the
    * lower-ordered marginals.
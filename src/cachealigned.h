@@ -0,0 +1,140 @@
+/**
+ *  cachealigned.h
+ *  express
+ *
+ *  Created by agent on 10/19/26.
+ *  Copyright 2026 agent. All rights reserved.
+ */
+
+#ifndef express_cachealigned_h
+#define express_cachealigned_h
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/**
+ * The size in bytes of a cache line.
+ */
+const size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * The CacheAlignedArray class stores a fixed number of objects contiguously in
+ * a single block of memory. Each object starts on its own cache line and is
+ * padded out to a whole number of lines, so that objects written by different
+ * threads never share a line. The objects are constructed individually, either
+ * with their default constructor through construct or in place at slot
+ * followed by a call to built, and are destroyed with the array.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+template <class T>
+class CacheAlignedArray {
+  /**
+   * A private pointer to the allocated memory.
+   */
+  char* _buffer;
+  /**
+   * A private pointer to the first cache line of the allocated memory.
+   */
+  char* _begin;
+  /**
+   * A private vector of flags that are non-zero for the constructed objects.
+   * Chars are used so that different threads may construct different objects.
+   */
+  std::vector<char> _built;
+  /**
+   * A private static member function that returns the distance in bytes
+   * between consecutive objects.
+   * @return The size of T rounded up to a whole number of cache lines.
+   */
+  static size_t stride() {
+    return (sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE *
+           CACHE_LINE_SIZE;
+  }
+  /**
+   * Private copy constructor and assignment operator to prevent copies.
+   */
+  CacheAlignedArray(const CacheAlignedArray&);
+  CacheAlignedArray& operator=(const CacheAlignedArray&);
+
+ public:
+  /**
+   * CacheAlignedArray constructor creates an empty array.
+   */
+  CacheAlignedArray() : _buffer(NULL), _begin(NULL) {}
+  /**
+   * CacheAlignedArray destructor destroys the constructed objects and frees
+   * the memory.
+   */
+  ~CacheAlignedArray() { clear(); }
+  /**
+   * A member function that destroys the constructed objects and allocates
+   * uninitialized memory for the given number of objects.
+   * @param size the number of objects to make room for.
+   */
+  void allocate(size_t size) {
+    clear();
+    _buffer = new char[size * stride() + CACHE_LINE_SIZE];
+    size_t offset = (size_t)_buffer % CACHE_LINE_SIZE;
+    _begin = _buffer + ((offset) ? CACHE_LINE_SIZE - offset : 0);
+    _built.assign(size, 0);
+  }
+  /**
+   * A member function that destroys the constructed objects and frees the
+   * memory.
+   */
+  void clear() {
+    for (size_t i = 0; i < _built.size(); ++i) {
+      if (_built[i]) {
+        (*this)[i].~T();
+      }
+    }
+    _built.clear();
+    delete [] _buffer;
+    _buffer = NULL;
+    _begin = NULL;
+  }
+  /**
+   * An accessor for the number of objects there is room for.
+   * @return The size of the array.
+   */
+  size_t size() const { return _built.size(); }
+  /**
+   * An accessor for the uninitialized memory of an object, to be constructed
+   * in place with placement new.
+   * @param i the index of the object.
+   * @return A pointer to the memory of the object.
+   */
+  void* slot(size_t i) { return _begin + i * stride(); }
+  /**
+   * A member function that records that an object has been constructed in
+   * place, so that it is destroyed with the array.
+   * @param i the index of the object.
+   */
+  void built(size_t i) { _built[i] = 1; }
+  /**
+   * A member function that default constructs an object.
+   * @param i the index of the object.
+   * @return A pointer to the new object.
+   */
+  T* construct(size_t i) {
+    T* obj = new (slot(i)) T();
+    built(i);
+    return obj;
+  }
+  /**
+   * Accessors for a constructed object.
+   * @param i the index of the object.
+   * @return A reference to the object.
+   */
+  T& operator[](size_t i) {
+    return *reinterpret_cast<T*>(_begin + i * stride());
+  }
+  const T& operator[](size_t i) const {
+    return *reinterpret_cast<const T*>(_begin + i * stride());
+  }
+};
+
+#endif
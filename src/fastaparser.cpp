@@ -0,0 +1,204 @@
+//
+//  fastaparser.cpp
+//  express
+//
+//  Created by agent on 10/19/26.
+//  Copyright 2026 agent. All rights reserved.
+//
+
+#include "fastaparser.h"
+#include "main.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <zlib.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/**
+ * A helper function that returns the end of the header name starting at the
+ * given position (the first space or end of line).
+ */
+inline const char* name_end(const char* p, const char* line_end) {
+  const char* end = p;
+  while (end < line_end && *end != ' ' && *end != '\r') {
+    end++;
+  }
+  return end;
+}
+
+FastaParser::FastaParser(const string& file_name)
+    : _data(NULL), _size(0), _map(NULL) {
+  if (!load(file_name)) {
+    logger.severe("Unable to open MultiFASTA file '%s'.", file_name.c_str());
+  }
+  if (!load_index(file_name + ".fai")) {
+    scan_records();
+  }
+}
+
+FastaParser::~FastaParser() {
+#ifndef WIN32
+  if (_map) {
+    munmap(_map, _size);
+  }
+#endif
+}
+
+bool FastaParser::load(const string& file_name) {
+  if (file_name.size() > 3 &&
+      file_name.compare(file_name.size() - 3, 3, ".gz") == 0) {
+    gzFile gz = gzopen(file_name.c_str(), "rb");
+    if (!gz) {
+      return false;
+    }
+    const size_t CHUNK = 1 << 20;
+    size_t n = 0;
+    int bytes;
+    do {
+      _buff.resize(n + CHUNK);
+      bytes = gzread(gz, &_buff[n], (unsigned)CHUNK);
+      n += (bytes > 0) ? bytes : 0;
+    } while (bytes > 0);
+    gzclose(gz);
+    if (bytes < 0) {
+      return false;
+    }
+    _buff.resize(n);
+    _size = n;
+    _data = (n) ? &_buff[0] : NULL;
+    return true;
+  }
+
+#ifndef WIN32
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      _map = map;
+      _size = st.st_size;
+      _data = (const char*)map;
+      close(fd);
+      return true;
+    }
+  }
+  close(fd);
+#endif
+
+  // Fall back to reading the whole file.
+  ifstream infile(file_name.c_str(), ios::in | ios::binary);
+  if (!infile.is_open()) {
+    return false;
+  }
+  infile.seekg(0, ios::end);
+  _size = (size_t)infile.tellg();
+  infile.seekg(0, ios::beg);
+  _buff.resize(_size);
+  if (_size) {
+    infile.read(&_buff[0], _size);
+    _data = &_buff[0];
+  }
+  return true;
+}
+
+bool FastaParser::load_index(const string& index_name) {
+  ifstream infile(index_name.c_str());
+  if (!infile.is_open()) {
+    return false;
+  }
+
+  vector<FastaRecord> records;
+  string line;
+  while (getline(infile, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    // Each line is: name, length, offset, bases per line, bytes per line.
+    size_t tab = line.find('\t');
+    if (tab == string::npos) {
+      return false;
+    }
+    size_t len, offset, line_bases, line_bytes;
+    if (sscanf(line.c_str() + tab + 1, SIZE_T_FMT "\t" SIZE_T_FMT "\t"
+               SIZE_T_FMT "\t" SIZE_T_FMT, &len, &offset, &line_bases,
+               &line_bytes) != 4 || !line_bases || line_bytes < line_bases) {
+      return false;
+    }
+    FastaRecord rec;
+    rec.name = line.substr(0, tab);
+    rec.begin = offset;
+    rec.end = offset + (len / line_bases) * line_bytes + len % line_bases;
+    // The record must start right after its own header line.
+    if (rec.end > _size || offset == 0 || _data[offset-1] != '\n') {
+      return false;
+    }
+    const char* header = _data + offset - 1;
+    while (header > _data && *(header-1) != '\n') {
+      header--;
+    }
+    const char* p = header + 1;
+    if (*header != '>' ||
+        rec.name.compare(0, string::npos, p,
+                         name_end(p, _data + offset - 1) - p)) {
+      return false;
+    }
+    records.push_back(rec);
+  }
+
+  _records.swap(records);
+  return true;
+}
+
+void FastaParser::scan_records() {
+  const char* p = _data;
+  const char* end = _data + _size;
+  while (p < end) {
+    const char* line_end = (const char*)memchr(p, '\n', end - p);
+    if (!line_end) {
+      line_end = end;
+    }
+    if (*p == '>') {
+      if (_records.size()) {
+        _records.back().end = p - _data;
+      }
+      FastaRecord rec;
+      rec.name.assign(p + 1, name_end(p + 1, line_end));
+      rec.begin = min((size_t)(line_end - _data + 1), _size);
+      rec.end = _size;
+      _records.push_back(rec);
+    }
+    p = line_end + 1;
+  }
+}
+
+void FastaParser::sequence(const FastaRecord& rec, string& seq) const {
+  seq.clear();
+  seq.reserve(rec.end - rec.begin);
+  const char* p = _data + rec.begin;
+  const char* end = _data + rec.end;
+  while (p < end) {
+    const char* line_end = (const char*)memchr(p, '\n', end - p);
+    if (!line_end) {
+      line_end = end;
+    }
+    const char* q = line_end;
+    while (q > p && isspace(*(q-1))) {
+      q--;
+    }
+    seq.append(p, q);
+    p = line_end + 1;
+  }
+}
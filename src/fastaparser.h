@@ -0,0 +1,124 @@
+/**
+ *  fastaparser.h
+ *  express
+ *
+ *  Created by agent on 10/19/26.
+ *  Copyright 2026 agent. All rights reserved.
+ */
+
+#ifndef express_fastaparser_h
+#define express_fastaparser_h
+
+#include <string>
+#include <vector>
+
+/**
+ * The FastaRecord struct stores the location of a single sequence within a
+ * loaded MultiFASTA file.
+ */
+struct FastaRecord {
+  /**
+   * A public string for the name of the sequence (the header up to the first
+   * space).
+   */
+  std::string name;
+  /**
+   * A public size_t for the offset of the first sequence byte in the file.
+   */
+  size_t begin;
+  /**
+   * A public size_t for the offset just past the last sequence byte in the
+   * file.
+   */
+  size_t end;
+};
+
+/**
+ * The FastaParser class loads a MultiFASTA file into memory and splits it into
+ * records whose sequences can then be extracted independently, and therefore
+ * in parallel. Plain files are memory mapped, while files ending in ".gz" are
+ * decompressed into a buffer. When a samtools index ("<file>.fai") is present
+ * and consistent with the file, the record boundaries are taken from it
+ * instead of scanning the file for headers.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class FastaParser {
+  /**
+   * A private pointer to the start of the file contents.
+   */
+  const char* _data;
+  /**
+   * A private size_t for the number of bytes in the file.
+   */
+  size_t _size;
+  /**
+   * A private pointer to the memory map of the file, or NULL if the file was
+   * read into _buff.
+   */
+  void* _map;
+  /**
+   * A private vector holding the file contents when it is not memory mapped.
+   */
+  std::vector<char> _buff;
+  /**
+   * A private vector of the records in the order they appear in the file.
+   */
+  std::vector<FastaRecord> _records;
+
+  /**
+   * A private member function that loads the file contents into memory.
+   * @param file_name the path to the file.
+   * @return True iff the file could be opened and read.
+   */
+  bool load(const std::string& file_name);
+  /**
+   * A private member function that builds the records from a samtools FASTA
+   * index.
+   * @param index_name the path to the index file.
+   * @return True iff the index exists and matches the file contents.
+   */
+  bool load_index(const std::string& index_name);
+  /**
+   * A private member function that builds the records by scanning the file
+   * for header lines.
+   */
+  void scan_records();
+
+ public:
+  /**
+   * FastaParser constructor loads the file and locates its records. Exits with
+   * an error if the file cannot be read.
+   * @param file_name the path to the MultiFASTA file.
+   */
+  FastaParser(const std::string& file_name);
+  /**
+   * FastaParser destructor unmaps or frees the file contents.
+   */
+  ~FastaParser();
+  /**
+   * An accessor for the records in the file.
+   * @return A reference to the vector of records in file order.
+   */
+  const std::vector<FastaRecord>& records() const { return _records; }
+  /**
+   * An accessor for the contents of the file, as loaded into memory.
+   * @return A pointer to the first byte of the file.
+   */
+  const char* data() const { return _data; }
+  /**
+   * An accessor for the number of bytes in the file, once decompressed.
+   * @return The size of the file contents.
+   */
+  size_t size() const { return _size; }
+  /**
+   * A member function that extracts the sequence of a record, dropping line
+   * breaks and other whitespace. Safe to call from multiple threads.
+   * @param rec the record to extract.
+   * @param seq the string to store the sequence in.
+   */
+  void sequence(const FastaRecord& rec, std::string& seq) const;
+};
+
+#endif
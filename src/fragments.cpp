@@ -8,82 +8,239 @@
 
 #include "fragments.h"
 #include "main.h"
+#include "xoshiro.h"
 #include <string.h>
 #include <stdlib.h>
 
 using namespace std;
 
-Fragment::Fragment(Library* lib) : _lib(lib) {}
+/**
+ * The number of open mates at which a fragment starts indexing them in a hash
+ * table instead of scanning them linearly.
+ */
+const size_t MIN_MATE_INDEX = 16;
+
+/**
+ * A helper function that hashes the key of an open mate.
+ * @param targ_id the target of the mapping.
+ * @param left the leftmost position of the mapping.
+ * @param mate_l the leftmost position of its mate.
+ * @param first a bool that is true iff the read was sequenced first.
+ * @param reversed a bool that is true iff the read was reverse complemented.
+ * @return The hash of the key.
+ */
+inline size_t mate_hash(size_t targ_id, size_t left, size_t mate_l, bool first,
+                        bool reversed) {
+  boost::uint64_t h = (boost::uint64_t)targ_id * 0x9E3779B97F4A7C15ULL;
+  h ^= (boost::uint64_t)left * 0xC2B2AE3D27D4EB4FULL;
+  h ^= (boost::uint64_t)mate_l * 0x165667B19E3779F9ULL;
+  h ^= (boost::uint64_t)(first << 1 | reversed);
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return (size_t)h;
+}
+
+/**
+ * A helper function that returns the hash table key of a stored open mate.
+ * @param om a pointer to the open mate.
+ * @return The hash of its key.
+ */
+inline size_t open_mate_hash(const ReadHit* om) {
+  return mate_hash(om->targ_id, om->left, (size_t)om->mate_l, om->first,
+                   om->reversed);
+}
+
+/**
+ * A helper function that checks whether two read mappings are mates.
+ * @param nm a pointer to the new read mapping.
+ * @param om a pointer to an open mate.
+ * @return True iff the mappings form a pair.
+ */
+inline bool is_mate(const ReadHit* nm, const ReadHit* om) {
+  return (nm->targ_id == om->targ_id &&
+          (size_t)nm->mate_l == om->left &&
+          (size_t)om->mate_l == nm->left &&
+          nm->first != om->first &&
+          nm->reversed != om->reversed);
+}
+
+void FragHit::release_reads(FragPool& pool) {
+  if (_read_l) {
+    pool.release(_read_l);
+    _read_l = NULL;
+  }
+  if (_read_r) {
+    pool.release(_read_r);
+    _read_r = NULL;
+  }
+}
+
+Fragment::Fragment(Library* lib, FragPool* pool)
+    : _num_pruned(0), _pruned_mass(0), _mass(0), _lib_mass(0), _seq_num(0),
+      _multiplicity(1), _lib(lib), _pool(pool) {}
 
 Fragment::~Fragment() {
+  reset(NULL);
+}
+
+void Fragment::reset(Library* lib) {
   for (size_t i = 0; i < num_hits(); i++) {
-    delete _frag_hits[i];
+    _pool->release(_frag_hits[i]);
   }
+  _frag_hits.clear();
+
+  for (size_t i = 0; i < _dropped_hits.size(); i++) {
+    _pool->release(_dropped_hits[i]);
+  }
+  _dropped_hits.clear();
+  _num_pruned = 0;
+  _pruned_mass = 0;
+  _multiplicity = 1;
 
   for (size_t i = 0; i < _open_mates.size(); i++) {
-    delete _open_mates[i];
+    if (_open_mates[i]) {
+      _pool->release(_open_mates[i]);
+    }
   }
+  _open_mates.clear();
+  _mate_index.clear();
+
+  _name.clear();
+  _name_key = NameKey();
+  _mass = 0;
+  _lib_mass = 0;
+  _seq_num = 0;
+  _lib = lib;
 }
 
 bool Fragment::add_map_end(ReadHit* r)
 {
-  if (_name.empty()) {
-    _name = r->name;
-  } else if (_name != r->name) {
+  if (_name_key.empty()) {
+    _name_key = r->name_key;
+  } else if (_name_key != r->name_key) {
     return false;
   }
 
   if (r->mate_l >= 0) {
     add_open_mate(r);
   } else {  // single-end fragment
-    _frag_hits.push_back(new FragHit(r));
+    _frag_hits.push_back(_pool->new_frag_hit(r));
   }
 
   return true;
 }
 
 void Fragment::add_open_mate(ReadHit* nm) {
-  bool found = false;
-
-  for(vector<ReadHit*>::iterator it = _open_mates.begin();
-      it != _open_mates.end(); ++it) {
-    ReadHit* om = *it;
-    if (nm->targ_id == om->targ_id &&
-        (size_t)nm->mate_l == om->left &&
-        (size_t)om->mate_l == nm->left &&
-        nm->first != om->first &&
-        nm->reversed != om->reversed) {
-      FragHit* h = NULL;
-	    if (nm->left < om->left || (nm->left == om->left && om->reversed)) {
-        h = new FragHit(nm, om);
-      } else {
-        h = new FragHit(om, nm);
+  // Open mates are searched in the order they were added, so the earliest
+  // match is paired. Slots are never reused after a pairing, which keeps
+  // matches with equal keys in that order along a probe sequence.
+  size_t found = _open_mates.size();
+  if (_mate_index.empty()) {
+    for (size_t i = 0; i < _open_mates.size(); ++i) {
+      if (_open_mates[i] && is_mate(nm, _open_mates[i])) {
+        found = i;
+        break;
+      }
+    }
+  } else {
+    size_t mask = _mate_index.size() - 1;
+    size_t s = mate_hash(nm->targ_id, (size_t)nm->mate_l, nm->left,
+                         !nm->first, !nm->reversed) & mask;
+    for (; _mate_index[s]; s = (s + 1) & mask) {
+      ReadHit* om = _open_mates[_mate_index[s] - 1];
+      if (om && is_mate(nm, om)) {
+        found = _mate_index[s] - 1;
+        break;
       }
-
-      found = true;
-      _frag_hits.push_back(h);
-      _open_mates.erase(it);
-      break;
     }
   }
 
-  if (!found) {
+  if (found == _open_mates.size()) {
     _open_mates.push_back(nm);
+    if (_open_mates.size() >= MIN_MATE_INDEX &&
+        2 * _open_mates.size() > _mate_index.size()) {
+      rebuild_mate_index();
+    } else if (!_mate_index.empty()) {
+      size_t mask = _mate_index.size() - 1;
+      size_t s = open_mate_hash(nm) & mask;
+      while (_mate_index[s]) {
+        s = (s + 1) & mask;
+      }
+      _mate_index[s] = _open_mates.size();
+    }
+    return;
   }
+
+  ReadHit* om = _open_mates[found];
+  _open_mates[found] = NULL;
+  FragHit* h = NULL;
+  if (nm->left < om->left || (nm->left == om->left && om->reversed)) {
+    h = _pool->new_frag_hit(nm, om);
+  } else {
+    h = _pool->new_frag_hit(om, nm);
+  }
+  _frag_hits.push_back(h);
 }
 
-const FragHit* Fragment::sample_hit() const {
+void Fragment::rebuild_mate_index() {
+  size_t n = 0;
+  for (size_t i = 0; i < _open_mates.size(); ++i) {
+    if (_open_mates[i]) {
+      _open_mates[n++] = _open_mates[i];
+    }
+  }
+  _open_mates.resize(n);
+
+  _mate_index.clear();
+  if (n < MIN_MATE_INDEX) {
+    return;
+  }
+  size_t size = 2 * MIN_MATE_INDEX;
+  while (size < 4 * n) {
+    size *= 2;
+  }
+  _mate_index.assign(size, 0);
+  size_t mask = size - 1;
+  for (size_t i = 0; i < n; ++i) {
+    size_t s = open_mate_hash(_open_mates[i]) & mask;
+    while (_mate_index[s]) {
+      s = (s + 1) & mask;
+    }
+    _mate_index[s] = i + 1;
+  }
+}
+
+const FragHit* Fragment::sample_hit(Xoshiro& rng) const {
   vector<double> probs(_frag_hits.size());
   probs[0] = sexp(_frag_hits[0]->params()->posterior);
   for (size_t i=1; i < _frag_hits.size(); ++i) {
     probs[i] = probs[i-1] + sexp(_frag_hits[i]->params()->posterior);
   }
 
-  double r = rand()/double(RAND_MAX)*probs.back();
+  double r = rng.uniform()*probs.back();
   size_t i = lower_bound(probs.begin(), probs.end(), r) - probs.begin();
   return _frag_hits[i];
 }
 
+void Fragment::drop_hits(const vector<bool>& drop) {
+  size_t n = 0;
+  for (size_t i = 0; i < _frag_hits.size(); ++i) {
+    if (drop[i]) {
+      _dropped_hits.push_back(_frag_hits[i]);
+    } else {
+      _frag_hits[n++] = _frag_hits[i];
+    }
+  }
+  _frag_hits.resize(n);
+}
+
+void Fragment::add_duplicate(double mass, double lib_mass) {
+  _mass = log_add(_mass, mass);
+  _lib_mass = log_add(_lib_mass, lib_mass);
+  _multiplicity++;
+}
+
 bool fraghit_compare(FragHit* h1, FragHit* h2) {
   return h1->target_id() < h2->target_id();
 }
@@ -91,3 +248,88 @@ bool fraghit_compare(FragHit* h1, FragHit* h2) {
 void Fragment::sort_hits() {
   sort(_frag_hits.begin(), _frag_hits.end(), fraghit_compare);
 }
+
+FragPool::~FragPool() {
+  foreach (Fragment* f, _frags) {
+    delete f;
+  }
+  foreach (vector<Fragment*>* batch, _batches) {
+    delete batch;
+  }
+  foreach (FragHit* h, _frag_hits) {
+    delete h;
+  }
+  foreach (ReadHit* r, _read_hits) {
+    delete r;
+  }
+}
+
+Fragment* FragPool::new_fragment(Library* lib) {
+  if (_frags.empty()) {
+    return new Fragment(lib, this);
+  }
+  Fragment* f = _frags.back();
+  _frags.pop_back();
+  f->reset(lib);
+  return f;
+}
+
+FragHit* FragPool::new_frag_hit(ReadHit* h) {
+  if (_frag_hits.empty()) {
+    return new FragHit(h);
+  }
+  FragHit* fh = _frag_hits.back();
+  _frag_hits.pop_back();
+  fh->reset(h);
+  return fh;
+}
+
+FragHit* FragPool::new_frag_hit(ReadHit* l, ReadHit* r) {
+  if (_frag_hits.empty()) {
+    return new FragHit(l, r);
+  }
+  FragHit* fh = _frag_hits.back();
+  _frag_hits.pop_back();
+  fh->reset(l, r);
+  return fh;
+}
+
+ReadHit* FragPool::new_read_hit() {
+  if (_read_hits.empty()) {
+    return new ReadHit();
+  }
+  ReadHit* r = _read_hits.back();
+  _read_hits.pop_back();
+  return r;
+}
+
+vector<Fragment*>* FragPool::new_batch() {
+  if (_batches.empty()) {
+    return new vector<Fragment*>();
+  }
+  vector<Fragment*>* batch = _batches.back();
+  _batches.pop_back();
+  return batch;
+}
+
+void FragPool::release(Fragment* f) {
+  f->reset(NULL);
+  _frags.push_back(f);
+}
+
+void FragPool::release(FragHit* h) {
+  h->release_reads(*this);
+  _frag_hits.push_back(h);
+}
+
+void FragPool::release(ReadHit* r) {
+  _read_hits.push_back(r);
+}
+
+void FragPool::release(vector<Fragment*>* batch) {
+  foreach (Fragment* f, *batch) {
+    release(f);
+  }
+  batch->clear();
+  _batches.push_back(batch);
+}
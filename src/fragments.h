@@ -15,13 +15,15 @@
 #include <fstream>
 #include <cassert>
 #include <api/BamAlignment.h>
+#include <boost/cstdint.hpp>
 #include "sequence.h"
-#include "boost/scoped_ptr.hpp"
 
 typedef size_t TargID;
 struct Library;
 class Target;
+class Xoshiro;
 class TargetTable;
+class FragPool;
 
 /**
  * PairStatus enum.
@@ -54,6 +56,58 @@ struct Indel {
   Indel(size_t p, size_t l) : pos(p), len(l) {}
 };
 
+/**
+ * The NameKey struct stores a fingerprint of a read name: a 64-bit hash of the
+ * name along with its length. Alignments are grouped into fragments and
+ * checked for sortedness by comparing NameKeys, so the full name only needs to
+ * be kept once per Fragment for use in messages.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+struct NameKey {
+  /**
+   * A public 64-bit FNV-1a hash of the name.
+   */
+  boost::uint64_t hash;
+  /**
+   * A public size_t for the length of the name.
+   */
+  size_t len;
+  /**
+   * Dummy NameKey constructor for an empty name.
+   */
+  NameKey() : hash(0), len(0) {}
+  /**
+   * NameKey constructor hashes the given characters.
+   * @param name a pointer to the (not necessarily null-terminated) name.
+   * @param length the number of characters in the name.
+   */
+  NameKey(const char* name, size_t length) : len(length) {
+    hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+      hash ^= (unsigned char)name[i];
+      hash *= 1099511628211ULL;
+    }
+  }
+  /**
+   * An accessor that returns true iff no name has been hashed.
+   * @return True iff the key is for an empty name.
+   */
+  bool empty() const { return len == 0; }
+  bool operator==(const NameKey& other) const {
+    return hash == other.hash && len == other.len;
+  }
+  bool operator!=(const NameKey& other) const { return !(*this == other); }
+};
+
+/**
+ * Global function used by boost::unordered containers to hash NameKeys.
+ * @param key the NameKey to hash.
+ * @return The hash value of the key.
+ */
+inline size_t hash_value(const NameKey& key) { return (size_t)key.hash; }
+
 /**
  * The ReadHit struct stores information for a single read alignment.
  *  @author    Adam Roberts
@@ -62,9 +116,10 @@ struct Indel {
  */
 struct ReadHit {
   /**
-   * A public string for the SAM "Query Template Name" (fragment name)
+   * A public NameKey fingerprinting the SAM "Query Template Name" (fragment
+   * name).
    */
-  std::string name;
+  NameKey name_key;
   /**
    * A public bool specifying if this read was sequenced first according to the
    * SAM flag.
@@ -93,7 +148,7 @@ struct ReadHit {
   /**
    * The read sequence.
    */
-  SequenceFwd seq;
+  ReadSequence seq;
   /**
    * A public vector of Indel objects storing all insertions to the reference in
    * the read. Insertions are stored in read order.
@@ -145,14 +200,14 @@ class FragHit {
   Target* _target;
   /**
    * Private pointer to data for the upstream (left) read alignment (if it
-   * exists). Pointer is deleted with this.
+   * exists). Pointer is deleted with this unless released to a FragPool.
    */
-  boost::scoped_ptr<ReadHit> _read_l;
+  ReadHit* _read_l;
   /**
    * Private pointer to data for the downstream (right) read alignment (if it
-   * exists). Pointer is deleted with this.
+   * exists). Pointer is deleted with this unless released to a FragPool.
    */
-  boost::scoped_ptr<ReadHit> _read_r;
+  ReadHit* _read_r;
   /**
    * A private vector storing pointers to "neighboring" targets. This is being
    * used for an experimental feature and may be removed without notice.
@@ -165,36 +220,72 @@ public:
    * FragHit constructor for single-end read.
    * @param h pointer to the ReadHit struct for the single-end read.
    */
-  FragHit(ReadHit* h) : _target(NULL) {
+  FragHit(ReadHit* h) : _read_l(NULL), _read_r(NULL) { reset(h); }
+  /**
+   * Fraghit constructor for paired-end read.
+   * @param l pointer to the ReadHit struct for the upstream (left) read.
+   * @param r pointer to the ReadHit struct for the downstream (right) read.
+   */
+  FragHit(ReadHit* l, ReadHit* r) : _read_l(NULL), _read_r(NULL) {
+    reset(l, r);
+  }
+  /**
+   * FragHit destructor deletes the ReadHit objects it holds.
+   */
+  ~FragHit() {
+    delete _read_l;
+    delete _read_r;
+  }
+  /**
+   * A member function that reinitializes a FragHit holding no reads for a
+   * single-end read.
+   * @param h pointer to the ReadHit struct for the single-end read.
+   */
+  void reset(ReadHit* h) {
+    assert(!_read_l && !_read_r);
+    _target = NULL;
+    _neighbors.clear();
     if (h->reversed) {
-      _read_r.reset(h);
+      _read_r = h;
     } else {
-      _read_l.reset(h);
+      _read_l = h;
     }
   }
   /**
-   * Fraghit constructor for paired-end read.
+   * A member function that reinitializes a FragHit holding no reads for a
+   * paired-end read.
    * @param l pointer to the ReadHit struct for the upstream (left) read.
    * @param r pointer to the ReadHit struct for the downstream (right) read.
    */
-  FragHit(ReadHit* l, ReadHit* r) : _target(NULL), _read_l(l), _read_r(r) {
+  void reset(ReadHit* l, ReadHit* r) {
+    assert(!_read_l && !_read_r);
     assert(!l->reversed);
     assert(r->reversed);
-    assert(l->name == r->name);
+    assert(l->name_key == r->name_key);
     assert(l->targ_id == r->targ_id);
     assert(l->left <= r->left);
     assert(l->first != r->first);
+    _target = NULL;
+    _neighbors.clear();
+    _read_l = l;
+    _read_r = r;
   }
   /**
-   * Accessor for the name of the fragment.
-   * @return The name of the fragment.
+   * A member function that passes the ReadHit objects held by the FragHit to
+   * the given pool for reuse.
+   * @param pool the FragPool to release the ReadHits to.
+   */
+  void release_reads(FragPool& pool);
+  /**
+   * Accessor for the fingerprint of the name of the fragment.
+   * @return The NameKey of the fragment.
    */
-  std::string frag_name() const {
+  const NameKey& frag_name_key() const {
     if (_read_l) {
-      return _read_l->name;
+      return _read_l->name_key;
     }
     assert(_read_r);
-    return _read_r->name;
+    return _read_r->name_key;
   }
   /**
    * Accessor for the hit parameters (likelihood, etc.).
@@ -244,6 +335,19 @@ public:
     assert(_read_r);
     return _read_r->targ_id;
   }
+  /**
+   * Mutator for the ID of the target the fragment is aligned to, used to
+   * reassign the hit to a target with an identical sequence.
+   * @param id the ID of the target aligned to.
+   */
+  void target_id(TargID id) {
+    if (_read_l) {
+      _read_l->targ_id = id;
+    }
+    if (_read_r) {
+      _read_r->targ_id = id;
+    }
+  }
   /**
    * Accessor for the leftmost position aligned to (0-based).
    * @return The leftmost position aligned to in the target.
@@ -283,10 +387,7 @@ public:
    * @return A const pointer to the 5' read alignment.
    */
   const ReadHit* left_read() const {
-    if (_read_l) {
-      return _read_l.get();
-    }
-    return NULL;
+    return _read_l;
   }
   /**
    * Const accessor for the alignment of the read at the rightmost (3') end of
@@ -294,10 +395,7 @@ public:
    * @return A const pointer to the 3' read alignment.
    */
   const ReadHit* right_read() const {
-    if (_read_r) {
-      return _read_r.get();
-    }
-    return NULL;
+    return _read_r;
   }
   /**
    * Const accessor for the alignment of the first (or only) read sequenced in
@@ -306,10 +404,10 @@ public:
    */
   const ReadHit* first_read() const {
     if (_read_l && _read_l->first) {
-      return _read_l.get();
+      return _read_l;
     }
     assert(_read_r);
-    return _read_r.get();
+    return _read_r;
   }
   /**
    * Const accessor for the alignment of the second read sequenced in
@@ -318,9 +416,9 @@ public:
    */
   const ReadHit* second_read() const {
     if (_read_l && !_read_l->first) {
-      return _read_l.get();
+      return _read_l;
     } else if (_read_r && !_read_r->first) {
-      return _read_r.get();
+      return _read_r;
     } else {
       return NULL;
     }
@@ -389,24 +487,75 @@ class Fragment {
   std::vector<FragHit*> _frag_hits;
   /**
    * A private vector of RadHit pointers containing single read mappings whose
-   * pairs have not been found. Temporarily useful when parsing the input to
-   * find mates but is not used after.
+   * pairs have not been found, in the order they were added. Mappings that
+   * have been paired are set to NULL. Temporarily useful when parsing the input
+   * to find mates but is not used after.
    */
   std::vector<ReadHit*> _open_mates;
   /**
-   * A private string for the SAM "Query Template Name" (fragment name).
+   * A private open-addressing hash table indexing _open_mates by target,
+   * position, mate position and orientation. Each slot holds the position of a
+   * mapping in _open_mates plus one, or 0 if empty. It is only built once a
+   * fragment has enough open mates for a linear scan to be slow, and is empty
+   * otherwise.
+   */
+  std::vector<size_t> _mate_index;
+  /**
+   * A private vector of FragHit pointers for mappings dropped by pruning. They
+   * are released with the rest of the Fragment, since the FragPool is only
+   * used by the parsing thread.
+   */
+  std::vector<FragHit*> _dropped_hits;
+  /**
+   * A private size_t for the number of mappings pruned during processing.
+   */
+  size_t _num_pruned;
+  /**
+   * A private double for the share of the fragment (non-logged) held by the
+   * pruned mappings before it was given to the others.
+   */
+  double _pruned_mass;
+  /**
+   * A private string for the SAM "Query Template Name" (fragment name). Only
+   * used for messages.
    */
   std::string _name;
+  /**
+   * A private NameKey fingerprinting the fragment name, which is compared
+   * against the keys of added reads.
+   */
+  NameKey _name_key;
   /**
    * A private double for the mass of the Fragment as determined by the
    * forgetting factor during processing.
    */
   double _mass;
+  /**
+   * A private double for the mass of the Fragment within its library as
+   * determined by the forgetting factor. Used to weight updates to the
+   * auxiliary parameters of the library.
+   */
+  double _lib_mass;
+  /**
+   * A private size_t for the sequence number of the Fragment within its library
+   * (starting at 1), as assigned by the parser.
+   */
+  size_t _seq_num;
+  /**
+   * A private size_t for the number of identical fragments this Fragment
+   * stands for, including itself.
+   */
+  size_t _multiplicity;
   /**
    * A private pointer to the global variables associated with the library
    * this fragment is from.
    */
   Library* _lib;
+  /**
+   * A private pointer to the FragPool that FragHits are requested from and
+   * released to.
+   */
+  FragPool* _pool;
   /**
    * A private method that searches for the mate of the given read mapping.
    * If found, the mates are combined into a single FragHit and added to
@@ -414,17 +563,35 @@ class Fragment {
    * @om pointer to single-end read mapping to find the mate of.
    */
   void add_open_mate(ReadHit* om);
+  /**
+   * A private method that removes the paired mappings from _open_mates and
+   * rebuilds _mate_index for the remaining ones, or clears it if there are too
+   * few for it to be useful.
+   */
+  void rebuild_mate_index();
 
 public:
   /**
    * Fragment Constructor.
+   * @param lib pointer to the global variables associated with the library
+   *        this fragment is from.
+   * @param pool pointer to the FragPool that FragHits are requested from and
+   *        released to.
    */
-  Fragment(Library* lib);
+  Fragment(Library* lib, FragPool* pool);
   /**
-   * Fragment destructor deletes all FragHit and ReadHit objects pointed to by
-   * the Fragment.
+   * Fragment destructor releases all FragHit and ReadHit objects pointed to by
+   * the Fragment to the pool.
    */
   ~Fragment();
+  /**
+   * A member function that releases all FragHit and ReadHit objects pointed to
+   * by the Fragment to the pool and resets it to an empty Fragment from the
+   * given library. The name and vector capacities are kept for reuse.
+   * @param lib pointer to the global variables associated with the library
+   *        the next fragment is from.
+   */
+  void reset(Library* lib);
   /**
    * Accessor for the global variables associated with the library this fragment
    * is from. Pointer outlives this.
@@ -432,12 +599,12 @@ public:
   const Library* lib() { return _lib; }
   /**
    * A member function that adds a new ReadHit to the Fragment. If it is the 
-   * first ReadHit, it sets the Fragment name. If the fragment is not paired, a
-   * FragHit is created and added to _frag_hits. Otherwise, add_open_mate is
-   * called.
+   * first ReadHit, it sets the Fragment name key. If the fragment is not
+   * paired, a FragHit is created and added to _frag_hits. Otherwise,
+   * add_open_mate is called.
    * @param r a pointer to the ReadHit to be added.
-   * @return True iff the read name matches the Fragment name or it is the first
-   *         read.
+   * @return True iff the read name key matches the Fragment name key or it is
+   *         the first read.
    */
   bool add_map_end(ReadHit* r);
   /**
@@ -445,6 +612,16 @@ public:
    * @return Reference to the SAM "Query Template Name" (fragment name).
    */
   const std::string& name() const { return _name; }
+  /**
+   * A mutator for the "Query Template Name", which is set by the parser.
+   * @param name the SAM "Query Template Name" (fragment name).
+   */
+  void name(const std::string& name) { _name = name; }
+  /**
+   * An accessor for the fingerprint of the "Query Template Name".
+   * @return Reference to the NameKey of the fragment.
+   */
+  const NameKey& name_key() const { return _name_key; }
   /**
    * An accessor for the number of valid alignments of the fragment.
    * @return Number of valid alignments for fragment.
@@ -466,9 +643,10 @@ public:
    * A member function that returns a single FragHit of the fragment sampled at
    * random based on the probabalistic assignments. Returned value does not
    * outlive this.
+   * @param rng the random number generator of the calling thread.
    * @return A randomly sampled FragHit.
    */
-  const FragHit* sample_hit() const;
+  const FragHit* sample_hit(Xoshiro& rng) const;
   /**
    * Mutator for the mass of the fragment according to the forgetting factor.
    * @param m a double representing the value to set to the mass to.
@@ -480,6 +658,74 @@ public:
    * @return The mass of the fragment.
    */
   double mass() const { return _mass; }
+  /**
+   * Mutator for the mass of the fragment within its library.
+   * @param m a double representing the value to set to the library mass to.
+   */
+  void lib_mass(double m) { _lib_mass = m; }
+  /**
+   * An accessor for the mass of the fragment within its library according to
+   * the forgetting factor.
+   * @return The library mass of the fragment.
+   */
+  double lib_mass() const { return _lib_mass; }
+  /**
+   * Mutator for the sequence number of the fragment within its library.
+   * @param n a size_t representing the sequence number (starting at 1).
+   */
+  void seq_num(size_t n) { _seq_num = n; }
+  /**
+   * An accessor for the sequence number of the fragment within its library,
+   * assigned in parse order starting at 1.
+   * @return The sequence number of the fragment.
+   */
+  size_t seq_num() const { return _seq_num; }
+  /**
+   * A member function that merges an identical fragment into this one. The
+   * masses of the duplicate are added to those of the fragment so that it is
+   * weighted as both when processed.
+   * @param mass the (logged) mass of the duplicate.
+   * @param lib_mass the (logged) library mass of the duplicate.
+   */
+  void add_duplicate(double mass, double lib_mass);
+  /**
+   * An accessor for the number of identical fragments this Fragment stands
+   * for, including itself.
+   * @return The multiplicity of the fragment.
+   */
+  size_t multiplicity() const { return _multiplicity; }
+  /**
+   * A mutator that records the mappings pruned during processing.
+   * @param num_pruned the number of pruned mappings.
+   * @param pruned_mass the share of the fragment (non-logged) held by the
+   *        pruned mappings.
+   */
+  void pruned(size_t num_pruned, double pruned_mass) {
+    _num_pruned = num_pruned;
+    _pruned_mass = pruned_mass;
+  }
+  /**
+   * An accessor for the number of mappings pruned during processing.
+   * @return The number of pruned mappings.
+   */
+  size_t num_pruned() const { return _num_pruned; }
+  /**
+   * An accessor for the share of the fragment held by the pruned mappings.
+   * @return The pruned mass (non-logged).
+   */
+  double pruned_mass() const { return _pruned_mass; }
+  /**
+   * An accessor for the number of mappings dropped from the fragment.
+   * @return The number of dropped mappings.
+   */
+  size_t num_dropped() const { return _dropped_hits.size(); }
+  /**
+   * A member function that removes the given mappings from the fragment,
+   * keeping the order of the others. The removed FragHits are released when
+   * the fragment is reset.
+   * @param drop a vector of bools that are true for the mappings to remove.
+   */
+  void drop_hits(const std::vector<bool>& drop);
   /**
    * A member function that sorts the FragHits by the TargID of the targets they
    * are aligned to.
@@ -497,4 +743,95 @@ public:
   }
 };
 
+/**
+ * The FragPool class recycles the Fragment, FragHit and ReadHit objects (and
+ * the FragBatch vectors holding them) used by a parse thread. Released objects
+ * keep the capacity of their strings and vectors, so that steady-state parsing
+ * does not need to allocate. The pool is not threadsafe; objects must be
+ * requested and released by the thread that owns it.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class FragPool {
+  /**
+   * A private vector of pointers to released Fragments.
+   */
+  std::vector<Fragment*> _frags;
+  /**
+   * A private vector of pointers to released FragHits.
+   */
+  std::vector<FragHit*> _frag_hits;
+  /**
+   * A private vector of pointers to released ReadHits.
+   */
+  std::vector<ReadHit*> _read_hits;
+  /**
+   * A private vector of pointers to released, empty vectors of Fragments.
+   */
+  std::vector<std::vector<Fragment*>*> _batches;
+
+ public:
+  /**
+   * FragPool destructor deletes all released objects.
+   */
+  ~FragPool();
+  /**
+   * A member function that returns an empty Fragment, reusing a released one if
+   * available.
+   * @param lib pointer to the global variables associated with the library
+   *        the fragment is from.
+   * @return A pointer to an empty Fragment.
+   */
+  Fragment* new_fragment(Library* lib);
+  /**
+   * A member function that returns a FragHit for a single-end read, reusing a
+   * released one if available.
+   * @param h pointer to the ReadHit struct for the single-end read.
+   * @return A pointer to the FragHit.
+   */
+  FragHit* new_frag_hit(ReadHit* h);
+  /**
+   * A member function that returns a FragHit for a paired-end read, reusing a
+   * released one if available.
+   * @param l pointer to the ReadHit struct for the upstream (left) read.
+   * @param r pointer to the ReadHit struct for the downstream (right) read.
+   * @return A pointer to the FragHit.
+   */
+  FragHit* new_frag_hit(ReadHit* l, ReadHit* r);
+  /**
+   * A member function that returns a ReadHit to be filled by a parser, reusing
+   * a released one if available. The contents of a reused ReadHit are stale.
+   * @return A pointer to the ReadHit.
+   */
+  ReadHit* new_read_hit();
+  /**
+   * A member function that returns an empty vector for a batch of Fragments,
+   * reusing a released one if available.
+   * @return A pointer to the empty vector.
+   */
+  std::vector<Fragment*>* new_batch();
+  /**
+   * A member function that resets a Fragment and stores it for reuse.
+   * @param f pointer to the Fragment to release.
+   */
+  void release(Fragment* f);
+  /**
+   * A member function that stores a FragHit and its ReadHits for reuse.
+   * @param h pointer to the FragHit to release.
+   */
+  void release(FragHit* h);
+  /**
+   * A member function that stores a ReadHit for reuse.
+   * @param r pointer to the ReadHit to release.
+   */
+  void release(ReadHit* r);
+  /**
+   * A member function that releases all Fragments in a batch and then stores
+   * the emptied batch vector for reuse.
+   * @param batch pointer to the vector of Fragments to release.
+   */
+  void release(std::vector<Fragment*>* batch);
+};
+
 #endif
@@ -7,10 +7,10 @@
  **/
 
 #include <boost/unordered_map.hpp>
-#include <boost/unordered_set.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -26,9 +26,9 @@
 #include "mismatchmodel.h"
 #include "mapparser.h"
 #include "threadsafety.h"
-#include "robertsfilter.h"
-#include "directiondetector.h"
 #include "library.h"
+#include "targetindex.h"
+#include "xoshiro.h"
 
 #ifdef PROTO
   #include PROTO_ALIGNMENT_INCL
@@ -63,12 +63,32 @@ size_t max_indel_size = 10;
 
 size_t stop_at = 0;
 
+// false positive rate of the Bloom filters used to check input sortedness
+double sort_check_fp_rate = 0.01;
+
+// number of threads used to parse SAM input
+size_t num_parse_threads = 1;
+
+// after the first round, hits whose likelihood is this far (logged) below the
+// best hit of their fragment are pruned, disabled with 0
+double prune_threshold = 0;
+
+// seed for the random number generators, set from the clock if not given
+size_t random_seed = 0;
+
+// with a fixed seed, the auxiliary parameters are updated in lockstep with
+// processing, once every this many fragments, so that runs can be repeated
+bool fixed_seed = false;
+const size_t SEEDED_BIAS_UPDATE_INTERVAL = 100000;
+
 // file location parameters
 string output_dir = ".";
 string fasta_file_name = "";
 string in_map_file_names = "";
 string param_file_name = "";
+string bias_cache_file_name = "";
 string haplotype_file_name = "";
+string cluster_file_name = "";
 
 // intial pseudo-count parameters (non-logged)
 double expr_alpha = .005;
@@ -113,6 +133,25 @@ size_t remaining_rounds = 0;
 
 bool spark_pre = false;
 
+// write an index of the target sequences and exit
+bool build_index = false;
+
+// collapse targets with identical sequences into a single representative
+bool collapse_targets = false;
+
+// merge exact duplicate fragments once the auxiliary parameters are burned out
+bool merge_duplicates = false;
+
+// run the E-step for each batch of fragments against a snapshot of the masses
+bool mini_batch = false;
+// mini-batches start after this many fragments, so that the early estimates,
+// which are based on few fragments, are still updated stepwise
+const size_t MINI_BATCH_WARM_UP = 100 * FRAG_BATCH_SIZE;
+// used to log the processing path once it is first taken
+boost::once_flag scored_once = BOOST_ONCE_INIT;
+boost::once_flag mini_batch_once = BOOST_ONCE_INIT;
+bool mini_batch_used = false;
+
 typedef boost::unordered_map<string, double> AlphaMap;
 AlphaMap* expr_alpha_map = NULL;
 
@@ -216,6 +255,29 @@ bool parse_options(int ac, char ** av) {
   ("aux-param-file",
    po::value<string>(&param_file_name)->default_value(param_file_name),
    "path to file containing auxiliary parameters to use instead of learning")
+  ("bias-cache",
+   po::value<string>(&bias_cache_file_name)->default_value(bias_cache_file_name),
+   "path to a cache of the target biases computed from the auxiliary parameter "
+   "file, read if it matches the targets and parameters and written otherwise")
+  ("build-index",
+   "write an index of the target sequences next to the fasta file for faster "
+   "loading in later runs, then exit")
+  ("prune-threshold",
+   po::value<double>(&prune_threshold)->default_value(prune_threshold),
+   "in additional rounds, skip alignments whose log likelihood is this far "
+   "below the best for the fragment, disabled with 0")
+  ("seed", po::value<size_t>(&random_seed),
+   "seed for the random number generators; runs with the same seed give "
+   "identical results when using at most 2 threads")
+  ("cluster-file",
+   po::value<string>(&cluster_file_name)->default_value(cluster_file_name),
+   "path to file with a cluster (e.g. gene) and target name on each line, used "
+   "to store targets of the same cluster together; the results.xprs of an "
+   "earlier run groups them by bundle")
+  ("collapse",
+   "estimate targets with identical sequences as one and split the result "
+   "evenly among them in results.xprs; the copies get uniq_counts 0, "
+   "solvable F and a lower bound of 0 on their intervals")
   ;
 
   string prior_file = "";
@@ -234,9 +296,18 @@ bool parse_options(int ac, char ** av) {
   ("sam-file", po::value<string>(&in_map_file_names)->default_value(""), "")
   ("fasta-file", po::value<string>(&fasta_file_name)->default_value(""), "")
   ("num-neighbors", po::value<size_t>(&num_neighbors)->default_value(0), "")
+  ("dup-merge", "merges exact duplicate fragments once the auxiliary "
+   "parameters are burned out")
+  ("mini-batch", "updates the masses once per batch of fragments")
   ("bias-model-order",
    po::value<size_t>(&bias_model_order)->default_value(bias_model_order),
    "sets the order of the Markov chain used to model sequence bias")
+  ("sort-check-fp-rate",
+   po::value<double>(&sort_check_fp_rate)->default_value(sort_check_fp_rate),
+   "false positive rate of the filters used to check that input is sorted")
+  ("num-parse-threads",
+   po::value<size_t>(&num_parse_threads)->default_value(num_parse_threads),
+   "number of threads for parsing SAM input")
   ;
 
   po::positional_options_description positional;
@@ -256,6 +327,11 @@ bool parse_options(int ac, char ** av) {
   }
   po::notify(vm);
 
+  fixed_seed = vm.count("seed");
+  if (!fixed_seed) {
+    random_seed = (size_t)time(NULL);
+  }
+
   if (ff_param > 1.0 || ff_param < 0.5) {
     logger.info("Command-Line Argument Error: forget-param/f option must be "
                 "between 0.5 and 1.0.");
@@ -323,8 +399,12 @@ bool parse_options(int ac, char ** av) {
   output_running_reads = vm.count("output-running-reads");
   batch_mode = vm.count("batch-mode");
   both = vm.count("both");
+  collapse_targets = vm.count("collapse");
+  merge_duplicates = vm.count("dup-merge");
+  mini_batch = vm.count("mini-batch");
   remaining_rounds = max(additional_online, additional_batch);
   spark_pre = vm.count("preprocess");
+  build_index = vm.count("build-index");
 
   if (batch_mode) {
     ff_param = 1;
@@ -355,6 +435,24 @@ bool parse_options(int ac, char ** av) {
   if (num_threads > 0) {
     num_threads -= edit_detect;
   }
+  if (prune_threshold > 0 && remaining_rounds == 0) {
+    logger.warn("The '--prune-threshold' option has no effect without "
+                "additional rounds, since nothing is pruned in the first "
+                "round. Use the '-B' or '-O' option to enable.");
+  }
+  if (bias_cache_file_name.size() && param_file_name.empty()) {
+    logger.warn("The '--bias-cache' option has no effect without "
+                "'--aux-param-file'.");
+  }
+  if (mini_batch && (edit_detect || calc_covar || num_neighbors)) {
+    logger.warn("The '--mini-batch' option has no effect with edit detection, "
+                "neighbors or '--calc-covar'.");
+  }
+  if (fixed_seed && num_threads > 0) {
+    logger.warn("Fragments are processed on multiple threads after burn-out, "
+                "so runs with the same seed may give different results. Use "
+                "'-p 2' for identical results.");
+  }
   if (remaining_rounds && in_map_file_names == "") {
     logger.severe("Cannot process multiple rounds from streaming input.");
   }
@@ -417,39 +515,301 @@ void output_results(Librarian& libs, size_t tot_counts, int n=-1) {
   }
 }
 
+/**
+ * The TargetSnapshot struct holds the values of a target read at the start of a
+ * mini-batch, which the E-step of every fragment in the batch uses.
+ */
+struct TargetSnapshot {
+  /**
+   * The (logged) sample likelihood, mass and mass variance of the target.
+   */
+  double likelihood;
+  double mass;
+  double variance;
+  /**
+   * A bool that is true iff the target was solvable.
+   */
+  bool solvable;
+  /**
+   * The number of the mini-batch the snapshot was taken for.
+   */
+  size_t batch_num;
+  TargetSnapshot() : batch_num(0) {}
+};
+
+/**
+ * The MiniBatchUpdate struct holds an update to a target found during the
+ * E-step of a mini-batch, to be applied in the M-step.
+ */
+struct MiniBatchUpdate {
+  /**
+   * A pointer to the target to update.
+   */
+  Target* targ;
+  /**
+   * A pointer to the hit to add to the target, with its posterior set.
+   */
+  const FragHit* hit;
+  /**
+   * A bool that is true iff the hit is added to the target.
+   */
+  bool add;
+  /**
+   * The (logged) assignment variance and fragment mass of the hit.
+   */
+  double var;
+  double mass;
+  /**
+   * The number of fragments to add to the counts of the target.
+   */
+  size_t counts;
+  /**
+   * A bool that is true iff the counted fragments map uniquely to the target.
+   */
+  bool uniq;
+  /**
+   * A bool that is true iff the target becomes solvable.
+   */
+  bool solvable;
+};
+
+/**
+ * A helper function that orders mini-batch updates by target ID.
+ */
+inline bool update_less(const MiniBatchUpdate& u1, const MiniBatchUpdate& u2) {
+  return u1.targ->id() < u2.targ->id();
+}
+
+/**
+ * The ProcScratch struct holds the buffers used by process_fragment. Each
+ * processing thread owns one and reuses it for every fragment, so no memory is
+ * allocated per fragment once the buffers have grown.
+ */
+struct ProcScratch {
+  /**
+   * Vectors of the (logged) masses and mass variances of the hit targets.
+   */
+  vector<double> masses;
+  vector<double> variances;
+  /**
+   * A vector of bools that are true for the hits that are pruned.
+   */
+  vector<bool> pruned;
+  /**
+   * A vector of the distinct targets locked for the fragment, sorted by ID.
+   */
+  vector<const Target*> locked;
+  /**
+   * Vectors indexed by target ID of the (logged) total mass and the number of
+   * the uniquely mapping fragments handled since the last flush.
+   */
+  vector<double> uniq_mass;
+  vector<size_t> uniq_counts;
+  /**
+   * A vector of the targets with uniquely mapping fragments since the last
+   * flush.
+   */
+  vector<Target*> uniq_targs;
+  /**
+   * The random number generator of the thread.
+   */
+  Xoshiro rng;
+  /**
+   * A vector indexed by target ID of the snapshots taken for the mini-batches.
+   */
+  vector<TargetSnapshot> snapshots;
+  /**
+   * The number of the current mini-batch, starting at 1.
+   */
+  size_t batch_num;
+  /**
+   * A vector of the (logged) full likelihoods of the hits of a fragment.
+   */
+  vector<double> likelihoods;
+  /**
+   * A vector of the target updates of the current mini-batch.
+   */
+  vector<MiniBatchUpdate> updates;
+  /**
+   * Vectors of the fragments of the current mini-batch that were estimated
+   * against the snapshot, and of those that must be processed one at a time.
+   */
+  vector<Fragment*> estimated;
+  vector<Fragment*> stepwise;
+  ProcScratch() : batch_num(0) {}
+};
+
+/**
+ * This function handles a fragment with a single hit once the auxiliary
+ * parameters are burned out. The fragment only adds its mass and count to its
+ * target, so these are gathered in the buffers of the calling thread without
+ * taking any lock and applied later by flush_unique_fragments. Fragments that
+ * need more than that take the full path in process_fragment instead.
+ * @param frag the fragment to assign.
+ * @param scratch pointer to the buffers of the calling thread.
+ * @return True iff the fragment was handled.
+ */
+bool process_unique_fragment(Fragment& frag, ProcScratch* scratch) {
+  FragHit& m = *frag[0];
+  Target* t = m.target();
+  if (!burned_out || edit_detect || calc_covar || m.neighbors()->size() ||
+      t->has_haplotype()) {
+    return false;
+  }
+  m.params()->align_likelihood = LOG_1;
+  m.params()->full_likelihood = LOG_1;
+  m.params()->posterior = LOG_1;
+
+  TargID id = t->id();
+  if (id >= scratch->uniq_counts.size()) {
+    size_t num_targs = frag.lib()->targ_table->size();
+    scratch->uniq_mass.resize(num_targs, LOG_0);
+    scratch->uniq_counts.resize(num_targs, 0);
+  }
+  if (scratch->uniq_counts[id] == 0) {
+    scratch->uniq_targs.push_back(t);
+  }
+  scratch->uniq_counts[id] += frag.multiplicity();
+  scratch->uniq_mass[id] = log_add(scratch->uniq_mass[id], frag.mass());
+  return true;
+}
+
+/**
+ * This function applies the pending mass and counts of the uniquely mapping
+ * fragments gathered by process_unique_fragment for a single target. The
+ * target must already be locked by the calling thread.
+ * @param t pointer to the locked target.
+ * @param scratch pointer to the buffers of the calling thread.
+ */
+void apply_unique_mass(Target* t, ProcScratch* scratch) {
+  TargID id = t->id();
+  if (id >= scratch->uniq_counts.size() || scratch->uniq_counts[id] == 0) {
+    return;
+  }
+  double mass = scratch->uniq_mass[id];
+  size_t counts = scratch->uniq_counts[id];
+  t->add_unique_mass(mass);
+  if (first_round) {
+    t->incr_counts(true, counts);
+    t->bundle()->incr_counts(counts);
+  }
+  if (first_round || online_additional) {
+    t->bundle()->incr_mass(mass);
+  }
+  scratch->uniq_mass[id] = LOG_0;
+  scratch->uniq_counts[id] = 0;
+}
+
+/**
+ * This function applies the mass and counts of the uniquely mapping fragments
+ * gathered by process_unique_fragment to their targets and bundles. Each
+ * target is locked once for all of its fragments. Targets whose mass was
+ * already applied by process_fragment are skipped.
+ * @param scratch pointer to the buffers of the calling thread.
+ */
+void flush_unique_fragments(ProcScratch* scratch) {
+  foreach (Target* t, scratch->uniq_targs) {
+    if (scratch->uniq_counts[t->id()] == 0) {
+      continue;
+    }
+    t->lock();
+    apply_unique_mass(t, scratch);
+    t->unlock();
+  }
+  scratch->uniq_targs.clear();
+}
+
+/**
+ * A helper function that orders targets by ID.
+ */
+inline bool targ_id_less(const Target* t1, const Target* t2) {
+  return t1->id() < t2->id();
+}
+
+/**
+ * This function calculates the alignment likelihoods of the hits of a
+ * multi-mapped fragment. These depend only on the auxiliary parameters, so once
+ * the parameters are final this is done without taking any lock, before the
+ * fragment is handed to process_fragment.
+ * @param frag the fragment to score.
+ */
+void score_fragment(Fragment& frag) {
+  if (frag.num_hits() == 1) {
+    return;
+  }
+  foreach (FragHit* m, frag.hits()) {
+    m->params()->align_likelihood = m->target()->align_likelihood(*m);
+  }
+}
+
 /**
  * This function handles the probabilistic assignment of multi-mapped reads. The
  * marginal likelihoods are calculated for each mapping, and the mass of the
  * fragment is divided based on the normalized marginals to update the model
  * parameters.
  * @param frag_p pointer to the fragment to probabilistically assign.
+ * @param scratch pointer to the buffers of the calling thread.
+ * @param scored true iff the alignment likelihoods of the hits were already
+ *        calculated by score_fragment.
  */
-void process_fragment(Fragment* frag_p) {
+void process_fragment(Fragment* frag_p, ProcScratch* scratch,
+                      bool scored=false) {
   Fragment& frag = *frag_p;
   const Library& lib = *frag.lib();
 
-  // sort hits to avoid deadlock
+  if (frag.num_hits() == 1 && process_unique_fragment(frag, scratch)) {
+    return;
+  }
+
   frag.sort_hits();
   double mass_n = frag.mass();
 
   assert(frag.num_hits());
 
-  vector<double> masses(frag.num_hits(), 0);
-  vector<double> variances(frag.num_hits(), 0);
+  vector<double>& masses = scratch->masses;
+  vector<double>& variances = scratch->variances;
+  masses.assign(frag.num_hits(), 0);
+  variances.assign(frag.num_hits(), 0);
   double total_likelihood = LOG_0;
   double total_mass = LOG_0;
   double total_variance = LOG_0;
   size_t num_solvable = 0;
 
-  // set of locked targets
-  boost::unordered_set<const Target*> targ_set;
-  boost::unordered_set<const Target*> locked_set;
+  // Lock the distinct targets of the hits and their neighbors in order of ID
+  // to avoid deadlock. The hits are sorted, so repeated targets are adjacent.
+  vector<const Target*>& locked = scratch->locked;
+  locked.clear();
+  size_t num_targs = 0;
+  for (size_t i = 0; i < frag.num_hits(); ++i) {
+    const FragHit& m = *frag[i];
+    if (i == 0 || frag[i-1]->target() != m.target()) {
+      locked.push_back(m.target());
+      num_targs++;
+    }
+    locked.insert(locked.end(), m.neighbors()->begin(), m.neighbors()->end());
+  }
+  if (locked.size() > num_targs) {
+    sort(locked.begin(), locked.end(), targ_id_less);
+    locked.erase(unique(locked.begin(), locked.end()), locked.end());
+  }
+  foreach (const Target* t, locked) {
+    t->lock();
+  }
+
+  // The mass of the uniquely mapping fragments handled earlier by this thread
+  // must be seen before the fragment is split between its targets, or the
+  // split would be biased against the targets with pending unique mass.
+  if (!scratch->uniq_targs.empty()) {
+    foreach (const Target* t, locked) {
+      apply_unique_mass(lib.targ_table->get_targ(t->id()), scratch);
+    }
+  }
 
   // Update bundles and merge in first loop
   Bundle* bundle = frag.hits()[0]->target()->bundle();
   
   if (frag.num_hits() > 1) {
-    // Calculate marginal likelihoods and lock targets.
+    // Calculate marginal likelihoods.
     for (size_t i = 0; i < frag.num_hits(); ++i) {
       FragHit& m = *frag.hits()[i];
       Target* t = m.target();
@@ -457,19 +817,9 @@ void process_fragment(Fragment* frag_p) {
       bundle = lib.targ_table->merge_bundles(bundle, t->bundle());
       t->bundle(bundle);
       
-      if (locked_set.count(t) == 0) {
-        t->lock();
-        locked_set.insert(t);
+      if (!scored) {
+        m.params()->align_likelihood = t->align_likelihood(m);
       }
-      targ_set = locked_set;
-      // lock neighbors
-      foreach (const Target* neighbor, *m.neighbors()) {
-        if (locked_set.count(neighbor) == 0) {
-          neighbor->lock();
-          locked_set.insert(neighbor);
-        }
-      }
-      m.params()->align_likelihood = t->align_likelihood(m);
       m.params()->full_likelihood = m.params()->align_likelihood +
                                     t->sample_likelihood(first_round,
                                                          m.neighbors());
@@ -483,32 +833,56 @@ void process_fragment(Fragment* frag_p) {
     }
   } else {
     FragHit& m = *frag.hits()[0];
-    Target* t = m.target();
-    t->lock();
-    locked_set.insert(t);
     total_likelihood = 0;
     m.params()->align_likelihood = 0;
     m.params()->full_likelihood = 0;
-    foreach (const Target* neighbor, *frag.hits()[0]->neighbors()) {
-      if (targ_set.count(neighbor) == 0) {
-        neighbor->lock();
-        locked_set.insert(neighbor);
-      }
-    }
   }
 
   if (islzero(total_likelihood)){
     assert(expr_alpha_map);
     logger.warn("Fragment '%s' has 0 likelihood of originating from the "
                 "transcriptome. Skipping...", frag.name().c_str());
-    foreach (const Target* t, locked_set) {
+    foreach (const Target* t, locked) {
       t->unlock();
     }
     return;
   }
 
+  // After the first round, hits far less likely than the best hit of the
+  // fragment can be pruned, as the masses are then based on a full round.
+  // Their share of the fragment's mass is given to the other hits.
+  vector<bool>& pruned = scratch->pruned;
+  pruned.assign(frag.num_hits(), false);
+  double kept_likelihood = total_likelihood;
+  bool prune = prune_threshold > 0 && !first_round && num_targs > 1;
+  if (prune) {
+    double max_likelihood = 0;
+    bool found = false;
+    foreach (const FragHit* m, frag.hits()) {
+      double l = m->params()->full_likelihood;
+      if (!islzero(l) && (!found || l > max_likelihood)) {
+        max_likelihood = l;
+        found = true;
+      }
+    }
+    kept_likelihood = LOG_0;
+    size_t num_pruned = 0;
+    double pruned_mass = 0;
+    for (size_t i = 0; i < frag.num_hits(); ++i) {
+      double l = frag[i]->params()->full_likelihood;
+      if (islzero(l) || l < max_likelihood - prune_threshold) {
+        pruned[i] = true;
+        num_pruned++;
+        pruned_mass += sexp(l - total_likelihood);
+      } else {
+        kept_likelihood = log_add(kept_likelihood, l);
+      }
+    }
+    frag.pruned(num_pruned, pruned_mass);
+  }
+
   if (first_round) {
-    bundle->incr_counts();
+    bundle->incr_counts(frag.multiplicity());
   }
   if (first_round || online_additional) {
     bundle->incr_mass(mass_n);
@@ -519,48 +893,51 @@ void process_fragment(Fragment* frag_p) {
     FragHit& m = *frag[i];
     Target* t  = m.target();
     
-    double p = m.params()->full_likelihood-total_likelihood;
+    double p = (pruned[i]) ? LOG_0
+                           : m.params()->full_likelihood-kept_likelihood;
     m.params()->posterior = p;
-    if (targ_set.size() > 1) {
-      double v = log_add(variances[i] - 2*total_mass,
-                  total_variance + 2*masses[i] - 4*total_mass);
-      t->add_hit(m, v, mass_n);
+    if (num_targs > 1) {
+      if (!pruned[i]) {
+        double v = log_add(variances[i] - 2*total_mass,
+                    total_variance + 2*masses[i] - 4*total_mass);
+        t->add_hit(m, v, mass_n);
+      }
     } else if (i == 0) {
       t->add_hit(m, LOG_0, mass_n);
     }
 
     // update parameters
     if (first_round) {
-      double r = rand()/double(RAND_MAX);
+      double r = scratch->rng.uniform();
       
       if (i == 0 || frag[i-1]->target_id() != t->id()) {
-        t->incr_counts(targ_set.size() <= 1);
+        t->incr_counts(num_targs <= 1, frag.multiplicity());
       }
       if (!t->solvable() && num_solvable == frag.num_hits()-1) {
         t->solvable(true);
       }
       if (edit_detect && lib.mismatch_table) {
-        (lib.mismatch_table)->update(m, p, lib.mass_n);
+        (lib.mismatch_table)->update(m, p, frag.lib_mass());
       }
       if (!burned_out && r < sexp(p)) {
         if (lib.mismatch_table && !edit_detect) {
-          (lib.mismatch_table)->update(m, LOG_1, lib.mass_n);
+          (lib.mismatch_table)->update(m, LOG_1, frag.lib_mass());
         }
         if (m.pair_status() == PAIRED) {
-          (lib.fld)->add_val(m.length(), lib.mass_n);
+          (lib.fld)->add_val(m.length(), frag.lib_mass());
         }
         if (lib.bias_table) {
-          (lib.bias_table)->update_observed(m, lib.mass_n);
+          (lib.bias_table)->update_observed(m, frag.lib_mass());
         }
       }
     }
-    if (calc_covar && (last_round || online_additional)) {
+    if (calc_covar && !pruned[i] && (last_round || online_additional)) {
       double var = 2*mass_n + p + log_sub(LOG_1, p);
       lib.targ_table->update_covar(m.target_id(), m.target_id(), var);
       for (size_t j = i+1; j < frag.num_hits(); ++j) {
         const FragHit& m2 = *frag.hits()[j];
-        double p2 = m2.params()->full_likelihood-total_likelihood;
-        if (sexp(p2) == 0) {
+        double p2 = m2.params()->full_likelihood-kept_likelihood;
+        if (pruned[j] || sexp(p2) == 0) {
           continue;
         }
         double covar = 2*mass_n + p + p2;
@@ -569,33 +946,382 @@ void process_fragment(Fragment* frag_p) {
     }
   }
 
-  foreach (const Target* t, locked_set) {
+  foreach (const Target* t, locked) {
+    t->unlock();
+  }
+
+  // Pruned hits are dropped in later rounds, so they are not output.
+  if (prune && !first_round && frag.num_pruned()) {
+    frag.drop_hits(pruned);
+  }
+}
+
+/**
+ * A helper function that calculates the log of the sum of a vector of logged
+ * values. The largest value is factored out first, so that the exponentials are
+ * summed in a single loop without branches that the compiler can vectorize.
+ * @param x the vector of logged values.
+ * @return The (logged) sum of the values.
+ */
+double log_sum(const vector<double>& x) {
+  double max_x = 0;
+  bool found = false;
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (!islzero(x[i]) && (!found || x[i] > max_x)) {
+      max_x = x[i];
+      found = true;
+    }
+  }
+  if (!found) {
+    return LOG_0;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < x.size(); ++i) {
+    sum += (islzero(x[i])) ? 0 : exp(x[i] - max_x);
+  }
+  return max_x + log(sum);
+}
+
+/**
+ * This function returns the snapshot of a target for the current mini-batch,
+ * taking it the first time the target is seen in the batch. The target is only
+ * locked while its values are read.
+ * @param t the target to take the snapshot of.
+ * @param scratch pointer to the buffers of the calling thread.
+ * @return The snapshot of the target.
+ */
+const TargetSnapshot& target_snapshot(const Target* t, ProcScratch* scratch) {
+  TargetSnapshot& snap = scratch->snapshots[t->id()];
+  if (snap.batch_num != scratch->batch_num) {
+    t->lock();
+    snap.likelihood = t->sample_likelihood(first_round, NULL);
+    snap.mass = t->mass();
+    snap.variance = t->mass_var();
+    snap.solvable = t->solvable();
+    t->unlock();
+    snap.batch_num = scratch->batch_num;
+  }
+  return snap;
+}
+
+/**
+ * This function runs the E-step of the mini-batch EM for a multi-mapped
+ * fragment whose alignment likelihoods are already calculated. The posteriors
+ * of the hits are calculated against the snapshot of their targets, without
+ * taking any lock, and the resulting updates are added to the mini-batch.
+ * @param frag the fragment to estimate.
+ * @param scratch pointer to the buffers of the calling thread.
+ * @return True iff the fragment was estimated. Fragments with haplotypes or
+ *         with 0 likelihood are left to process_fragment.
+ */
+bool estimate_fragment(Fragment& frag, ProcScratch* scratch) {
+  frag.sort_hits();
+  size_t num_hits = frag.num_hits();
+
+  vector<double>& likelihoods = scratch->likelihoods;
+  vector<double>& masses = scratch->masses;
+  vector<double>& variances = scratch->variances;
+  likelihoods.resize(num_hits);
+  masses.resize(num_hits);
+  variances.resize(num_hits);
+  size_t num_targs = 0;
+  size_t num_solvable = 0;
+  for (size_t i = 0; i < num_hits; ++i) {
+    FragHit& m = *frag[i];
+    const Target* t = m.target();
+    if (t->has_haplotype()) {
+      return false;
+    }
+    if (i == 0 || frag[i-1]->target() != t) {
+      num_targs++;
+    }
+    const TargetSnapshot& snap = target_snapshot(t, scratch);
+    m.params()->full_likelihood = m.params()->align_likelihood +
+                                  snap.likelihood;
+    likelihoods[i] = m.params()->full_likelihood;
+    masses[i] = snap.mass;
+    variances[i] = snap.variance;
+    num_solvable += snap.solvable;
+  }
+  double total_likelihood = log_sum(likelihoods);
+  if (islzero(total_likelihood)) {
+    return false;
+  }
+  double total_mass = log_sum(masses);
+  double total_variance = log_sum(variances);
+
+  vector<bool>& pruned = scratch->pruned;
+  pruned.assign(num_hits, false);
+  double kept_likelihood = total_likelihood;
+  if (prune_threshold > 0 && !first_round && num_targs > 1) {
+    double max_likelihood = 0;
+    bool found = false;
+    for (size_t i = 0; i < num_hits; ++i) {
+      double l = likelihoods[i];
+      if (!islzero(l) && (!found || l > max_likelihood)) {
+        max_likelihood = l;
+        found = true;
+      }
+    }
+    size_t num_pruned = 0;
+    double pruned_mass = 0;
+    for (size_t i = 0; i < num_hits; ++i) {
+      double l = likelihoods[i];
+      if (islzero(l) || l < max_likelihood - prune_threshold) {
+        pruned[i] = true;
+        likelihoods[i] = LOG_0;
+        num_pruned++;
+        pruned_mass += sexp(l - total_likelihood);
+      }
+    }
+    kept_likelihood = log_sum(likelihoods);
+    frag.pruned(num_pruned, pruned_mass);
+  }
+
+  for (size_t i = 0; i < num_hits; ++i) {
+    FragHit& m = *frag[i];
+    Target* t = m.target();
+    double p = (pruned[i]) ? LOG_0
+                           : m.params()->full_likelihood - kept_likelihood;
+    m.params()->posterior = p;
+
+    MiniBatchUpdate u;
+    u.targ = t;
+    u.hit = &m;
+    u.add = (num_targs > 1) ? !pruned[i] : i == 0;
+    u.var = (num_targs > 1) ? log_add(variances[i] - 2*total_mass,
+                                      total_variance + 2*masses[i] -
+                                      4*total_mass)
+                            : LOG_0;
+    u.mass = frag.mass();
+    u.counts = 0;
+    if (first_round && (i == 0 || frag[i-1]->target_id() != t->id())) {
+      u.counts = frag.multiplicity();
+    }
+    u.uniq = num_targs <= 1;
+    u.solvable = first_round && num_solvable == num_hits - 1;
+    if (u.add || u.counts || u.solvable) {
+      scratch->updates.push_back(u);
+    }
+  }
+  return true;
+}
+
+/**
+ * This function runs the M-step of the mini-batch EM. The bundles of each
+ * estimated fragment are merged and updated first. The updates are then
+ * grouped by target, so that each target is locked once for all of its hits in
+ * the batch.
+ * @param scratch pointer to the buffers of the calling thread.
+ */
+void apply_mini_batch(ProcScratch* scratch) {
+  vector<const Target*>& locked = scratch->locked;
+  foreach (Fragment* frag_p, scratch->estimated) {
+    Fragment& frag = *frag_p;
+    const Library& lib = *frag.lib();
+    locked.clear();
+    for (size_t i = 0; i < frag.num_hits(); ++i) {
+      if (i == 0 || frag[i-1]->target() != frag[i]->target()) {
+        locked.push_back(frag[i]->target());
+      }
+    }
+    foreach (const Target* t, locked) {
+      t->lock();
+    }
+    Bundle* bundle = frag[0]->target()->bundle();
+    for (size_t i = 1; i < frag.num_hits(); ++i) {
+      Target* t = frag[i]->target();
+      bundle = lib.targ_table->merge_bundles(bundle, t->bundle());
+      t->bundle(bundle);
+    }
+    if (first_round) {
+      bundle->incr_counts(frag.multiplicity());
+    }
+    if (first_round || online_additional) {
+      bundle->incr_mass(frag.mass());
+    }
+    foreach (const Target* t, locked) {
+      t->unlock();
+    }
+  }
+
+  vector<MiniBatchUpdate>& updates = scratch->updates;
+  stable_sort(updates.begin(), updates.end(), update_less);
+  size_t i = 0;
+  while (i < updates.size()) {
+    Target* t = updates[i].targ;
+    t->lock();
+    for (; i < updates.size() && updates[i].targ == t; ++i) {
+      const MiniBatchUpdate& u = updates[i];
+      if (u.add) {
+        t->add_hit(*u.hit, u.var, u.mass);
+      }
+      if (u.counts) {
+        t->incr_counts(u.uniq, u.counts);
+      }
+      if (u.solvable) {
+        t->solvable(true);
+      }
+    }
     t->unlock();
   }
+
+  // Pruned hits are dropped in later rounds, so they are not output.
+  if (prune_threshold > 0 && !first_round) {
+    vector<bool>& pruned = scratch->pruned;
+    foreach (Fragment* frag, scratch->estimated) {
+      if (!frag->num_pruned()) {
+        continue;
+      }
+      pruned.assign(frag->num_hits(), false);
+      for (size_t j = 0; j < frag->num_hits(); ++j) {
+        pruned[j] = islzero((*frag)[j]->params()->posterior);
+      }
+      frag->drop_hits(pruned);
+    }
+  }
+}
+
+/**
+ * This function processes a batch of fragments as a mini-batch of the online
+ * EM. Rather than updating the masses after each fragment, every fragment of
+ * the batch is estimated against the masses of its targets at the start of the
+ * batch, and the resulting updates are applied together. Each fragment still
+ * carries the mass given to it by the forgetting factor. This is the
+ * mini-batch form of the stepwise EM, and requires the alignment likelihoods
+ * to have been calculated by score_fragment.
+ * @param batch the batch of fragments to process.
+ * @param scratch pointer to the buffers of the calling thread.
+ */
+void process_mini_batch(FragBatch& batch, ProcScratch* scratch) {
+  size_t num_targs = batch.front()->lib()->targ_table->size();
+  if (scratch->snapshots.size() < num_targs) {
+    scratch->snapshots.resize(num_targs);
+  }
+  scratch->batch_num++;
+  scratch->updates.clear();
+  scratch->estimated.clear();
+  scratch->stepwise.clear();
+
+  foreach (Fragment* frag, batch) {
+    if (frag->num_hits() == 1) {
+      if (!process_unique_fragment(*frag, scratch)) {
+        scratch->stepwise.push_back(frag);
+      }
+    } else if (estimate_fragment(*frag, scratch)) {
+      scratch->estimated.push_back(frag);
+    } else {
+      scratch->stepwise.push_back(frag);
+    }
+  }
+  apply_mini_batch(scratch);
+
+  foreach (Fragment* frag, scratch->stepwise) {
+    process_fragment(frag, scratch, true);
+  }
+}
+
+/**
+ * These functions log, once per run, when batches are first scored before
+ * their updates and first processed as mini-batches, so that an option without
+ * effect is visible in the log.
+ */
+void log_scored_path() {
+  logger.info("Auxiliary parameters are final. Scoring alignments before "
+              "updates.");
+}
+void log_mini_batch_path() {
+  logger.info("Processing fragments in mini-batches.");
+  mini_batch_used = true;
+}
+
+/**
+ * This function processes a batch of fragments once the auxiliary parameters
+ * are burned out. If they are also final, the alignment likelihoods of the
+ * whole batch are calculated first without locks, so that only the updates are
+ * made while holding them. The batch is then processed as a mini-batch if
+ * requested and past the warm-up, and otherwise one fragment at a time.
+ * @param batch the batch of fragments to process.
+ * @param scratch pointer to the buffers of the calling thread.
+ */
+void process_batch(FragBatch& batch, ProcScratch* scratch) {
+  const Library& lib = *batch.front()->lib();
+  bool scored = !edit_detect && (!lib.bias_table ||
+                                 lib.targ_table->bias_final());
+  if (scored) {
+    boost::call_once(&log_scored_path, scored_once);
+    foreach (Fragment* frag, batch) {
+      score_fragment(*frag);
+    }
+  }
+  if (scored && mini_batch && !calc_covar && !num_neighbors &&
+      batch.front()->seq_num() > MINI_BATCH_WARM_UP) {
+    boost::call_once(&log_mini_batch_path, mini_batch_once);
+    process_mini_batch(batch, scratch);
+  } else {
+    foreach (Fragment* frag, batch) {
+      process_fragment(frag, scratch, scored);
+    }
+  }
+  flush_unique_fragments(scratch);
 }
 
 /**
- * This function processes Fragments asynchronously. Fragments are popped from
- * a threadsafe input queue, processed, and then pushed onto a threadsafe output
- * queue.
- * @param pts pointer to a struct with the input and output Fragment queues.
+ * This function processes Fragments asynchronously. Batches of Fragments are
+ * popped from a threadsafe input queue, processed, and then pushed onto a
+ * threadsafe output queue. A NULL batch signals the end of the input and is
+ * pushed back onto the input queue to stop the other processing threads.
+ * @param in pointer to the queue of batches to be processed.
+ * @param out pointer to the queue of processed batches.
+ * @param stream the stream of the random seed used by the thread.
  */
-void proc_thread(ParseThreadSafety* pts) {
+void proc_thread(ThreadSafeFragQueue* in, ThreadSafeFragQueue* out,
+                 size_t stream) {
+  ProcScratch scratch;
+  scratch.rng.seed(random_seed, stream);
   while (true) {
-    Fragment* frag = pts->proc_on.pop();
-    if (!frag) {
+    FragBatch* batch = in->pop();
+    if (!batch) {
+      in->push(NULL);
       break;
     }
-    process_fragment(frag);
-    pts->proc_out.push(frag);
+    process_batch(*batch, &scratch);
+    out->push(batch);
+  }
+}
+
+/**
+ * This function logs the alignments pruned in the round that just ended. The
+ * parsers count them per round, so this is called before they are reset.
+ * Nothing is pruned in the first round.
+ * @param libs a struct containing the parsers of all libraries.
+ */
+void log_pruning(Librarian& libs) {
+  if (prune_threshold <= 0 || first_round) {
+    return;
+  }
+  size_t num_hits = 0;
+  size_t num_pruned = 0;
+  double pruned_mass = 0;
+  for (size_t l = 0; l < libs.size(); l++) {
+    num_hits += libs[l].map_parser->num_hits();
+    num_pruned += libs[l].map_parser->num_pruned();
+    pruned_mass += libs[l].map_parser->pruned_mass();
   }
+  logger.info("Pruned " SIZE_T_FMT " of " SIZE_T_FMT " alignments (%.2f%%) in "
+              "this round, reassigning %.3g fragments of expected mass.",
+              num_pruned, num_hits,
+              (num_hits) ? 100.0*num_pruned/num_hits : 0.0, pruned_mass);
 }
 
 /**
- * This is the driver function for the main processing thread. This function
- * updates the current fragment mass for libraries, dispatches fragments to be
- * processed once they are passed by the parsing thread, outputs intermediate
- * results, and handles additional online rounds.
+ * This is the driver function for the main processing thread. Fragments arrive
+ * from the parsing thread already numbered and with their masses set. Until
+ * the auxiliary parameters are burned out, this function processes them
+ * serially. Afterwards the processing threads pull batches directly from the
+ * parser, unless intermediate results must be output, in which case fragments
+ * are still dispatched through this thread. Also handles additional online
+ * rounds.
  * @param libs a struct containing pointers to the parameter tables (bias_table,
  *        mismatch_table, fld) and parser for all libraries being processed.
  * @return The total number of fragments processed.
@@ -603,6 +1329,8 @@ void proc_thread(ParseThreadSafety* pts) {
 size_t threaded_calc_abundances(Librarian& libs) {
   logger.info("Processing input fragment alignments...");
   boost::scoped_ptr<boost::thread> bias_update;
+  ProcScratch scratch;
+  scratch.rng.seed(random_seed);
 
   size_t n = 1;
   size_t num_frags = 0;
@@ -612,9 +1340,15 @@ size_t threaded_calc_abundances(Librarian& libs) {
   size_t i = 1;
   size_t j = 6;
 
-  DirectionDetector dir_detector;
-  Fragment* frag;
-  
+  // Exact duplicate fragments are merged only once the auxiliary parameters
+  // are burned out, so that each of them still updates the auxiliary
+  // parameters, and only if nothing needs to see every fragment on its own.
+  bool merge = merge_duplicates && !edit_detect && !calc_covar &&
+               !output_align_prob && !output_align_samp &&
+               !output_running_reads && !num_neighbors &&
+               haplotype_file_name.empty();
+  size_t merge_from = (merge) ? max(burn_in, burn_out) + 1 : 0;
+
   while (true) {
     // Loop through libraries
     for (size_t l = 0; l < libs.size(); l++) {
@@ -622,111 +1356,133 @@ size_t threaded_calc_abundances(Librarian& libs) {
       libs.set_curr(l);
       MapParser& map_parser = *lib.map_parser;
       boost::mutex bu_mut;
+      // With a fixed seed, paces the bias update thread
+      BiasUpdateGate bu_gate;
+      BiasUpdateGate* pace = (fixed_seed) ? &bu_gate : NULL;
       // Used to signal bias update thread
       running = true;
-      ParseThreadSafety pts(max((int)num_threads,10));
+      burned_out = lib.n >= burn_out;
+      size_t lib_start = lib.n;
+      ParseThreadSafety pts(max((int)num_threads,10), n, mass_n);
       boost::thread parse(&MapParser::threaded_parse, &map_parser, &pts,
-                          stop_at, num_neighbors);
+                          stop_at, num_neighbors, merge_from);
       vector<boost::thread*> thread_pool;
-      RobertsFilter frags_seen;
 
-      burned_out = lib.n >= burn_out;
       while(true) {
-        if (lib.n == burn_in) {
-          bias_update.reset(new boost::thread(&TargetTable::asynch_bias_update,
-                                              lib.targ_table, &bu_mut));
-          if (lib.mismatch_table) {
-            (lib.mismatch_table)->activate();
-          }
-        }
-        if (lib.n == burn_out) {
-          if (lib.mismatch_table) {
-            (lib.mismatch_table)->fix();
-          };
-          burned_out = true;
-        }
-        // Start threads once aux parameters are burned out
-        if (burned_out && num_threads && thread_pool.size() == 0) {
+        // Start threads once aux parameters are burned out. They pull directly
+        // from the parser unless this thread must see every fragment, so they
+        // are not started before this thread has passed fragment burn_in and
+        // started the bias update, even if burn-out comes first.
+        if (burned_out && n > burn_in && num_threads &&
+            thread_pool.size() == 0) {
           lib.targ_table->enable_bundle_threadsafety();
+          ThreadSafeFragQueue* in = (output_running_reads) ? &pts.proc_on
+                                                           : &pts.proc_in;
           thread_pool = vector<boost::thread*>(num_threads);
           for (size_t k = 0; k < thread_pool.size(); k++) {
-            thread_pool[k] = new boost::thread(proc_thread, &pts);
+            thread_pool[k] = new boost::thread(proc_thread, in, &pts.proc_out,
+                                               k + 1);
+          }
+          if (!output_running_reads) {
+            break;
           }
         }
 
-        // Pop next parsed fragment and set mass
-        frag = pts.proc_in.pop();
-        if (frag) {
-          frag->mass(mass_n);
-          dir_detector.add_fragment(frag);
-        }
+        // Pop next batch of parsed fragments
+        FragBatch* batch = pts.proc_in.pop();
 
-        // Test that we have not already seen this fragment
-        if (frag && first_round && frags_seen.test_and_push(frag->name())) {
-          logger.severe("Alignments are not properly sorted. Read '%s' has "
-                        "alignments which are non-consecutive.",
-                        frag->name().c_str());
+        // If no more fragments, send stop signal (NULL) to processing threads
+        if (!batch) {
+          if (thread_pool.size()) {
+            pts.proc_on.push(NULL);
+          }
+          break;
         }
 
-        // If multi-threaded and burned out, push to the processing queue
-        if (num_threads && burned_out) {
-          // If no more fragments, send stop signal (NULL) to processing threads
-          if (!frag) {
-            for (size_t k = 0; k < thread_pool.size(); ++k) {
-              pts.proc_on.push(NULL);
+        bool dispatch = thread_pool.size() > 0;
+        // Once burned out, a batch processed on this thread takes the same
+        // path as on the processing threads, unless every fragment must be
+        // seen on its own for the intermediate results.
+        bool whole = !dispatch && burned_out && !output_running_reads;
+
+        foreach (Fragment* frag, *batch) {
+          if (frag->seq_num() == burn_in) {
+            bias_update.reset(new boost::thread(
+                                      &TargetTable::asynch_bias_update,
+                                      lib.targ_table, &bu_mut, pace));
+            if (lib.mismatch_table) {
+              (lib.mismatch_table)->activate();
             }
-            break;
           }
-          pts.proc_on.push(frag);
-        } else {
-          if (!frag) {
-            break;
+          if (frag->seq_num() == burn_out) {
+            if (lib.mismatch_table) {
+              (lib.mismatch_table)->fix();
+            };
+            burned_out = true;
+          }
+          if (pace && bias_update) {
+            // Run the update passes at fixed fragments. At burn-out, the last
+            // pass is made at once so the parameters are final from here on.
+            size_t seq_num = frag->seq_num();
+            if (seq_num >= burn_in &&
+                (seq_num - burn_in) % SEEDED_BIAS_UPDATE_INTERVAL == 0) {
+              bu_gate.step();
+            }
+            if (seq_num == burn_out) {
+              bu_gate.step();
+              bu_gate.step();
+            }
           }
-          {
+
+          if (!dispatch && !whole) {
             // Block the bias update thread from updating the paramater tables
-            // during processing. We don't need to do this during multi-threaded
-            // processing since the parameters are burned out before we start
-            // the threads.
+            // during processing. We don't need to do this during
+            // multi-threaded processing since the parameters are burned out
+            // before we start the threads.
+            boost::unique_lock<boost::mutex> lock(bu_mut);
+            process_fragment(frag, &scratch);
+          }
+
+          // Output intermediate results, if necessary
+          if (output_running_reads && n == i*pow(10.,(double)j)) {
             boost::unique_lock<boost::mutex> lock(bu_mut);
-            process_fragment(frag);
-            pts.proc_out.push(frag);
+            flush_unique_fragments(&scratch);
+            output_results(libs, n, (int)n);
+            if (i++ == 9) {
+              i = 1;
+              j++;
+            }
           }
+          n++;
         }
 
-        // Output intermediate results, if necessary
-        if (output_running_reads && n == i*pow(10.,(double)j)) {
+        if (dispatch) {
+          pts.proc_on.push(batch);
+        } else {
           boost::unique_lock<boost::mutex> lock(bu_mut);
-          output_results(libs, n, (int)n);
-          if (i++ == 9) {
-            i = 1;
-            j++;
+          if (whole) {
+            process_batch(*batch, &scratch);
+          } else {
+            flush_unique_fragments(&scratch);
           }
+          pts.proc_out.push(batch);
         }
-        num_frags++;
-
-        // Output progress
-        if (num_frags % 1000000 == 0) {
-          logger.info("Fragments Processed (%s): %d\tNumber of Bundles: %d.",
-                      lib.in_file_name.c_str(), num_frags,
-                      lib.targ_table->num_bundles());
-          dir_detector.report_if_improper_direction();
-        }
-
-        n++;
-        lib.n++;
-        mass_n += ff_param*log((double)n-1) - log(pow(n,ff_param) - 1);
-        lib.mass_n += ff_param*log((double)lib.n-1) -
-                      log(pow(lib.n,ff_param) - 1);
       }
 
-      // Signal bias update thread to stop
-      running = false;
-
       parse.join();
       foreach(boost::thread* t, thread_pool) {
         t->join();
+        delete t;
       }
 
+      // Signal bias update thread to stop
+      running = false;
+      bu_gate.close();
+
+      n = pts.n;
+      mass_n = pts.mass_n;
+      num_frags += lib.n - lib_start;
+
       lib.targ_table->disable_bundle_threadsafety();
       lib.targ_table->collapse_bundles();
       
@@ -742,6 +1498,7 @@ size_t threaded_calc_abundances(Librarian& libs) {
         output_results(libs, n, (int)remaining_rounds);
       }
 
+      log_pruning(libs);
       logger.info("%d remaining rounds.", remaining_rounds);
       first_round = false;
       last_round = (remaining_rounds==0 && !both);
@@ -758,6 +1515,15 @@ size_t threaded_calc_abundances(Librarian& libs) {
   logger.info("COMPLETED: Processed %d mapped fragments, targets are in %d "
               "bundles.", num_frags, libs[0].targ_table->num_bundles());
 
+  if (mini_batch && !mini_batch_used && !edit_detect && !calc_covar &&
+      !num_neighbors) {
+    logger.warn("The '--mini-batch' option had no effect, since mini-batches "
+                "only start once the auxiliary parameters are final and %d "
+                "fragments have been processed.", (int)MINI_BATCH_WARM_UP);
+  }
+
+  log_pruning(libs);
+
   return num_frags;
 }
 
@@ -806,7 +1572,12 @@ int estimation_main() {
     
     libs[i].in_file_name = file_names[i];
     libs[i].out_file_name = out_map_file_name;
-    libs[i].map_parser.reset(new MapParser(&libs[i], last_round));
+    boost::shared_ptr<const TargetDict> shared_dict;
+    if (i > 0) {
+      // Libraries with matching headers share the first one's dictionary.
+      shared_dict = libs[0].map_parser->targ_dict();
+    }
+    libs[i].map_parser.reset(new MapParser(&libs[i], last_round, shared_dict));
 
     if (param_file_name.size()) {
       libs[i].fld.reset(new LengthDistribution(param_file_name, "Fragment"));
@@ -826,21 +1597,28 @@ int estimation_main() {
                                                     bias_alpha):NULL);
     }
     if (i > 0 &&
-        (libs[i].map_parser->targ_index() != libs[i-1].map_parser->targ_index()
-         || libs[i].map_parser->targ_lengths() !=
-         libs[i-1].map_parser->targ_lengths())) {
+        libs[i].map_parser->targ_dict() != libs[i-1].map_parser->targ_dict()) {
           logger.severe("Alignment file headers do not match for '%s' and '%s'.",
                         file_names[i-1].c_str(), file_names[i].c_str());
         }
   }
-  
+
+  // Targets with identical sequences are collapsed if requested, unless
+  // something needs to tell them apart: their sequences, haplotypes,
+  // neighbors, covariances or the alignments written out.
+  bool collapse = collapse_targets && !edit_detect && !calc_covar &&
+                  !output_align_prob && !output_align_samp && !num_neighbors &&
+                  haplotype_file_name.empty();
+  // No other threads are running yet, so all of them can load the targets.
   boost::shared_ptr<TargetTable> targ_table(
                                   new TargetTable(fasta_file_name,
                                                   haplotype_file_name,
                                                   edit_detect,
-                                                  param_file_name.size(),
+                                                  param_file_name,
+                                                  bias_cache_file_name,
                                                   expr_alpha, expr_alpha_map,
-                                                  &libs));
+                                                  &libs, num_threads + 2,
+                                                  collapse));
   size_t max_target_length = 0;
   for(size_t tid=0; tid < targ_table->size(); tid++) {
     max_target_length = max(max_target_length,
@@ -944,21 +1722,23 @@ int preprocess_main() {
   lib.in_file_name = in_map_file_names;
   lib.out_file_name = "";
   
-  lib.map_parser.reset(new MapParser (&lib, false));
+  lib.map_parser.reset(new MapParser (&lib, false,
+                                      boost::shared_ptr<const TargetDict>()));
   lib.fld.reset(new LengthDistribution(0, 0, 0, 1, 2, 0));
   MarkovModel bias_model(3, 21, 21, 0);
   MismatchTable mismatch_table(0);
-  lib.targ_table.reset(new TargetTable(fasta_file_name, "", 0, 0, 0.0, NULL,
-                                       &libs));
+  lib.targ_table.reset(new TargetTable(fasta_file_name, "", 0, "", "", 0.0,
+                                       NULL, &libs, num_threads + 2, false));
   
   logger.info("Converting targets to Protocol Buffers...");
   fstream targ_out((output_dir + "/targets.pb").c_str(),
                    ios::out | ios::trunc);
   string out_buff;
   proto::Target target_proto;
-  for (TargID id = 0; id < lib.targ_table->size(); ++id) {
+  const TargetDict& targ_dict = *lib.map_parser->targ_dict();
+  for (size_t pos = 0; pos < lib.targ_table->size(); ++pos) {
     target_proto.Clear();
-    Target& targ = *lib.targ_table->get_targ(id);
+    Target& targ = *lib.targ_table->get_targ(targ_dict.header_id(pos));
     target_proto.set_name(targ.name());
     target_proto.set_id((unsigned int)targ.id());
     target_proto.set_length((unsigned int)targ.length());
@@ -973,111 +1753,104 @@ int preprocess_main() {
   ostream frag_out(cout.rdbuf());
   
   size_t num_frags = 0;
-  Fragment* frag;
-  
   ParseThreadSafety pts(10);
   boost::thread parse(&MapParser::threaded_parse, lib.map_parser.get(), &pts,
-                      stop_at, 0);
-  RobertsFilter frags_seen;
+                      stop_at, 0, 0);
   proto::Fragment frag_proto;
   while(true) {
-    frag_proto.Clear();
+    // Pop next batch of parsed fragments
+    FragBatch* batch = pts.proc_in.pop();
     
-    // Pop next parsed fragment and set mass
-    frag = pts.proc_in.pop();
-    
-    if (!frag) {
+    if (!batch) {
       break;
     }
     
-    // Test that we have not already seen this fragment
-    if (frags_seen.test_and_push(frag->name())) {
-      logger.severe("Alignments are not properly sorted. Read '%s' has "
-                    "alignments which are non-consecutive.",
-                    frag->name().c_str());
-    }
+    foreach (Fragment* frag, *batch) {
+      frag_proto.Clear();
     
-    frag_proto.set_paired(frag->paired());
+      frag_proto.set_paired(frag->paired());
     
-    vector<char> ref_left_mm_indices;
-    vector<char> ref_left_mm_seq;
-    vector<char> ref_left_mm_ref;
-    vector<char> ref_right_mm_indices;
-    vector<char> ref_right_mm_seq;
-    vector<char> ref_right_mm_ref;
-    bool ref_left_first = false;
+      vector<char> ref_left_mm_indices;
+      vector<char> ref_left_mm_seq;
+      vector<char> ref_left_mm_ref;
+      vector<char> ref_right_mm_indices;
+      vector<char> ref_right_mm_seq;
+      vector<char> ref_right_mm_ref;
+      bool ref_left_first = false;
     
-    for (size_t i = 0; i < frag->num_hits(); ++i) {
-      FragHit& fh = *(*frag)[i];
-      proto::FragmentAlignment& align_proto = *frag_proto.add_alignments();
-      align_proto.set_target_id((unsigned int)fh.target_id());
+      for (size_t i = 0; i < frag->num_hits(); ++i) {
+        FragHit& fh = *(*frag)[i];
+        proto::FragmentAlignment& align_proto = *frag_proto.add_alignments();
+        align_proto.set_target_id((unsigned int)fh.target_id());
       
-      vector<char> left_mm_indices;
-      vector<char> left_mm_seq;
-      vector<char> left_mm_ref;
-      vector<char> right_mm_indices;
-      vector<char> right_mm_seq;
-      vector<char> right_mm_ref;
+        vector<char> left_mm_indices;
+        vector<char> left_mm_seq;
+        vector<char> left_mm_ref;
+        vector<char> right_mm_indices;
+        vector<char> right_mm_seq;
+        vector<char> right_mm_ref;
       
-      mismatch_table.get_indices(fh, left_mm_indices, left_mm_seq, left_mm_ref,
-                                 right_mm_indices, right_mm_seq, right_mm_ref);
+        mismatch_table.get_indices(fh, left_mm_indices, left_mm_seq,
+                                   left_mm_ref, right_mm_indices, right_mm_seq,
+                                   right_mm_ref);
       
-      if (i == 0) {
-        ref_left_mm_indices = left_mm_indices;
-        ref_left_mm_seq = left_mm_seq;
-        ref_left_mm_ref = left_mm_ref;
-        ref_right_mm_indices = right_mm_indices;
-        ref_right_mm_seq = right_mm_seq;
-        ref_right_mm_ref = right_mm_ref;
-      }
+        if (i == 0) {
+          ref_left_mm_indices = left_mm_indices;
+          ref_left_mm_seq = left_mm_seq;
+          ref_left_mm_ref = left_mm_ref;
+          ref_right_mm_indices = right_mm_indices;
+          ref_right_mm_seq = right_mm_seq;
+          ref_right_mm_ref = right_mm_ref;
+        }
       
-      ReadHit* read_l = fh.left_read();
-      if (read_l) {
-        if (i==0) { ref_left_first = read_l->first; }
-        proto::ReadAlignment& read_proto = *align_proto.mutable_read_l();
-        read_proto.set_first(read_l->first);
-        read_proto.set_left_pos(read_l->left);
-        read_proto.set_right_pos(read_l->right-1);
-        if (i == 0 || read_l->first != ref_left_first ||
-            left_mm_indices != ref_left_mm_indices ||
-            left_mm_seq != ref_left_mm_seq ||
-            left_mm_ref != ref_left_mm_ref) {
-          read_proto.set_mismatch_indices(string(left_mm_indices.begin(),
-                                                 left_mm_indices.end()));
-          read_proto.set_mismatch_nucs(string(left_mm_seq.begin(),
-                                              left_mm_seq.end()));
+        ReadHit* read_l = fh.left_read();
+        if (read_l) {
+          if (i==0) { ref_left_first = read_l->first; }
+          proto::ReadAlignment& read_proto = *align_proto.mutable_read_l();
+          read_proto.set_first(read_l->first);
+          read_proto.set_left_pos(read_l->left);
+          read_proto.set_right_pos(read_l->right-1);
+          if (i == 0 || read_l->first != ref_left_first ||
+              left_mm_indices != ref_left_mm_indices ||
+              left_mm_seq != ref_left_mm_seq ||
+              left_mm_ref != ref_left_mm_ref) {
+            read_proto.set_mismatch_indices(string(left_mm_indices.begin(),
+                                                   left_mm_indices.end()));
+            read_proto.set_mismatch_nucs(string(left_mm_seq.begin(),
+                                                left_mm_seq.end()));
+          }
         }
-      }
       
-      ReadHit* read_r = fh.right_read();
-      if (read_r) {
-        if (i==0) { ref_left_first = !read_r->first; }
-        proto::ReadAlignment& read_proto = *align_proto.mutable_read_r();
-        read_proto.set_first(read_r->first);
-        read_proto.set_left_pos(read_r->left);
-        read_proto.set_right_pos(read_r->right-1);
-        if (i == 0 || read_r->first == ref_left_first ||
-            right_mm_indices != ref_right_mm_indices ||
-            right_mm_seq != ref_right_mm_seq ||
-            right_mm_ref != ref_right_mm_ref) {
-          read_proto.set_mismatch_indices(string(right_mm_indices.begin(),
-                                                 right_mm_indices.end()));
-          read_proto.set_mismatch_nucs(string(right_mm_seq.begin(),
-                                              right_mm_seq.end()));
+        ReadHit* read_r = fh.right_read();
+        if (read_r) {
+          if (i==0) { ref_left_first = !read_r->first; }
+          proto::ReadAlignment& read_proto = *align_proto.mutable_read_r();
+          read_proto.set_first(read_r->first);
+          read_proto.set_left_pos(read_r->left);
+          read_proto.set_right_pos(read_r->right-1);
+          if (i == 0 || read_r->first == ref_left_first ||
+              right_mm_indices != ref_right_mm_indices ||
+              right_mm_seq != ref_right_mm_seq ||
+              right_mm_ref != ref_right_mm_ref) {
+            read_proto.set_mismatch_indices(string(right_mm_indices.begin(),
+                                                   right_mm_indices.end()));
+            read_proto.set_mismatch_nucs(string(right_mm_seq.begin(),
+                                                right_mm_seq.end()));
+          }
         }
       }
-    }
-    frag_proto.SerializeToString(&out_buff);
-    frag_out << base64_encode(out_buff) << endl;
+      frag_proto.SerializeToString(&out_buff);
+      frag_out << base64_encode(out_buff) << endl;
     
-    pts.proc_out.push(frag);
-    
-    num_frags++;
-    
-    // Output progress
-    if (num_frags % 1000000 == 0) {
-      logger.info("Fragments Processed: %d", num_frags);
+      num_frags++;
+      
+      // Output progress
+      if (num_frags % 1000000 == 0) {
+        logger.info("Fragments Processed: %d", num_frags);
+      }
     }
+    
+    pts.proc_out.push(batch);
   }
   
   parse.join();
@@ -1090,7 +1863,6 @@ int preprocess_main() {
 int main (int argc, char ** argv)
 {
 
-  srand((unsigned int)time(NULL));
   int parse_ret = parse_options(argc,argv);
   if (parse_ret) {
     return parse_ret;
@@ -1101,6 +1873,12 @@ int main (int argc, char ** argv)
     return preprocess_main();
   }
 #endif
+
+  if (build_index) {
+    logger.info("Building target index...");
+    TargetIndex::build(fasta_file_name, bias_model_order, num_threads + 2);
+    return 0;
+  }
   
   return estimation_main();
 }
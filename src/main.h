@@ -17,6 +17,7 @@
 #include <cmath>
 #include <cassert>
 #include <limits>
+#include <string>
 
 #define foreach BOOST_FOREACH
 
@@ -38,6 +39,43 @@ extern bool running;
  * certain parameters.
  */
 extern bool burned_out;
+/**
+ * A global bool that is true during the first round of processing. Used by the
+ * parser to decide whether the sortedness of the input should be verified.
+ */
+extern bool first_round;
+/**
+ * A global double for the forgetting factor parameter, which controls the
+ * growth of the fragment mass.
+ */
+extern double ff_param;
+/**
+ * A global double for the target false positive rate of the Bloom filters used
+ * by the parser to check that alignments are grouped by read name.
+ */
+extern double sort_check_fp_rate;
+/**
+ * A global size_t specifying the number of threads used to parse SAM input.
+ * The input is parsed serially if less than 2.
+ */
+extern size_t num_parse_threads;
+/**
+ * A global double specifying how far (logged) below the best hit of a fragment
+ * the likelihood of a hit may fall before it is pruned after burn-out. Pruning
+ * is disabled if 0.
+ */
+extern double prune_threshold;
+/**
+ * A global size_t specifying the seed for the random number generators. Each
+ * processing thread and output writer draws from its own stream of this seed.
+ */
+extern size_t random_seed;
+/**
+ * A global string specifying the path to a file grouping targets into
+ * clusters, by which they are renumbered so that targets in the same cluster
+ * are stored together. Targets keep their header order if empty.
+ */
+extern std::string cluster_file_name;
 /**
  * A global bool that is true when edit detection is enabled
  */
@@ -12,11 +12,186 @@
 #include "targets.h"
 #include "threadsafety.h"
 #include "library.h"
-#include <boost/algorithm/string/predicate.hpp>
+#include "robertsfilter.h"
+#include <boost/functional/hash.hpp>
 
 using namespace std;
 
 const size_t BUFF_SIZE = 9999;
+const size_t SAM_CHUNK_SIZE = 1 << 20;
+
+/**
+ * A helper function that advances a logged fragment mass by one fragment
+ * according to the forgetting factor. The mass has no closed form for general
+ * forgetting factors, but it is constant when the forgetting factor is 1 (as in
+ * additional batch rounds), in which case no work is done.
+ * @param mass_n the logged mass of fragment n-1.
+ * @param n the number of the fragment whose mass is returned.
+ * @return The logged mass of fragment n.
+ */
+inline double next_mass(double mass_n, size_t n) {
+  if (ff_param == 1) {
+    return mass_n;
+  }
+  return mass_n + ff_param*log((double)n-1) - log(pow(n,ff_param) - 1);
+}
+
+/**
+ * A helper function that calculates the number of characters of a read name
+ * that identify its fragment, ignoring a trailing mate suffix.
+ * @param name a pointer to the read name.
+ * @param len the number of characters in the read name.
+ * @return The number of leading characters of the name to use.
+ */
+inline size_t frag_name_len(const char* name, size_t len) {
+  if (len >= 2 && (name[len-1] == '\1' || name[len-1] == '\2')) {
+    return len - 2;
+  }
+  return len;
+}
+
+/**
+ * A helper function that null-terminates the tab-delimited field starting at
+ * the given position. Unlike strtok, it keeps no state and is thread-safe.
+ * @param field a pointer to the start of the field.
+ * @return A pointer to the start of the next field, or NULL if this is the
+ *         last field.
+ */
+inline char* split_field(char* field) {
+  char* tab = strchr(field, '\t');
+  if (!tab) {
+    return NULL;
+  }
+  *tab = '\0';
+  return tab + 1;
+}
+
+/**
+ * A helper function that checks whether two hits of a fragment align it to the
+ * same positions in the same orientation.
+ * @param h1 one of the hits.
+ * @param h2 the other hit.
+ * @return True iff the hits have the same alignment.
+ */
+inline bool same_alignment(const FragHit& h1, const FragHit& h2) {
+  if (h1.pair_status() != h2.pair_status() || h1.left() != h2.left() ||
+      h1.right() != h2.right()) {
+    return false;
+  }
+  const ReadHit* r1 = h1.first_read();
+  const ReadHit* r2 = h2.first_read();
+  return r1->left == r2->left && r1->reversed == r2->reversed;
+}
+
+/**
+ * A helper function that drops the hits of a fragment that have become
+ * identical to an earlier one after being reassigned from a collapsed target
+ * to its representative.
+ * @param frag the fragment whose hits were reassigned.
+ */
+void drop_collapsed_hits(Fragment& frag) {
+  frag.sort_hits();
+  const vector<FragHit*>& hits = frag.hits();
+  vector<bool> drop(hits.size(), false);
+  size_t run_start = 0;
+  for (size_t i = 1; i < hits.size(); ++i) {
+    if (hits[i]->target_id() != hits[run_start]->target_id()) {
+      run_start = i;
+      continue;
+    }
+    for (size_t j = run_start; j < i && !drop[i]; ++j) {
+      drop[i] = same_alignment(*hits[i], *hits[j]);
+    }
+  }
+  frag.drop_hits(drop);
+}
+
+/**
+ * A helper function that hashes the alignment of a read to its target.
+ * @param r the read hit to hash.
+ * @param seed the hash value to combine the read into.
+ */
+void hash_read(const ReadHit* r, size_t& seed) {
+  if (!r) {
+    boost::hash_combine(seed, 0);
+    return;
+  }
+  boost::hash_combine(seed, r->targ_id);
+  boost::hash_combine(seed, r->left);
+  boost::hash_combine(seed, r->right);
+  boost::hash_combine(seed, r->reversed);
+  boost::hash_combine(seed, r->seq.hash());
+}
+
+/**
+ * A helper function that hashes the alignments of a fragment, so that
+ * fragments that may be duplicates can be found quickly.
+ * @param frag the fragment to hash.
+ * @return A hash value that is equal for fragments with the same alignments.
+ */
+size_t fragment_hash(const Fragment& frag) {
+  size_t seed = frag.num_hits();
+  foreach (const FragHit* h, frag.hits()) {
+    hash_read(h->first_read(), seed);
+    hash_read(h->second_read(), seed);
+  }
+  return seed;
+}
+
+/**
+ * A helper function that checks whether two lists of indels are identical.
+ */
+inline bool same_indels(const vector<Indel>& i1, const vector<Indel>& i2) {
+  if (i1.size() != i2.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < i1.size(); ++i) {
+    if (i1[i].pos != i2[i].pos || i1[i].len != i2[i].len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * A helper function that checks whether two reads have the same sequence and
+ * the same alignment to the same target, including their indels.
+ * @param r1 one of the reads (may be NULL).
+ * @param r2 the other read (may be NULL).
+ * @return True iff the reads are aligned identically.
+ */
+bool same_read(const ReadHit* r1, const ReadHit* r2) {
+  if (!r1 || !r2) {
+    return r1 == r2;
+  }
+  return r1->targ_id == r2->targ_id && r1->left == r2->left &&
+         r1->right == r2->right && r1->reversed == r2->reversed &&
+         r1->seq == r2->seq && same_indels(r1->inserts, r2->inserts) &&
+         same_indels(r1->deletes, r2->deletes);
+}
+
+/**
+ * A helper function that checks whether two fragments are exact duplicates:
+ * their reads have the same sequences and the same alignments, in the same
+ * order. Such fragments have identical likelihoods under every parameter.
+ * @param f1 one of the fragments.
+ * @param f2 the other fragment.
+ * @return True iff the fragments are duplicates.
+ */
+bool same_fragment(const Fragment& f1, const Fragment& f2) {
+  if (f1.num_hits() != f2.num_hits()) {
+    return false;
+  }
+  for (size_t i = 0; i < f1.num_hits(); ++i) {
+    const FragHit& h1 = *f1.hits()[i];
+    const FragHit& h2 = *f2.hits()[i];
+    if (!same_read(h1.first_read(), h2.first_read()) ||
+        !same_read(h1.second_read(), h2.second_read())) {
+      return false;
+    }
+  }
+  return true;
+}
 
 /**
  * A helper functon that calculates the length of the reference spanned by the
@@ -93,8 +268,36 @@ size_t cigar_length(vector<BamTools::CigarOp>& cigar_vec,
   return j;
 }
 
-MapParser::MapParser(Library* lib, bool write_active)
-    : _lib(lib), _write_active(write_active) {
+void Parser::init_targ_dict(const vector<string>& names,
+                            const vector<size_t>& lengths,
+                            const boost::shared_ptr<const TargetDict>&
+                                shared_dict) {
+  if (shared_dict && shared_dict->matches(names, lengths)) {
+    _targ_dict = shared_dict;
+  } else {
+    _targ_dict.reset(new TargetDict(names, lengths, cluster_file_name));
+  }
+}
+
+/**
+ * A helper function that derives the seed of an output writer from the global
+ * seed and the output file name, so that each library samples independently.
+ * @param out_file the name of the output file.
+ * @return The seed for the writer's random number generator.
+ */
+inline boost::uint64_t writer_seed(const string& out_file) {
+  return (boost::uint64_t)random_seed ^ boost::hash<string>()(out_file);
+}
+
+MapParser::MapParser(Library* lib, bool write_active,
+                     const boost::shared_ptr<const TargetDict>& shared_dict)
+    : _lib(lib),
+      _write_active(write_active),
+      _num_hits(0),
+      _num_pruned(0),
+      _pruned_mass(0),
+      _dup_table(2 * FRAG_BATCH_SIZE, std::make_pair(0, (Fragment*)NULL)) {
+  _dup_slots.reserve(FRAG_BATCH_SIZE);
 
   string in_file = lib->in_file_name;
   string out_file = lib->out_file_name;
@@ -102,21 +305,24 @@ MapParser::MapParser(Library* lib, bool write_active)
   if (in_file.size() == 0) {
     logger.info("No alignment file specified. Expecting streaming input on "
                 "stdin...\n");
-    _parser.reset(new SAMParser(&cin));
+    _parser.reset(new SAMParser(&cin, &_frag_pool, num_parse_threads,
+                                shared_dict));
     is_sam = true;
   } else {
     logger.info("Attempting to read '%s' in BAM format...", in_file.c_str());
     BamTools::BamReader* reader = new BamTools::BamReader();
     if (reader->Open(in_file)) {
       logger.info("Parsing BAM header...");
-      _parser.reset(new BAMParser(reader));
+      _parser.reset(new BAMParser(reader, &_frag_pool, out_file.size() > 0,
+                                  shared_dict));
       if (out_file.size()) {
         out_file += ".bam";
         BamTools::BamWriter* writer = new BamTools::BamWriter();
         if (writer->Open(out_file, reader->GetHeader(),
                          reader->GetReferenceData())) {
           bool sample = out_file.substr(out_file.length()-8,4) == "samp";
-          _writer.reset(new BAMWriter(writer, sample));
+          _writer.reset(new BAMWriter(writer, sample,
+                                      writer_seed(out_file)));
         } else {
           logger.severe("Unable to open output BAM file '%s'.",
                         out_file.c_str());
@@ -129,7 +335,8 @@ MapParser::MapParser(Library* lib, bool write_active)
       if (!ifs->is_open()) {
         logger.severe("Unable to open input SAM file '%s'.", in_file.c_str());
       }
-      _parser.reset(new SAMParser(ifs));
+      _parser.reset(new SAMParser(ifs, &_frag_pool, num_parse_threads,
+                                  shared_dict));
       is_sam = true;
     }
   }
@@ -142,137 +349,250 @@ MapParser::MapParser(Library* lib, bool write_active)
     }
     *ofs << _parser->header();
     bool sample = out_file.substr(out_file.length()-8,4) == "samp";
-    _writer.reset(new SAMWriter(ofs, sample));
+    _writer.reset(new SAMWriter(ofs, sample, writer_seed(out_file)));
+  }
+}
+
+void MapParser::write_batch(FragBatch* batch) {
+  if (prune_threshold > 0) {
+    foreach (const Fragment* frag, *batch) {
+      size_t k = frag->multiplicity();
+      _num_hits += k * (frag->num_hits() + frag->num_dropped());
+      _num_pruned += k * frag->num_pruned();
+      _pruned_mass += k * frag->pruned_mass();
+    }
   }
+  if (_writer && _write_active) {
+    foreach (Fragment* frag, *batch) {
+      _writer->write_fragment(*frag);
+    }
+  }
+  _frag_pool.release(batch);
 }
 
 void MapParser::threaded_parse(ParseThreadSafety* thread_safety_p,
                                size_t stop_at,
-                               size_t num_neighbors) {
+                               size_t num_neighbors,
+                               size_t merge_from) {
   ParseThreadSafety& pts = *thread_safety_p;
   bool fragments_remain = true;
   size_t n = 0;
   size_t still_out = 0;
+  size_t num_merged = 0;
 
   TargetTable& targ_table = *(_lib->targ_table);
+  Library& lib = *_lib;
+  RobertsFilter frags_seen(DEFAULT_LOC_SIZE, DEFAULT_GLOB_SIZE,
+                           sort_check_fp_rate);
 
   while (!stop_at || n < stop_at) {
-    Fragment* frag = NULL;
-    while (fragments_remain) {
-      frag = new Fragment(_lib);
-      fragments_remain = _parser->next_fragment(*frag);
-      if (frag->num_hits()) {
+    FragBatch* batch = _frag_pool.new_batch();
+    batch->reserve(FRAG_BATCH_SIZE);
+    for (size_t i = 0; i < _dup_slots.size(); ++i) {
+      _dup_table[_dup_slots[i]].second = NULL;
+    }
+    _dup_slots.clear();
+    while (batch->size() < FRAG_BATCH_SIZE && (!stop_at || n < stop_at)) {
+      Fragment* frag = NULL;
+      while (fragments_remain) {
+        frag = _frag_pool.new_fragment(_lib);
+        fragments_remain = _parser->next_fragment(*frag);
+        if (frag->num_hits()) {
+          break;
+        }
+        _frag_pool.release(frag);
+        frag = NULL;
+      }
+      if (!frag) {
         break;
       }
-      delete frag;
-      frag = NULL;
-    }
-    for (size_t i = 0; frag && i < frag->hits().size(); ++i) {
-      FragHit& m = *(frag->hits()[i]);
-      
-      if (m.first_read() && m.first_read()->seq.length() > max_read_len) {
-        logger.severe("Length of first read for fragment '%s' is longer than "
-                      "maximum allowed read length (%d vs. %d). Increase the "
-                      "limit using the '--max-read-len,L' option.",
-                      m.frag_name().c_str(),  m.first_read()->seq.length(),
-                      max_read_len);
-      }
-      if (m.second_read() && m.second_read()->seq.length() > max_read_len) {
-        logger.severe("Length of second read for fragment '%s' is longer than "
-                      "maximum allowed read length (%d vs. %d). Increase the "
-                      "limit using the '--max-read-len,L' option.",
-                      m.frag_name().c_str(),  m.second_read()->seq.length(),
-                      max_read_len);
-      }
-      
-      Target* t = targ_table.get_targ(m.target_id());
-      if (!t) {
-        logger.severe("Target sequence at index '%s' not found. Verify that it "
-                      "is in the SAM/BAM header and FASTA file.",
-                      m.target_id());
-      }
-      m.target(t);
-      assert(t->id() == m.target_id());
-      
-      // Add num_neighbors targets on either side to the neighbors list.
-      // Used for experimental feature.
-      vector<const Target*> neighbors;
-      for (TargID j = 1; j <= num_neighbors;  j++) {
-        if (j <= m.target_id()) {
-          neighbors.push_back(targ_table.get_targ(m.target_id() - j));
+      bool reassigned = false;
+      for (size_t i = 0; i < frag->hits().size(); ++i) {
+        FragHit& m = *(frag->hits()[i]);
+        TargID rep_id = targ_table.representative(m.target_id());
+        if (rep_id != m.target_id()) {
+          m.target_id(rep_id);
+          reassigned = true;
+        }
+
+        if (m.first_read() && m.first_read()->seq.length() > max_read_len) {
+          logger.severe("Length of first read for fragment '%s' is longer "
+                        "than maximum allowed read length (%d vs. %d). "
+                        "Increase the limit using the '--max-read-len,L' "
+                        "option.", frag->name().c_str(),
+                        m.first_read()->seq.length(), max_read_len);
+        }
+        if (m.second_read() && m.second_read()->seq.length() > max_read_len) {
+          logger.severe("Length of second read for fragment '%s' is longer "
+                        "than maximum allowed read length (%d vs. %d). "
+                        "Increase the limit using the '--max-read-len,L' "
+                        "option.", frag->name().c_str(),
+                        m.second_read()->seq.length(), max_read_len);
+        }
+
+        Target* t = targ_table.get_targ(m.target_id());
+        if (!t) {
+          logger.severe("Target sequence at index '%s' not found. Verify that "
+                        "it is in the SAM/BAM header and FASTA file.",
+                        m.target_id());
         }
-        if (j + m.target_id() < targ_table.size()) {
-          neighbors.push_back(targ_table.get_targ(m.target_id() + j));
+        m.target(t);
+        assert(t->id() == m.target_id());
+
+        // Add num_neighbors targets on either side in the header to the
+        // neighbors list. Used for experimental feature.
+        vector<const Target*> neighbors;
+        const TargetDict& targ_dict = *_parser->targ_dict();
+        size_t pos = targ_dict.header_pos(m.target_id());
+        for (TargID j = 1; j <= num_neighbors;  j++) {
+          if (j <= pos) {
+            neighbors.push_back(targ_table.get_targ(
+                targ_dict.header_id(pos - j)));
+          }
+          if (j + pos < targ_table.size()) {
+            neighbors.push_back(targ_table.get_targ(
+                targ_dict.header_id(pos + j)));
+          }
         }
+        m.neighbors(neighbors);
       }
-      m.neighbors(neighbors);
-    }
-    boost::scoped_ptr<Fragment> done_frag(pts.proc_out.pop(false));
-    while (done_frag) {
-      if (_writer && _write_active) {
-        _writer->write_fragment(*done_frag);
+      if (reassigned) {
+        drop_collapsed_hits(*frag);
+      }
+
+      // Test that we have not already seen this fragment
+      if (first_round && frags_seen.test_and_push(frag->name_key(),
+                                                   frag->name())) {
+        logger.severe("Alignments are not properly sorted. Read '%s' has "
+                      "alignments which are non-consecutive.",
+                      frag->name().c_str());
       }
+      _dir_detector.add_fragment(frag);
+
+      // Number the fragment and set its masses
+      frag->seq_num(lib.n);
+      frag->mass(pts.mass_n);
+      frag->lib_mass(lib.mass_n);
+      pts.n++;
+      lib.n++;
+      pts.mass_n = next_mass(pts.mass_n, pts.n);
+      lib.mass_n = next_mass(lib.mass_n, lib.n);
+
+      // Merge an exact duplicate of a fragment earlier in the batch into it
+      // instead of processing it again.
+      Fragment* dup = NULL;
+      if (merge_from && frag->seq_num() >= merge_from) {
+        size_t key = fragment_hash(*frag);
+        size_t mask = _dup_table.size() - 1;
+        size_t slot = key & mask;
+        while (_dup_table[slot].second) {
+          if (_dup_table[slot].first == key &&
+              same_fragment(*_dup_table[slot].second, *frag)) {
+            dup = _dup_table[slot].second;
+            break;
+          }
+          slot = (slot + 1) & mask;
+        }
+        if (!dup) {
+          _dup_table[slot] = std::make_pair(key, frag);
+          _dup_slots.push_back(slot);
+        }
+      }
+      if (dup) {
+        dup->add_duplicate(frag->mass(), frag->lib_mass());
+        _frag_pool.release(frag);
+        num_merged++;
+      } else {
+        batch->push_back(frag);
+      }
+      n++;
+
+      // Output progress
+      if (n % 1000000 == 0) {
+        logger.info("Fragments Processed (%s): %d\tNumber of Bundles: %d.",
+                    lib.in_file_name.c_str(), n, targ_table.num_bundles());
+        _dir_detector.report_if_improper_direction();
+      }
+    }
+
+    FragBatch* done_batch = pts.proc_out.pop(false);
+    while (done_batch) {
+      write_batch(done_batch);
       still_out--;
-      done_frag.reset(pts.proc_out.pop(false));
+      done_batch = pts.proc_out.pop(false);
     }
 
-    if (!frag) {
+    if (batch->empty()) {
+      _frag_pool.release(batch);
       break;
     }
 
-    pts.proc_in.push(frag);
-    n++;
+    // Limit the number of batches in flight so that no queue can fill and
+    // block a thread the parser is waiting on.
+    while (still_out >= pts.proc_out.max_size()) {
+      write_batch(pts.proc_out.pop(true));
+      still_out--;
+    }
+
+    pts.proc_in.push(batch);
     still_out++;
   }
 
+  if (num_merged) {
+    logger.info("Merged %d exact duplicate fragments in '%s'.", num_merged,
+                lib.in_file_name.c_str());
+  }
+
   pts.proc_in.push(NULL);
 
   while (still_out) {
-    boost::scoped_ptr<Fragment> done_frag(pts.proc_out.pop(true));
-    if (_writer && _write_active) {
-      _writer->write_fragment(*done_frag);
-    }
+    write_batch(pts.proc_out.pop(true));
     still_out--;
   }
 }
 
-BAMParser::BAMParser(BamTools::BamReader* reader) : _reader(reader) {
+BAMParser::BAMParser(BamTools::BamReader* reader, FragPool* pool,
+                     bool keep_alignments,
+                     const boost::shared_ptr<const TargetDict>& shared_dict)
+    : _reader(reader), _keep_alignments(keep_alignments) {
+  _pool = pool;
   BamTools::BamAlignment a;
 
-  size_t index = 0;
+  vector<string> names;
+  vector<size_t> lengths;
   foreach(const BamTools::RefData& ref, _reader->GetReferenceData()) {
-    if (_targ_index.count(ref.RefName)) {
-      logger.severe("Target '%s' appears multiple times in BAM header.",
-                    ref.RefName.c_str());
-    }
-    _targ_index[ref.RefName] = index++;
-    _targ_lengths[ref.RefName] = ref.RefLength;
+    names.push_back(ref.RefName);
+    lengths.push_back(ref.RefLength);
   }
+  init_targ_dict(names, lengths, shared_dict);
 
   // Get first valid ReadHit
-  _read_buff = new ReadHit();
+  _read_buff = _pool->new_read_hit();
   do {
-    if (!_reader->GetNextAlignment(a)) {
+    if (!_reader->GetNextAlignmentCore(a)) {
       logger.severe("Input BAM file contains no valid alignments.");
     }
   } while(!map_end_from_alignment(a));
+  _name_buff.assign(a.Name, 0, _read_buff->name_key.len);
 }
 
 bool BAMParser::next_fragment(Fragment& nf) {
+  nf.name(_name_buff);
   nf.add_map_end(_read_buff);
 
   BamTools::BamAlignment a;
-  _read_buff = new ReadHit();
+  _read_buff = _pool->new_read_hit();
 
   while(true) {
-    if (!_reader->GetNextAlignment(a)) {
+    if (!_reader->GetNextAlignmentCore(a)) {
       return false;
     } else if (!map_end_from_alignment(a)) {
       continue;
     } else if (!nf.add_map_end(_read_buff)) {
+      _name_buff.assign(a.Name, 0, _read_buff->name_key.len);
       return true;
     }
-    _read_buff = new ReadHit();
+    _read_buff = _pool->new_read_hit();
   }
 }
 
@@ -311,19 +631,24 @@ bool BAMParser::map_end_from_alignment(BamTools::BamAlignment& a) {
     return false;
   }
     
-  r.name = a.Name;
-  if (boost::algorithm::ends_with(r.name, "\1") ||
-      boost::algorithm::ends_with(r.name, "\2")) {
-    r.name = r.name.substr(r.name.size()-2);
+  // Only decode the name, sequence and CIGAR of records that pass the core
+  // filters.
+  if (!a.BuildCharData()) {
+    return false;
   }
 
+  r.name_key = NameKey(a.Name.c_str(),
+                       frag_name_len(a.Name.c_str(), a.Name.size()));
+
   r.reversed = is_reversed;
   r.first = !is_paired || a.IsFirstMate();
-  r.targ_id = a.RefID;
+  r.targ_id = _targ_dict->header_id(a.RefID);
   r.left = a.Position;
   r.mate_l = a.MatePosition;
   r.seq.set(a.QueryBases, is_reversed);
-  r.bam = a;
+  if (_keep_alignments) {
+    r.bam = a;
+  }
   r.right = r.left + cigar_length(a.CigarData, r.inserts, r.deletes);
   
   foreach (Indel& indel, r.inserts) {
@@ -345,22 +670,31 @@ void BAMParser::reset() {
 
   // Get first valid FragHit
   BamTools::BamAlignment a;
-  delete _read_buff;
-  _read_buff = new ReadHit();
   do {
-    _reader->GetNextAlignment(a);
+    _reader->GetNextAlignmentCore(a);
   } while(!map_end_from_alignment(a));
+  _name_buff.assign(a.Name, 0, _read_buff->name_key.len);
 }
 
-SAMParser::SAMParser(istream* in) {
-  _in = in;
+SAMParser::SAMParser(istream* in, FragPool* pool, size_t num_threads,
+                     const boost::shared_ptr<const TargetDict>& shared_dict)
+    : _in(in),
+      _line_buff(BUFF_SIZE),
+      _line(NULL),
+      _eof(false),
+      _num_threads(num_threads),
+      _chunk(NULL),
+      _chunk_pos(0),
+      _stopping(false) {
+  _pool = pool;
+  _read_buff = NULL;
 
-  char line_buff[BUFF_SIZE];
-  _read_buff = new ReadHit();
+  char* line_buff = &_line_buff[0];
   _header = "";
 
   // Parse header
-  size_t index = 0;
+  vector<string> names;
+  vector<size_t> lengths;
   while(_in->good()) {
     _in->getline(line_buff, BUFF_SIZE-1, '\n');
     if (line_buff[0] != '@') {
@@ -374,53 +708,262 @@ SAMParser::SAMParser(istream* in) {
     if (idx!=string::npos) {
       string name = str.substr(idx+3);
       name = name.substr(0,name.find_first_of("\n\t "));
-      if (_targ_index.count(name)) {
-        logger.severe("Target '%s' appears multiple times in SAM header.",
-                      str.c_str());
-      }
-      _targ_index[name] = index++;
+      names.push_back(name);
+      lengths.push_back(0);
       idx = str.find("LN:");
       if (idx != string::npos) {
         string len = str.substr(idx+3);
         len = len.substr(0,len.find_first_of("\n\t "));
-        _targ_lengths[name] = atoi(len.c_str());
+        lengths.back() = atoi(len.c_str());
       }
     }
   }
+  init_targ_dict(names, lengths, shared_dict);
+
+  if (_num_threads > 1) {
+    for (size_t i = 0; i < _num_threads; ++i) {
+      _threads.push_back(new boost::thread(&SAMParser::parse_chunks, this));
+    }
+  }
 
   // Load first aligned read
-  while(!map_end_from_line(line_buff)) {
-    if (!_in->good()) {
-      logger.severe("Input SAM file contains no valid alignments.");
+  _carry = line_buff;
+  load_first();
+}
+
+SAMParser::~SAMParser() {
+  if (_threads.size()) {
+    drain();
+    {
+      boost::unique_lock<boost::mutex> lock(_chunk_mut);
+      _stopping = true;
+    }
+    _todo_cond.notify_all();
+    foreach (boost::thread* t, _threads) {
+      t->join();
+      delete t;
     }
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
   }
+  foreach (SAMChunk* chunk, _free_chunks) {
+    foreach (ReadHit* r, chunk->hits) {
+      if (r) {
+        _pool->release(r);
+      }
+    }
+    delete chunk;
+  }
+  if (_read_buff) {
+    _pool->release(_read_buff);
+  }
+}
+
+void SAMParser::load_first() {
+  if (_num_threads > 1) {
+    // The carried line is complete, so it must be terminated before the next
+    // chunk is appended to it.
+    _carry += "\n";
+  }
+  if (!next_map_end()) {
+    logger.severe("Input SAM file contains no valid alignments.");
+  }
+  _name_buff.assign(_line, _read_buff->name_key.len);
 }
 
 bool SAMParser::next_fragment(Fragment& nf) {
+  nf.name(_name_buff);
   nf.add_map_end(_read_buff);
+  _read_buff = NULL;
 
-  _read_buff = new ReadHit();
-  char line_buff[BUFF_SIZE];
+  while (next_map_end()) {
+    if (!nf.add_map_end(_read_buff)) {
+      // The parsed line starts with the null-terminated read name.
+      _name_buff.assign(_line, _read_buff->name_key.len);
+      return true;
+    }
+    _read_buff = NULL;
+  }
+  return false;
+}
 
-  while(_in->good()) {
-    _in->getline (line_buff, BUFF_SIZE-1, '\n');
-    if (!map_end_from_line(line_buff)) {
-      continue;
+bool SAMParser::next_map_end() {
+  if (_num_threads < 2) {
+    if (!_read_buff) {
+      _read_buff = _pool->new_read_hit();
     }
-    if (!nf.add_map_end(_read_buff)) {
-      break;
+    char* line_buff = &_line_buff[0];
+    while (true) {
+      if (_carry.size()) {
+        strncpy(line_buff, _carry.c_str(), BUFF_SIZE-1);
+        _carry.clear();
+      } else if (_in->good()) {
+        _in->getline(line_buff, BUFF_SIZE-1, '\n');
+      } else {
+        return false;
+      }
+      if (map_end_from_line(line_buff, *_read_buff)) {
+        _line = line_buff;
+        return true;
+      }
+    }
+  }
+
+  if (_read_buff) {
+    _pool->release(_read_buff);
+    _read_buff = NULL;
+  }
+  while (true) {
+    if (!_chunk) {
+      _chunk = next_chunk();
+      if (!_chunk) {
+        return false;
+      }
+      _chunk_pos = 0;
     }
-    _read_buff = new ReadHit();
+    while (_chunk_pos < _chunk->lines.size()) {
+      size_t i = _chunk_pos++;
+      if (_chunk->valid[i]) {
+        _read_buff = _chunk->hits[i];
+        _chunk->hits[i] = NULL;
+        _line = _chunk->lines[i];
+        return true;
+      }
+    }
+    _free_chunks.push_back(_chunk);
+    _chunk = NULL;
+  }
+}
+
+void SAMParser::fill_chunk(SAMChunk& chunk) {
+  size_t n = _carry.size();
+  chunk.data.resize(n + SAM_CHUNK_SIZE + 1);
+  copy(_carry.begin(), _carry.end(), chunk.data.begin());
+  _carry.clear();
+  if (!_eof) {
+    _in->read(&chunk.data[n], SAM_CHUNK_SIZE);
+    n += (size_t)_in->gcount();
+    _eof = !_in->good();
+  }
+
+  // Carry any trailing partial line over to the next chunk.
+  size_t end = n;
+  if (!_eof) {
+    while (end > 0 && chunk.data[end-1] != '\n') {
+      end--;
+    }
+    if (end == 0) {
+      end = n;
+    }
+    _carry.assign(chunk.data.begin() + end, chunk.data.begin() + n);
+  }
+  chunk.data[end] = '\0';
+
+  chunk.lines.clear();
+  char* p = &chunk.data[0];
+  char* stop = p + end;
+  while (p < stop) {
+    char* nl = (char*)memchr(p, '\n', stop - p);
+    if (!nl) {
+      nl = stop;
+    }
+    *nl = '\0';
+    if (nl > p) {
+      chunk.lines.push_back(p);
+    }
+    p = nl + 1;
   }
 
-  return _in->good();
+  if (chunk.hits.size() < chunk.lines.size()) {
+    chunk.hits.resize(chunk.lines.size(), NULL);
+  }
+  for (size_t i = 0; i < chunk.lines.size(); ++i) {
+    if (!chunk.hits[i]) {
+      chunk.hits[i] = _pool->new_read_hit();
+    }
+  }
+  chunk.valid.assign(chunk.lines.size(), 0);
+  chunk.done = false;
 }
 
-bool SAMParser::map_end_from_line(char* line) {
-  ReadHit& r = *_read_buff;
-  string sam_line(line);
-  char *p = strtok(line, "\t");
+SAMParser::SAMChunk* SAMParser::next_chunk() {
+  // Read ahead so that the parsing threads stay busy.
+  while (!_eof && _pending.size() < 2*_num_threads) {
+    SAMChunk* chunk;
+    if (_free_chunks.empty()) {
+      chunk = new SAMChunk();
+    } else {
+      chunk = _free_chunks.back();
+      _free_chunks.pop_back();
+    }
+    fill_chunk(*chunk);
+    {
+      boost::unique_lock<boost::mutex> lock(_chunk_mut);
+      _todo.push_back(chunk);
+    }
+    _todo_cond.notify_one();
+    _pending.push_back(chunk);
+  }
+
+  if (_pending.empty()) {
+    return NULL;
+  }
+  SAMChunk* chunk = _pending.front();
+  _pending.pop_front();
+  boost::unique_lock<boost::mutex> lock(_chunk_mut);
+  while (!chunk->done) {
+    _done_cond.wait(lock);
+  }
+  return chunk;
+}
+
+void SAMParser::drain() {
+  while (!_pending.empty()) {
+    SAMChunk* chunk = _pending.front();
+    _pending.pop_front();
+    {
+      boost::unique_lock<boost::mutex> lock(_chunk_mut);
+      while (!chunk->done) {
+        _done_cond.wait(lock);
+      }
+    }
+    _free_chunks.push_back(chunk);
+  }
+  if (_chunk) {
+    _free_chunks.push_back(_chunk);
+    _chunk = NULL;
+  }
+  _carry.clear();
+  _eof = false;
+}
+
+void SAMParser::parse_chunks() {
+  while (true) {
+    SAMChunk* chunk;
+    {
+      boost::unique_lock<boost::mutex> lock(_chunk_mut);
+      while (_todo.empty() && !_stopping) {
+        _todo_cond.wait(lock);
+      }
+      if (_todo.empty()) {
+        return;
+      }
+      chunk = _todo.front();
+      _todo.pop_front();
+    }
+    for (size_t i = 0; i < chunk->lines.size(); ++i) {
+      chunk->valid[i] = map_end_from_line(chunk->lines[i], *chunk->hits[i]);
+    }
+    {
+      boost::unique_lock<boost::mutex> lock(_chunk_mut);
+      chunk->done = true;
+    }
+    _done_cond.notify_all();
+  }
+}
+
+bool SAMParser::map_end_from_line(char* line, ReadHit& r) const {
+  r.sam = line;
+  char* p = line;
+  char* next = split_field(p);
   int sam_flag = 0;
   bool paired = 0;
   bool left_first = 0;
@@ -430,11 +973,7 @@ bool SAMParser::map_end_from_line(char* line) {
   while (p && i <= 9) {
     switch(i++) {
       case 0: {
-        r.name = p;
-        if (boost::algorithm::ends_with(r.name, "\1") ||
-            boost::algorithm::ends_with(r.name, "\2")) {
-          r.name = r.name.substr(r.name.size()-2);
-        }
+        r.name_key = NameKey(p, frag_name_len(p, strlen(p)));
         break;
       }
       case 1: {
@@ -467,11 +1006,12 @@ bool SAMParser::map_end_from_line(char* line) {
         if(p[0] == '*') {
           goto stop;
         }
-        if (!_targ_index.count(p)) {
+        size_t len = (next) ? (size_t)(next - p - 1) : strlen(p);
+        r.targ_id = _targ_dict->find(p, len);
+        if (r.targ_id == TargetDict::NOT_FOUND) {
           logger.severe("Target sequence '%s' not found. Verify that it is in "
                         "the SAM/BAM header and FASTA file.", p);
         }
-        r.targ_id = _targ_index[p];
         break;
       }
       case 3: {
@@ -514,27 +1054,28 @@ bool SAMParser::map_end_from_line(char* line) {
         break;
       }
       case 9: {
-        r.seq.set(p, r.reversed);
-        r.sam = sam_line;
+        r.seq.set(p, strlen(p), r.reversed);
         goto stop;
       }
     }
-    p = strtok(NULL, "\t");
+    p = next;
+    next = (p) ? split_field(p) : NULL;
   }
  stop:
   return i == 10;
 }
 
 void SAMParser::reset() {
+  if (_threads.size()) {
+    drain();
+  }
+
   // Rewind input file
   _in->clear();
   _in->seekg(0, ios::beg);
 
-  // Load first alignment
-  char line_buff[BUFF_SIZE];
-  delete _read_buff;
-  _read_buff = new ReadHit();
-
+  // Skip the header
+  char* line_buff = &_line_buff[0];
   while(_in->good()) {
     _in->getline(line_buff, BUFF_SIZE-1, '\n');
     if (line_buff[0] != '@') {
@@ -542,14 +1083,16 @@ void SAMParser::reset() {
     }
   }
 
-  while(!map_end_from_line(line_buff)) {
-    _in->getline(line_buff, BUFF_SIZE-1, '\n');
-  }
+  // Load first alignment
+  _carry = line_buff;
+  load_first();
 }
 
-BAMWriter::BAMWriter(BamTools::BamWriter* writer, bool sample)
+BAMWriter::BAMWriter(BamTools::BamWriter* writer, bool sample,
+                     boost::uint64_t seed)
    : _writer(writer) {
   _sample = sample;
+  _rng.seed(seed);
 }
 
 BAMWriter::~BAMWriter() {
@@ -558,7 +1101,7 @@ BAMWriter::~BAMWriter() {
 
 void BAMWriter::write_fragment(Fragment& f) {
   if (_sample) {
-    const FragHit* hit = f.sample_hit();
+    const FragHit* hit = f.sample_hit(_rng);
     PairStatus ps = hit->pair_status();
     if (ps != RIGHT_ONLY) {
       _writer->SaveAlignment(hit->left_read()->bam);
@@ -584,8 +1127,10 @@ void BAMWriter::write_fragment(Fragment& f) {
   }
 }
 
-SAMWriter::SAMWriter(ostream* out, bool sample) : _out(out) {
+SAMWriter::SAMWriter(ostream* out, bool sample, boost::uint64_t seed)
+    : _out(out) {
   _sample = sample;
+  _rng.seed(seed);
 }
 
 SAMWriter::~SAMWriter() {
@@ -594,7 +1139,7 @@ SAMWriter::~SAMWriter() {
 
 void SAMWriter::write_fragment(Fragment& f) {
   if (_sample) {
-    const FragHit* hit = f.sample_hit();
+    const FragHit* hit = f.sample_hit(_rng);
     PairStatus ps = hit->pair_status();
 
     if (ps != RIGHT_ONLY) {
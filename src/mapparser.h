@@ -12,22 +12,27 @@
 #include <api/BamReader.h>
 #include <api/BamWriter.h>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/unordered_map.hpp>
+#include <deque>
 #include <string>
 #include <vector>
 
 #include <iostream>
 
+#include "directiondetector.h"
+#include "fragments.h"
+#include "targetdict.h"
+#include "threadsafety.h"
+#include "xoshiro.h"
+
 class Fragment;
 class TargetTable;
 class FragHit;
-struct ParseThreadSafety;
+class FragPool;
 struct ReadHit;
 struct Library;
 
-typedef boost::unordered_map<std::string, size_t> TransIndex;
-
 /**
  * The Parser class is an abstract class for implementing a SAMParser or
  * BAMParser. It fills Fragment objects by parsing an input file in SAM/BAM
@@ -39,17 +44,34 @@ typedef boost::unordered_map<std::string, size_t> TransIndex;
 class Parser {
  protected:
   /**
-   * The private target-to-index map.
-   */
-  TransIndex _targ_index;
-  /**
-   * The private target-to-length map.
+   * A private pointer to the dictionary of the targets in the header, which may
+   * be shared with the parsers of other libraries.
    */
-  TransIndex _targ_lengths;
+  boost::shared_ptr<const TargetDict> _targ_dict;
   /**
    * A private pointer to the current/last read mapping being parsed.
    */
   ReadHit* _read_buff;
+  /**
+   * A private string for the name of the read mapping in _read_buff. Only
+   * copied when the read starts a new Fragment.
+   */
+  std::string _name_buff;
+  /**
+   * A private pointer to the FragPool that ReadHits are requested from.
+   */
+  FragPool* _pool;
+  /**
+   * A protected member function that sets the target dictionary from the
+   * targets in the header, reusing the shared dictionary if it matches.
+   * @param names the names of the targets, in header order.
+   * @param lengths the lengths of the targets, in header order.
+   * @param shared_dict a pointer to the dictionary of a previous library, or
+   *        NULL.
+   */
+  void init_targ_dict(const std::vector<std::string>& names,
+                      const std::vector<size_t>& lengths,
+                      const boost::shared_ptr<const TargetDict>& shared_dict);
 
  public:
   /**
@@ -62,17 +84,12 @@ class Parser {
    */
   virtual const std::string header() const=0;
   /**
-   * An accessor for the target name to index map. Returns a reference that
-   * does not outlive this.
-   * @return Reference to the target-to-index map.
-   */
-  const TransIndex& targ_index() const { return _targ_index; }
-  /**
-   * An accessor for the target-to-length map. Returns a reference that does
-   * not outlive this.
-   * @return Reference to the target-to-length map.
+   * An accessor for the dictionary of the targets in the header.
+   * @return A pointer to the target dictionary.
    */
-  const TransIndex& targ_lengths() const { return _targ_lengths; }
+  const boost::shared_ptr<const TargetDict>& targ_dict() const {
+    return _targ_dict;
+  }
   /**
    * A member function that loads all mappings of the next fragment into the
    * given Fragment object.
@@ -103,6 +120,11 @@ class Writer {
    * (true) or all output with their respective posterior probabilities (false).
    */
   bool _sample;
+  /**
+   * A private random number generator used to sample alignments, owned by the
+   * writer so that sampling does not depend on the processing threads.
+   */
+  Xoshiro _rng;
 
  public:
   /**
@@ -130,9 +152,16 @@ class BAMParser : public Parser {
    * file. Automatically deleted with BAMParser object.
    */
   boost::scoped_ptr<BamTools::BamReader> _reader;
+  /**
+   * A private bool specifying whether each accepted BamAlignment should be
+   * copied into its ReadHit, which is only needed when alignments are written
+   * back out.
+   */
+  bool _keep_alignments;
   /**
    * A private member function to parse a single read alignment and store the
-   * data in _read_buff.
+   * data in _read_buff. The alignment is expected to be read with only its
+   * core data, which is filtered on before the character data is decoded.
    * @param alignment a BamAlignment containing the data parsed by BamTools.
    * @return True if the mapping is valid and false otherwise
    */
@@ -143,8 +172,15 @@ class BAMParser : public Parser {
    * BAMParser constructor sets the reader.
    * @param reader a pointer to the BamReader object that will directly parse
    *        the BAM file.
+   * @param pool a pointer to the FragPool that ReadHits are requested from.
+   * @param keep_alignments a bool specifying whether the BamAlignments must be
+   *        kept in the ReadHits for output.
+   * @param shared_dict a pointer to the target dictionary of a previous
+   *        library, which is reused if the header matches. May be NULL.
    */
-  BAMParser(BamTools::BamReader* reader);
+  BAMParser(BamTools::BamReader* reader, FragPool* pool,
+            bool keep_alignments,
+            const boost::shared_ptr<const TargetDict>& shared_dict);
   /**
    * An accessor for the header string.
    * @return The header string.
@@ -173,6 +209,36 @@ class BAMParser : public Parser {
  **/
 class SAMParser : public Parser
 {
+  /**
+   * The SAMChunk struct stores a block of complete SAM lines read from the
+   * input, along with the ReadHits they are parsed into by the parsing threads.
+   */
+  struct SAMChunk {
+    /**
+     * A public vector of chars holding the null-terminated lines of the chunk.
+     */
+    std::vector<char> data;
+    /**
+     * A public vector of pointers to the start of each line in data.
+     */
+    std::vector<char*> lines;
+    /**
+     * A public vector of ReadHits, one for each line (and possibly extra left
+     * over from a previous use of the chunk). Consumed ReadHits are set to
+     * NULL.
+     */
+    std::vector<ReadHit*> hits;
+    /**
+     * A public vector of chars that are non-zero iff the line of the same index
+     * is a valid alignment.
+     */
+    std::vector<char> valid;
+    /**
+     * A public bool that is true once the chunk has been parsed. Guarded by
+     * _chunk_mut.
+     */
+    bool done;
+  };
   /**
    * A private pointer to the input stream (either stdin or file) in SAM format.
    */
@@ -181,21 +247,135 @@ class SAMParser : public Parser
    * A private string storing the SAM header.
    */
   std::string _header;
+  /**
+   * A private vector of chars used to read single lines when parsing serially.
+   */
+  std::vector<char> _line_buff;
+  /**
+   * A private pointer to the (null-terminated) line that _read_buff was parsed
+   * from, which starts with the read name.
+   */
+  char* _line;
+  /**
+   * A private string storing input that has been read but not yet parsed. This
+   * is the first alignment line after the header or a partial line left over
+   * at the end of a chunk.
+   */
+  std::string _carry;
+  /**
+   * A private bool that is true once the end of the input has been read into a
+   * chunk.
+   */
+  bool _eof;
+  /**
+   * A private size_t specifying the number of threads parsing chunks. If less
+   * than 2, lines are parsed serially by the calling thread.
+   */
+  size_t _num_threads;
+  /**
+   * A private vector of pointers to the threads parsing chunks.
+   */
+  std::vector<boost::thread*> _threads;
+  /**
+   * A private mutex guarding _todo, _stopping and the done flags of the chunks.
+   */
+  boost::mutex _chunk_mut;
+  /**
+   * A private condition variable signaled when a chunk is added to _todo.
+   */
+  boost::condition_variable _todo_cond;
+  /**
+   * A private condition variable signaled when a chunk has been parsed.
+   */
+  boost::condition_variable _done_cond;
+  /**
+   * A private deque of chunks waiting for a parsing thread.
+   */
+  std::deque<SAMChunk*> _todo;
+  /**
+   * A private deque of chunks that have been read but not yet consumed, in
+   * input order.
+   */
+  std::deque<SAMChunk*> _pending;
+  /**
+   * A private vector of chunks available for reuse.
+   */
+  std::vector<SAMChunk*> _free_chunks;
+  /**
+   * A private pointer to the chunk currently being consumed.
+   */
+  SAMChunk* _chunk;
+  /**
+   * A private size_t for the index of the next line in _chunk to consume.
+   */
+  size_t _chunk_pos;
+  /**
+   * A private bool that is true when the parsing threads should exit.
+   */
+  bool _stopping;
   /**
    * A private member function to parse a single read alignment and store the
-   * data in _read_buff.
-   * @param alignment a BamAlignment containing the data parsed by BamTools.
+   * data in the given ReadHit. Safe to call from multiple threads.
+   * @param line a null-terminated SAM line, which is modified in place so that
+   *        it begins with the null-terminated read name.
+   * @param r the ReadHit to fill.
    * @return True if the mapping is valid and false otherwise
    */
-  bool map_end_from_line(char* line);
+  bool map_end_from_line(char* line, ReadHit& r) const;
+  /**
+   * A private member function that sets _read_buff and _line to the next valid
+   * alignment in the input, either by parsing the next lines serially or by
+   * taking it from the parsed chunks.
+   * @return True iff a valid alignment was found before the end of the input.
+   */
+  bool next_map_end();
+  /**
+   * A private member function that loads the first valid alignment of the
+   * input into _read_buff.
+   */
+  void load_first();
+  /**
+   * A private member function that reads the next block of complete lines
+   * from the input into the given chunk and provides ReadHits for them.
+   * @param chunk the chunk to fill.
+   */
+  void fill_chunk(SAMChunk& chunk);
+  /**
+   * A private member function that returns the next chunk in input order once
+   * it has been parsed, first reading ahead to keep the parsing threads busy.
+   * @return A pointer to the next parsed chunk, or NULL if the input has been
+   *         fully consumed.
+   */
+  SAMChunk* next_chunk();
+  /**
+   * A private member function that waits for all outstanding chunks to be
+   * parsed and returns them (and the current chunk) to _free_chunks.
+   */
+  void drain();
+  /**
+   * A private member function run by each parsing thread, which parses chunks
+   * from _todo until _stopping is set.
+   */
+  void parse_chunks();
 
 public:
   /**
    * SAMParser constructor removes the header and parses the first line to
    * start the first Fragment.
    * @param in the input stream in SAM format, which may be a file or stdin.
+   * @param pool a pointer to the FragPool that ReadHits are requested from.
+   * @param num_threads the number of threads to parse the input with. If less
+   *        than 2, lines are parsed serially by the calling thread.
+   * @param shared_dict a pointer to the target dictionary of a previous
+   *        library, which is reused if the header matches. May be NULL.
    */
-  SAMParser(std::istream* in);
+  SAMParser(std::istream* in, FragPool* pool, size_t num_threads,
+            const boost::shared_ptr<const TargetDict>& shared_dict);
+  /**
+   * SAMParser destructor stops the parsing threads and returns any unconsumed
+   * ReadHits to the FragPool.
+   */
+  ~SAMParser();
   /**
    * An accessor for the header string.
    * @return The header string.
@@ -240,8 +420,9 @@ class BAMWriter : public Writer {
    *        posteriors (true) or all output with their respective posterior
 
    *        probabilities (false).
+   * @param seed the seed for the random number generator used in sampling.
    */
-  BAMWriter(BamTools::BamWriter* writer, bool sample);
+  BAMWriter(BamTools::BamWriter* writer, bool sample, boost::uint64_t seed);
   /**
    * BAMWriter destructor closes the BamTools::BamWriter object.
    */
@@ -278,8 +459,9 @@ class SAMWriter : public Writer {
    * @param sample specifies if a single alignment should be sampled based on
    *        posteriors (true) or all output with their respective posterior
    *        probabilities (false).
+   * @param seed the seed for the random number generator used in sampling.
    */
-  SAMWriter(std::ostream* out, bool sample);
+  SAMWriter(std::ostream* out, bool sample, boost::uint64_t seed);
   /**
    * SAMWriter destructor flushes the output stream.
    */
@@ -307,6 +489,12 @@ class SAMWriter : public Writer {
  **/
 class MapParser
 {
+  /**
+   * A private FragPool that recycles the Fragments, FragHits, ReadHits and
+   * FragBatches used by the parse thread. Declared first so that it outlives
+   * the Parser.
+   */
+  FragPool _frag_pool;
   /**
    * A private pointer to the Parser object that will read the input in SAM/BAM
    * format. Automatically deleted with MapParser.
@@ -326,6 +514,44 @@ class MapParser
    * processing.
    */
   bool _write_active;
+  /**
+   * A private DirectionDetector that counts the directions of the parsed
+   * Fragments in order to warn about unspecified strandedness.
+   */
+  DirectionDetector _dir_detector;
+  /**
+   * A private size_t for the number of mappings in the processed Fragments of
+   * the current round. Only counted when pruning is enabled.
+   */
+  size_t _num_hits;
+  /**
+   * A private size_t for the number of mappings pruned in the current round.
+   */
+  size_t _num_pruned;
+  /**
+   * A private double for the total share of fragments (non-logged) held by the
+   * mappings pruned in the current round.
+   */
+  double _pruned_mass;
+  /**
+   * A private open-addressing hash table of the Fragments in the current batch
+   * that later exact duplicates may be merged into, keyed by fragment hash. It
+   * has twice as many slots as a batch holds Fragments and is reused across
+   * batches, so merging does not allocate.
+   */
+  std::vector<std::pair<size_t, Fragment*> > _dup_table;
+  /**
+   * A private vector of the slots of _dup_table filled by the current batch,
+   * so that only those are cleared for the next one.
+   */
+  std::vector<size_t> _dup_slots;
+  /**
+   * A private member function that writes the Fragments in a processed batch
+   * to the output map file (depending on settings) and releases them along
+   * with the batch to the FragPool.
+   * @param batch a pointer to the processed FragBatch to finish.
+   */
+  void write_batch(FragBatch* batch);
 
  public:
   /**
@@ -334,35 +560,37 @@ class MapParser
    * @param lib pointer to variables associated with the input, including file
    *        path.
    * @param write_active bool to initialize _write_active.
+   * @param shared_dict a pointer to the target dictionary of a previous
+   *        library, which is reused if the header matches. May be NULL.
    */
-  MapParser(Library* lib, bool write_active);
+  MapParser(Library* lib, bool write_active,
+            const boost::shared_ptr<const TargetDict>& shared_dict);
   /**
    * A member function that drives the parse thread. When all valid mappings of
-   * a fragment have been parsed, its mapped targets are found and the
-   * information is passed in a Fragment object to the processing thread through
-   * a queue in the ParseThreadSafety struct. After processing, the Fragment
-   * returns on a different in queue, and is written to the output map file
-   * (depending on settings) and deleted.
+   * a fragment have been parsed, its mapped targets are found, it is checked
+   * for sortedness and direction, assigned its sequence number and masses, and
+   * added to the current FragBatch. Full batches are passed to the processing
+   * threads through a queue in the ParseThreadSafety struct. After processing,
+   * the batch returns on a different queue, and its Fragments are written to
+   * the output map file (depending on settings) and recycled.
    * @param thread_safety a pointer to the struct containing shared queues with
    *        the processing thread.
    * @param stop_at a size_t indicating how many reads to process before
    *        stopping (disabled if 0, default).
    * @param num_neighbors experimental.
+   * @param merge_from the sequence number from which fragments that exactly
+   *        duplicate an earlier fragment of their batch are merged into it
+   *        (disabled if 0, default).
    */
   void threaded_parse(ParseThreadSafety* thread_safety, size_t stop_at=0,
-                      size_t num_neighbors=0);
+                      size_t num_neighbors=0, size_t merge_from=0);
   /**
-   * An accessor for the target name to index map. Returns a reference that does
-   * not outlive this.
-   * @return Reference to the target-to-index map.
+   * An accessor for the dictionary of the targets in the header.
+   * @return A pointer to the target dictionary.
    */
-  const TransIndex& targ_index() { return _parser->targ_index(); }
-  /**
-   * An accessor for the target-to-length map. Returns a reference that does not
-   * outlive this.
-   * @return Reference to the target-to-length map.
-   */
-  const TransIndex& targ_lengths() { return _parser->targ_lengths(); }
+  const boost::shared_ptr<const TargetDict>& targ_dict() const {
+    return _parser->targ_dict();
+  }
   /**
    * A mutator for the write-active status of the parser. This specifies whether
    * or not the alignments (sampled or with probs) should be ouptut.
@@ -370,9 +598,31 @@ class MapParser
    */
   void write_active(bool b) { _write_active = b; }
   /**
-   * A member function that resets the input parser.
+   * A member function that resets the input parser and the pruning counts.
+   */
+  void reset_reader() {
+    _parser->reset();
+    _num_hits = 0;
+    _num_pruned = 0;
+    _pruned_mass = 0;
+  }
+  /**
+   * An accessor for the number of mappings processed in the current round.
+   * Only counted when pruning is enabled.
+   * @return The number of mappings.
+   */
+  size_t num_hits() const { return _num_hits; }
+  /**
+   * An accessor for the number of mappings pruned in the current round.
+   * @return The number of pruned mappings.
+   */
+  size_t num_pruned() const { return _num_pruned; }
+  /**
+   * An accessor for the total share of fragments held by the mappings pruned
+   * in the current round.
+   * @return The pruned mass (non-logged).
    */
-  void reset_reader() { _parser->reset(); }
+  double pruned_mass() const { return _pruned_mass; }
 };
 
 #endif
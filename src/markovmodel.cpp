@@ -34,9 +34,8 @@ size_t MarkovModel::get_indices(const Sequence& seq, int left, vector<char>& ind
   
   if (left != 0 && left < _order) {
     i = _order-left;
-    for (j=0; j < _order; j++) {
-      cond = (cond << 2) + seq[j];
-    }
+    j = _order;
+    cond = (size_t)seq.kmer(0, _order);
   }
   
   indices = vector<char>(_window_size - i, -1);
@@ -54,7 +53,8 @@ size_t MarkovModel::get_indices(const Sequence& seq, int left, vector<char>& ind
   return start_index;
 }
 
-void MarkovModel::update(const Sequence& seq, int left, double mass) {
+template <class SequenceT>
+void MarkovModel::update(const SequenceT& seq, int left, double mass) {
   int i = 0;
   int j = left;
   int seq_len = (int)seq.length();
@@ -63,14 +63,13 @@ void MarkovModel::update(const Sequence& seq, int left, double mass) {
   
   if (left != 0 && left < _order) {
     i = _order-left;
-    for (j=0; j < _order; j++) {
-      cond = (cond << 2) + seq[j];
-    }
+    j = _order;
+    cond = (size_t)seq.kmer(0, _order);
   }
 
   while (i < _window_size && j < seq_len) {
     size_t index = min(i, _num_pos-1);
-    size_t curr = seq[j];
+    size_t curr = seq.nuc(j);
     //if (seq.prob()) {
     //  for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
     //    _params[index].increment(cond, nuc, seq.get_prob(j, nuc) + mass);
@@ -96,10 +95,7 @@ vector<char> MarkovModel::get_indices(const Sequence& seq) {
     return indices;
   }
   
-  size_t cond = 0;
-  for (int i = 0; i < _order; ++i) {
-    cond = (cond << 2) + seq[i];
-  }
+  size_t cond = (size_t)seq.kmer(0, _order);
   
   for (size_t i = _order; i < seq.length(); ++i) {
     size_t curr = seq[i];
@@ -110,29 +106,29 @@ vector<char> MarkovModel::get_indices(const Sequence& seq) {
   return indices;
 }
 
-void MarkovModel::fast_learn(const Sequence& seq, double mass,
+template <class SequenceT>
+void MarkovModel::fast_learn(const SequenceT& seq, double mass,
                              const vector<double>& fl_cmf) {
   assert(_num_pos==_order+1);
-  if (seq.length() < (size_t)_order) {
+  size_t seq_len = seq.length();
+  if (seq_len < (size_t)_order) {
     return;
   }
 
-  size_t cond = 0;
-  for (int i = 0; i < _order; ++i) {
-     cond = (cond << 2) + seq[i];
-  }
+  bool is_prob = seq.prob();
+  size_t cond = (size_t)seq.kmer(0, _order);
 
-  for (size_t i = _order; i < seq.length(); ++i) {
-    size_t curr = seq[i];
+  for (size_t i = _order; i < seq_len; ++i) {
+    size_t curr = seq.nuc(i);
 
     double mass_i = mass;
-    if (seq.length()-i < fl_cmf.size()) {
-      mass_i += fl_cmf[seq.length()-i];
+    if (seq_len-i < fl_cmf.size()) {
+      mass_i += fl_cmf[seq_len-i];
     }
 
-    if (seq.prob()) {
+    if (is_prob) {
       for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
-        _params[_order].increment(cond, nuc, seq.get_prob(i, nuc) + mass_i);
+        _params[_order].increment(cond, nuc, seq.nuc_prob(i, nuc) + mass_i);
       }
     } else {
       _params[_order].increment(cond, curr, mass_i);
@@ -142,6 +138,19 @@ void MarkovModel::fast_learn(const Sequence& seq, double mass,
   }
 }
 
+void MarkovModel::learn_counts(const boost::uint64_t* counts, bool rev) {
+  assert(_num_pos==_order+1);
+  size_t k = _order + 1;
+  size_t num_kmers = (size_t)1 << (2*k);
+  for (size_t kmer = 0; kmer < num_kmers; ++kmer) {
+    if (!counts[kmer]) {
+      continue;
+    }
+    size_t index = (rev) ? (size_t)rev_comp(kmer, k) : kmer;
+    _params[_order].increment(index >> 2, index & 3, log((double)counts[kmer]));
+  }
+}
+
 void MarkovModel::calc_marginals() {
   assert(_num_pos==_order+1);
   for (int i = 0; i < _order; ++i) {
@@ -160,31 +169,32 @@ double MarkovModel::transition_prob(size_t p, size_t cond, size_t curr) const {
   return _params[p](cond, curr);
 }
 
-double MarkovModel::seq_prob(const Sequence& seq, int left) const {
+template <class SequenceT>
+double MarkovModel::seq_prob(const SequenceT& seq, int left) const {
   int i = 0;
   int j = left;
   int seq_len = (int)seq.length();
+  bool is_prob = seq.prob();
 
   size_t cond = 0;
   double v = 0;
 
   if (left < _order) {
     i = _order-left;
-    for (j=0; j < min(_order, i); j++) {
-      cond = (cond << 2) + seq[j];
-    }
+    j = min(_order, i);
+    cond = (size_t)seq.kmer(0, j);
     v = i*LOG_QUARTER;
   }
 
   while (i < _window_size && j < seq_len) {
     size_t index = min(i, _num_pos -1);
-    size_t curr = seq[j];
-    if (seq.prob()) {
+    size_t curr = seq.nuc(j);
+    if (is_prob) {
       double prob = LOG_0;
       for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
-        assert(!isnan(seq.get_prob(j, nuc)));
+        assert(!isnan(seq.nuc_prob(j, nuc)));
         assert(!isnan(_params[index](cond, nuc)));
-        prob = log_add(prob, seq.get_prob(j, nuc) + _params[index](cond, nuc));
+        prob = log_add(prob, seq.nuc_prob(j, nuc) + _params[index](cond, nuc));
       }
       v += prob;
     } else {
@@ -212,3 +222,14 @@ double MarkovModel::marginal_prob(size_t w, size_t nuc) const {
   }
   return marg-tot;
 }
+
+template double MarkovModel::seq_prob(const SequenceFwd& seq, int left) const;
+template double MarkovModel::seq_prob(const SequenceRev& seq, int left) const;
+template void MarkovModel::update(const SequenceFwd& seq, int left,
+                                  double mass);
+template void MarkovModel::update(const SequenceRev& seq, int left,
+                                  double mass);
+template void MarkovModel::fast_learn(const SequenceFwd& seq, double mass,
+                                      const vector<double>& fl_cmf);
+template void MarkovModel::fast_learn(const SequenceRev& seq, double mass,
+                                      const vector<double>& fl_cmf);
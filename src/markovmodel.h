@@ -9,6 +9,7 @@
 #ifndef express_markovmodel_h
 #define express_markovmodel_h
 
+#include <boost/cstdint.hpp>
 #include <vector>
 #include <string>
 #include "frequencymatrix.h"
@@ -69,20 +70,25 @@ class MarkovModel {
   double transition_prob(size_t p, size_t cond, size_t curr) const;
   /**
    * Computes the probability of the sequence beginning at left of size
-   * _window_size using the parameters of the Markov model.
+   * _window_size using the parameters of the Markov model. Templated on the
+   * sequence direction (SequenceFwd or SequenceRev) so that nucleotide access
+   * is inlined.
    * @param seq the sequence from which to extract the window.
    * @param left the leftmost point in the sequence window.
    * @return The probability of the sequence based on the model parameters.
    */
-  double seq_prob(const Sequence& seq, int left) const;
+  template <class SequenceT>
+  double seq_prob(const SequenceT& seq, int left) const;
   /**
    * Increments the parameters associated with the sequence beginning at left of
-   * size _window_size by the (logged) mass.
+   * size _window_size by the (logged) mass. Templated on the sequence
+   * direction (SequenceFwd or SequenceRev).
    * @param seq the sequence from which to extract the window.
    * @param left the leftmost point in the sequence window.
    * @param mass the amount to increment the parameters by (logged).
    */
-  void update(const Sequence& seq, int left, double mass);
+  template <class SequenceT>
+  void update(const SequenceT& seq, int left, double mass);
   /**
    * Increments the specified transition by the given mass.
    * @param p the position in the chain to increment.
@@ -126,14 +132,25 @@ class MarkovModel {
   /**
    * Slides a window along the given sequence, incrementing the highest order
    * transition paramaters by the given mass multiplied by the probability of
-   * observing a fragment at that distance from the end.
+   * observing a fragment at that distance from the end. Templated on the
+   * sequence direction (SequenceFwd or SequenceRev).
    * @param seq the sequence to slide the window along.
    * @param mass the amount to increment the parameters by.
    * @param fl_cmf the fragment length CMF to determine the probability of
    *        observing fragment starts at different positions in the sequence.
    */
-  void fast_learn(const Sequence& seq, double mass,
+  template <class SequenceT>
+  void fast_learn(const SequenceT& seq, double mass,
                   const std::vector<double>& fl_cmf);
+  /**
+   * Increments the highest order transition parameters by precomputed counts
+   * of (order+1)-mers. Equivalent to calling fast_learn with a mass of 1 and no
+   * fragment length CMF on each of the sequences the k-mers were counted in.
+   * @param counts an array of 4^(order+1) counts indexed by encoded k-mer.
+   * @param rev a bool that is true iff the k-mers should be reverse
+   *        complemented before they are added.
+   */
+  void learn_counts(const boost::uint64_t* counts, bool rev);
   /**
    * After learning the highest order transitions with fast_learn, this method
    * fills in the lower-order transitions.
@@ -165,8 +165,8 @@ void MismatchTable::get_indices(const FragHit& f,
                            vector<char>& right_ref) const {
 
   const Target& targ = *f.target();
-  const Sequence& t_seq_fwd = targ.seq(0);
-  const Sequence& t_seq_rev = targ.seq(1);
+  const SequenceFwd& t_seq_fwd = targ.seq_fwd();
+  const SequenceRev& t_seq_rev = targ.seq_rev();
   
   if (f.left_read()) {
     const ReadHit& read_l = *f.left_read();
@@ -194,8 +194,8 @@ void MismatchTable::get_indices(const FragHit& f,
         i += ins->len;
         ins++;
       } else {
-        size_t cur = read_l.seq[i];
-        size_t ref = t_seq_fwd[j];
+        size_t cur = read_l.seq.nuc(i);
+        size_t ref = t_seq_fwd.nuc(j);
         if (cur != ref) {
           left_indices.push_back(i);
           if (cur_seq_bit / 8 == left_seq.size()) {
@@ -240,8 +240,8 @@ void MismatchTable::get_indices(const FragHit& f,
         i += ins->len;
         ins--;
       } else {
-        size_t cur = read_r.seq[i];
-        size_t ref = t_seq_rev[j];
+        size_t cur = read_r.seq.nuc(i);
+        size_t ref = t_seq_rev.nuc(j);
         
         if (cur != ref) {
           right_indices.push_back(i);
@@ -267,8 +267,9 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
   }
   
   const Target& targ = *f.target();
-  const Sequence& t_seq_fwd = targ.seq(0);
-  const Sequence& t_seq_rev = targ.seq(1);
+  const SequenceFwd& t_seq_fwd = targ.seq_fwd();
+  const SequenceRev& t_seq_rev = targ.seq_rev();
+  const bool t_prob = t_seq_fwd.prob();
 
   double ll = 0;
 
@@ -306,20 +307,20 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
         insertion = false;
         deletion = false;
         
-        size_t cur = read_l.seq[i];
-        size_t prev = (i) ? (read_l.seq[i-1] << 2) : 0;
+        size_t cur = read_l.seq.nuc(i);
+        size_t prev = (i) ? (read_l.seq.nuc(i-1) << 2) : 0;
 
-        if (t_seq_fwd.prob()) {
+        if (t_prob) {
           double trans_prob = LOG_0;
           for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
             size_t index = ((prev + nuc) << 2) + cur;
             
-            trans_prob = log_add(trans_prob, t_seq_fwd.get_prob(j, nuc) +
+            trans_prob = log_add(trans_prob, t_seq_fwd.nuc_prob(j, nuc) +
                                              left_mm[i](index));
           }
           ll += trans_prob;
         } else {
-          size_t ref = t_seq_fwd[j];
+          size_t ref = t_seq_fwd.nuc(j);
           size_t index = prev + ref;
           ll += left_mm[i](index, cur);
         }
@@ -364,19 +365,19 @@ double MismatchTable::log_likelihood(const FragHit& f) const {
         insertion = false;
         deletion = false;
         
-        size_t cur = read_r.seq[i];
-        size_t prev = (i) ? (read_r.seq[i-1] << 2) : 0;
+        size_t cur = read_r.seq.nuc(i);
+        size_t prev = (i) ? (read_r.seq.nuc(i-1) << 2) : 0;
 
-        if (t_seq_rev.prob()) {
+        if (t_prob) {
           double trans_prob = LOG_0;
           for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
             size_t index = ((prev + nuc) << 2) + cur;
-            trans_prob = log_add(trans_prob, t_seq_rev.get_prob(j, nuc) +
+            trans_prob = log_add(trans_prob, t_seq_rev.nuc_prob(j, nuc) +
                                              right_mm[i](index));
           }
           ll += trans_prob;
         } else {
-          size_t ref = t_seq_rev[j];
+          size_t ref = t_seq_rev.nuc(j);
           size_t index = prev + ref;
           ll += right_mm[i](index, cur);
         }
@@ -396,8 +397,9 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
   }
 
   Target& targ = *f.target();
-  Sequence& t_seq_fwd = targ.seq(0);
-  Sequence& t_seq_rev = targ.seq(1);
+  SequenceFwd& t_seq_fwd = targ.seq_fwd();
+  SequenceRev& t_seq_rev = targ.seq_rev();
+  const bool t_prob = t_seq_fwd.prob() && _active;
 
   if (f.left_read()) {
     const ReadHit& read_l = *f.left_read();
@@ -437,24 +439,24 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
         insertion = false;
         deletion = false;
         
-        size_t cur = read_l.seq[i];
-        size_t prev = (i) ? (read_l.seq[i-1] << 2) : 0;
+        size_t cur = read_l.seq.nuc(i);
+        size_t prev = (i) ? (read_l.seq.nuc(i-1) << 2) : 0;
         // Update the seq parameters only after burn-in (active)
-        if (t_seq_fwd.prob() && _active) {
+        if (t_prob) {
           
           t_seq_fwd.update_obs(j, cur, p);
 
           double Z = LOG_0;
 
-          size_t ref_index = (i) ? (t_seq_fwd.get_ref(j-1)<<2) +
-                                    t_seq_fwd.get_ref(j) : t_seq_fwd.get_ref(j);
+          size_t ref_index = (i) ? (t_seq_fwd.ref_nuc(j-1)<<2) +
+                                    t_seq_fwd.ref_nuc(j) : t_seq_fwd.ref_nuc(j);
           for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
             // Update expected
             t_seq_fwd.update_exp(j, nuc, p+left_mm[i](ref_index, nuc));
 
             // Update posterior
             size_t index = prev + nuc;
-            joint_probs[nuc] = t_seq_fwd.get_prob(j, nuc) +
+            joint_probs[nuc] = t_seq_fwd.nuc_prob(j, nuc) +
                                left_mm[i](index, cur);
             Z = log_add(Z, joint_probs[nuc]);
           }
@@ -462,14 +464,14 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
           for (size_t nuc = 0; !left_mm[i].is_fixed() && nuc < NUM_NUCS; nuc++) {
             size_t index = prev + nuc;
             left_mm[i].increment(index, cur,
-                                 mass + p + t_seq_fwd.get_prob(j, nuc));
+                                 mass + p + t_seq_fwd.nuc_prob(j, nuc));
           }
 
           for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
             t_seq_fwd.update_est(j, nuc, p + joint_probs[nuc] - Z);
           }
         } else {
-          size_t ref = t_seq_fwd[j];
+          size_t ref = t_seq_fwd.nuc(j);
           size_t index = prev + ref;
           left_mm[i].increment(index, cur, mass + p);
         }
@@ -521,37 +523,37 @@ void MismatchTable::update(const FragHit& f, double p, double mass) {
         insertion = false;
         deletion = false;
 
-        size_t cur = read_r.seq[i];
-        size_t prev = (i) ? (read_r.seq[i-1] << 2) : 0;
+        size_t cur = read_r.seq.nuc(i);
+        size_t prev = (i) ? (read_r.seq.nuc(i-1) << 2) : 0;
 
-        if (t_seq_rev.prob() && _active) {          
+        if (t_prob) {
           t_seq_rev.update_obs(j, cur, p);
 
           double Z = LOG_0;
 
-          size_t ref_index = (i) ? (t_seq_rev.get_ref(j-1)<<2) +
-                                   t_seq_rev.get_ref(j) : t_seq_rev.get_ref(j);
+          size_t ref_index = (i) ? (t_seq_rev.ref_nuc(j-1)<<2) +
+                                   t_seq_rev.ref_nuc(j) : t_seq_rev.ref_nuc(j);
           for (size_t nuc = 0; nuc < NUM_NUCS; nuc++) {
             // Update expected
             t_seq_rev.update_exp(j, nuc, p+right_mm[i](ref_index, nuc));
 
             // Update posterior
             size_t index = prev + nuc;
-            joint_probs[nuc] = t_seq_rev.get_prob(j, nuc) +
+            joint_probs[nuc] = t_seq_rev.nuc_prob(j, nuc) +
                                right_mm[i](index, cur);
             Z = log_add(Z, joint_probs[nuc]);
           }
 
           for (size_t nuc = 0; !right_mm[i].is_fixed() && nuc < NUM_NUCS; nuc++) {
             size_t index = prev + nuc;
-            right_mm[i].increment(index, cur, mass+p+t_seq_rev.get_prob(j, nuc));
+            right_mm[i].increment(index, cur, mass+p+t_seq_rev.nuc_prob(j, nuc));
           }
 
           for (size_t nuc=0; nuc < NUM_NUCS; nuc++) {
             t_seq_rev.update_est(j, nuc, p + joint_probs[nuc] - Z);
           }
         } else {
-          size_t ref = t_seq_rev[j];
+          size_t ref = t_seq_rev.nuc(j);
           size_t index = prev + ref;
           right_mm[i].increment(index, cur, mass+p);
         }
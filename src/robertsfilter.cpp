@@ -7,33 +7,249 @@
 //
 
 #include "robertsfilter.h"
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 
-RobertsFilter::RobertsFilter(size_t local_size, size_t global_size)
-    : _global_vector(global_size),
-      _local_size(local_size),
-      _global_size(global_size) {
+/**
+ * The number of 64-bit words in each Bloom filter block (one cache line).
+ */
+const size_t BLOCK_WORDS = 8;
+const size_t BLOCK_BITS = BLOCK_WORDS * 64;
+const size_t MAX_HASHES = 16;
+
+/**
+ * A helper function that mixes the bits of a 64-bit value (the splitmix64
+ * finalizer) so that tables can be indexed by the low bits.
+ */
+inline boost::uint64_t mix(boost::uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * A helper function that folds a NameKey into a single non-zero fingerprint,
+ * since 0 marks empty slots.
+ */
+inline boost::uint64_t fingerprint(const NameKey& key) {
+  boost::uint64_t fp = key.hash ^ (key.len * 0x9E3779B97F4A7C15ULL);
+  return (fp) ? fp : 1;
 }
 
-bool RobertsFilter::test_and_push(const string& key) {
-  if (_local_set.count(key) || _global_set.count(key)) {
-    return true;
+/**
+ * A helper function that returns the smallest power of 2 that is at least
+ * twice n, to keep the open-addressing tables at most half full.
+ */
+inline size_t table_size(size_t n) {
+  size_t size = 16;
+  while (size < 2*n) {
+    size <<= 1;
   }
+  return size;
+}
 
-  _local_set.insert(key);
-  _local_queue.push(key);
-  if (_local_set.size() > _local_size) {
-    size_t r = _global_set.size();
-    if (_global_set.size() == _global_size) {
-      r = (size_t)(rand()/double(RAND_MAX)*(_global_size-1));
-      _global_set.erase(_global_vector[r]);
+RobertsFilter::RobertsFilter(size_t local_size, size_t global_size,
+                             double fp_rate, size_t res_size)
+    : _local_next(0),
+      _local_count(0),
+      _curr_gen(0),
+      _res_count(0),
+      _local_size(max(local_size, (size_t)1)),
+      _gen_size(max(global_size/2, (size_t)1)),
+      _res_size(res_size) {
+  Slot empty = {0, 0, 0};
+  _local_table.assign(table_size(_local_size), empty);
+  _local_fps.resize(_local_size);
+  _local_names.resize(_local_size);
+  _res_table.assign(table_size(_res_size), empty);
+  _res_fps.resize(_res_size);
+  _res_names.resize(_res_size);
+
+  fp_rate = min(max(fp_rate, 1e-10), 0.5);
+  double bits = -(double)_gen_size * log(fp_rate) / (log(2.0)*log(2.0));
+  _num_blocks = max((size_t)ceil(bits / BLOCK_BITS), (size_t)1);
+  size_t k = (size_t)(bits / _gen_size * log(2.0) + 0.5);
+  _num_hashes = min(max(k, (size_t)1), MAX_HASHES);
+
+  for (size_t g = 0; g < 2; ++g) {
+    _global[g].bloom.assign(_num_blocks * BLOCK_WORDS, 0);
+    _global[g].table.assign(table_size(_gen_size), empty);
+    _global[g].size = 0;
+  }
+}
+
+size_t RobertsFilter::find_slot(const vector<Slot>& table, boost::uint64_t fp,
+                                size_t idx) const {
+  size_t mask = table.size() - 1;
+  for (size_t i = mix(fp) & mask; table[i].fp; i = (i+1) & mask) {
+    if (table[i].idx == idx) {
+      return i;
     }
+  }
+  return table.size();
+}
 
-    _local_set.erase(_local_queue.front());
-    _global_set.insert(_local_queue.front());
-    _global_vector[r] = _local_queue.front();
-    _local_queue.pop();
+void RobertsFilter::erase_slot(vector<Slot>& table, size_t i) {
+  size_t mask = table.size() - 1;
+  size_t j = i;
+  while (true) {
+    table[i].fp = 0;
+    while (true) {
+      j = (j+1) & mask;
+      if (!table[j].fp) {
+        return;
+      }
+      // Entries whose home slot lies cyclically in (i, j] stay put.
+      size_t k = mix(table[j].fp) & mask;
+      if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+        continue;
+      }
+      break;
+    }
+    table[i] = table[j];
+    i = j;
+  }
+}
+
+void RobertsFilter::insert_slot(vector<Slot>& table, boost::uint64_t fp,
+                                size_t idx) {
+  size_t mask = table.size() - 1;
+  size_t i = mix(fp) & mask;
+  while (table[i].fp) {
+    i = (i+1) & mask;
+  }
+  table[i].fp = fp;
+  table[i].idx = (boost::uint32_t)idx;
+}
+
+void RobertsFilter::retire(const Generation& gen) {
+  if (!_res_size) {
+    return;
+  }
+  // Only a random half of the keys is kept, so that the reservoir turns over
+  // more slowly and reaches further back.
+  for (size_t i = 0; i < gen.table.size(); ++i) {
+    const Slot& s = gen.table[i];
+    if (!s.fp || (_rng.next() & 1)) {
+      continue;
+    }
+    size_t r = _res_count;
+    if (_res_count == _res_size) {
+      r = (size_t)(_rng.next() % _res_size);
+      erase_slot(_res_table, find_slot(_res_table, _res_fps[r], r));
+    } else {
+      _res_count++;
+    }
+    _res_fps[r] = s.fp;
+    _res_names[r].assign(gen.names, s.idx, s.len);
+    insert_slot(_res_table, s.fp, r);
+  }
+}
+
+bool RobertsFilter::bloom_test(const Generation& gen,
+                               boost::uint64_t fp) const {
+  boost::uint64_t h = mix(fp ^ 0x9E3779B97F4A7C15ULL);
+  const boost::uint64_t* block = &gen.bloom[(h % _num_blocks) * BLOCK_WORDS];
+  h = mix(h);
+  size_t a = (size_t)(h & 0xFFFFFFFF);
+  size_t b = (size_t)(h >> 32) | 1;
+  for (size_t i = 0; i < _num_hashes; ++i) {
+    size_t bit = (a + i*b) % BLOCK_BITS;
+    if (!(block[bit / 64] & (1ULL << (bit % 64)))) {
+      return false;
+    }
   }
+  return true;
+}
+
+void RobertsFilter::push_global(boost::uint64_t fp, const string& name) {
+  if (_global[_curr_gen].size == _gen_size) {
+    _curr_gen ^= 1;
+    Generation& old = _global[_curr_gen];
+    retire(old);
+    fill(old.bloom.begin(), old.bloom.end(), 0);
+    for (size_t i = 0; i < old.table.size(); ++i) {
+      old.table[i].fp = 0;
+    }
+    old.names.clear();
+    old.size = 0;
+  }
+
+  Generation& gen = _global[_curr_gen];
+
+  boost::uint64_t h = mix(fp ^ 0x9E3779B97F4A7C15ULL);
+  boost::uint64_t* block = &gen.bloom[(h % _num_blocks) * BLOCK_WORDS];
+  h = mix(h);
+  size_t a = (size_t)(h & 0xFFFFFFFF);
+  size_t b = (size_t)(h >> 32) | 1;
+  for (size_t i = 0; i < _num_hashes; ++i) {
+    size_t bit = (a + i*b) % BLOCK_BITS;
+    block[bit / 64] |= 1ULL << (bit % 64);
+  }
+
+  size_t mask = gen.table.size() - 1;
+  size_t i = mix(fp) & mask;
+  while (gen.table[i].fp) {
+    i = (i+1) & mask;
+  }
+  gen.table[i].fp = fp;
+  gen.table[i].idx = (boost::uint32_t)gen.names.size();
+  gen.table[i].len = (boost::uint32_t)name.size();
+  gen.names.append(name);
+  gen.size++;
+}
+
+bool RobertsFilter::test_and_push(const NameKey& key, const string& name) {
+  boost::uint64_t fp = fingerprint(key);
+
+  size_t mask = _local_table.size() - 1;
+  for (size_t i = mix(fp) & mask; _local_table[i].fp; i = (i+1) & mask) {
+    if (_local_table[i].fp == fp && _local_names[_local_table[i].idx] == name) {
+      return true;
+    }
+  }
+
+  for (size_t g = 0; g < 2; ++g) {
+    const Generation& gen = _global[g];
+    if (!gen.size || !bloom_test(gen, fp)) {
+      continue;
+    }
+    size_t gmask = gen.table.size() - 1;
+    for (size_t i = mix(fp) & gmask; gen.table[i].fp; i = (i+1) & gmask) {
+      const Slot& s = gen.table[i];
+      if (s.fp == fp && !gen.names.compare(s.idx, s.len, name)) {
+        return true;
+      }
+    }
+  }
+
+  if (_res_count) {
+    size_t rmask = _res_table.size() - 1;
+    for (size_t i = mix(fp) & rmask; _res_table[i].fp; i = (i+1) & rmask) {
+      if (_res_table[i].fp == fp && _res_names[_res_table[i].idx] == name) {
+        return true;
+      }
+    }
+  }
+
+  if (_local_count == _local_size) {
+    // The ring is full, so the next slot holds the oldest key.
+    size_t oldest = _local_next;
+    erase_slot(_local_table, find_slot(_local_table, _local_fps[oldest],
+                                       oldest));
+    push_global(_local_fps[oldest], _local_names[oldest]);
+  } else {
+    _local_count++;
+  }
+
+  _local_fps[_local_next] = fp;
+  _local_names[_local_next].assign(name);
+  insert_slot(_local_table, fp, _local_next);
+  _local_next = (_local_next + 1) % _local_size;
   return false;
 }
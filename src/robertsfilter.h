@@ -9,72 +9,235 @@
 #ifndef express_robertsfilter_h
 #define express_robertsfilter_h
 
-#include <boost/unordered_set.hpp>
-#include <queue>
+#include <boost/cstdint.hpp>
+#include <string>
 #include <vector>
+#include "fragments.h"
+#include "xoshiro.h"
 
 static size_t DEFAULT_LOC_SIZE = 10000;
 static size_t DEFAULT_GLOB_SIZE = 100000;
+static size_t DEFAULT_RES_SIZE = 50000;
+static double DEFAULT_FP_RATE = 0.01;
 
 /**
  * The RobertsFilter class implements a datastructure to test for repeats of
  * a key with high probability, when repeats are most likely to be nearby.
- * Recently observed keys are stored in a local set for a certain number of
- * observations (set by local_size). After this number of observations, it is
- * removed from the local set, and placed in the global set, displacing a random
- * element of this set. To be used when the full set cannot be stored in memory.
+ * Recently observed keys are stored in a local window for a certain number of
+ * observations (set by local_size). After this number of observations, they are
+ * moved from the local window into a global sample. To be used when the full
+ * set cannot be stored in memory.
+ *
+ * Keys are read name fingerprints. The local window is an open-addressing table
+ * of fingerprints over a FIFO ring, and the global sample is kept in two
+ * generations, each with a blocked Bloom filter in front of a fingerprint table
+ * whose names are packed into a single buffer. Once a generation is full, the
+ * older one is cleared and reused. Before that, a random half of its keys is
+ * retired into a reservoir, where each displaces a random older key once the
+ * reservoir is full, so that some names are still recognized after they leave
+ * the generations. A fingerprint match is only reported after the full names
+ * have been compared, so the Bloom filter false positive rate only affects
+ * speed.
  *  @author    Adam Roberts
  *  @date      2011
  *  @copyright Artistic License 2.0
  **/
 class RobertsFilter {
   /**
-   * A private queue to store the local keys in FIFO order. Used to know which
-   * element to remove from the set next.
+   * The Slot struct is an entry in one of the open-addressing tables. An empty
+   * slot has a fingerprint of 0.
+   */
+  struct Slot {
+    /**
+     * A public 64-bit fingerprint of the key stored in the slot.
+     */
+    boost::uint64_t fp;
+    /**
+     * A public 32-bit ring (local) or reservoir index, or name offset
+     * (global) of the key stored in the slot.
+     */
+    boost::uint32_t idx;
+    /**
+     * A public 32-bit length of the name (global only).
+     */
+    boost::uint32_t len;
+  };
+  /**
+   * The Generation struct stores one generation of the global sample.
+   */
+  struct Generation {
+    /**
+     * A public vector of 64-bit words making up the blocks of the Bloom filter.
+     */
+    std::vector<boost::uint64_t> bloom;
+    /**
+     * A public vector of Slots indexing the names in the generation by
+     * fingerprint.
+     */
+    std::vector<Slot> table;
+    /**
+     * A public string that all names in the generation are appended to.
+     */
+    std::string names;
+    /**
+     * A public size_t for the number of keys in the generation.
+     */
+    size_t size;
+  };
+  /**
+   * A private vector of Slots indexing the local ring by fingerprint.
+   */
+  std::vector<Slot> _local_table;
+  /**
+   * A private vector storing the fingerprints of the local keys in FIFO order.
+   * Used to know which key to move to the global sample next.
+   */
+  std::vector<boost::uint64_t> _local_fps;
+  /**
+   * A private vector storing the names of the local keys in FIFO order. The
+   * strings are reused as the ring wraps around.
+   */
+  std::vector<std::string> _local_names;
+  /**
+   * A private size_t for the ring index of the oldest (or next empty) local
+   * key.
+   */
+  size_t _local_next;
+  /**
+   * A private size_t for the number of keys in the local ring.
+   */
+  size_t _local_count;
+  /**
+   * A private array of the two generations of the global sample.
    */
-  std::queue<std::string> _local_queue;
+  Generation _global[2];
   /**
-   * A private set used to store the local keys. Allows for easy membership
-   * testing.
+   * A private size_t indexing the generation that new global keys are added
+   * to.
    */
-  boost::unordered_set<std::string> _local_set;
+  size_t _curr_gen;
   /**
-   * A private vector to store the global keys. Used to know which element to
-   * randomly replace when the global set is full.
+   * A private vector of Slots indexing the reservoir by fingerprint.
    */
-  std::vector<std::string> _global_vector;
+  std::vector<Slot> _res_table;
   /**
-   * A private set used to store the global keys. Allows for easy membership
-   * testing.
+   * A private vector storing the fingerprints of the reservoir keys. Used to
+   * find the slot of a key when it is displaced.
    */
-  boost::unordered_set<std::string> _global_set;
+  std::vector<boost::uint64_t> _res_fps;
+  /**
+   * A private vector storing the names of the reservoir keys. The strings are
+   * reused as keys are displaced.
+   */
+  std::vector<std::string> _res_names;
+  /**
+   * A private size_t for the number of keys in the reservoir.
+   */
+  size_t _res_count;
+  /**
+   * A private Xoshiro generator choosing the reservoir keys to displace. It
+   * has a fixed seed, so that the same input always gives the same result.
+   */
+  Xoshiro _rng;
   /**
    * A private size_t specifying the maximum number of keys to store in the
-   * local set.
+   * local window.
    */
   size_t _local_size;
+  /**
+   * A private size_t specifying the maximum number of keys to store in each
+   * global generation.
+   */
+  size_t _gen_size;
   /**
    * A private size_t specifying the maximum number of keys to store in the
-   * global set.
+   * reservoir.
+   */
+  size_t _res_size;
+  /**
+   * A private size_t specifying the number of blocks in each Bloom filter.
+   */
+  size_t _num_blocks;
+  /**
+   * A private size_t specifying the number of bits set per key within a Bloom
+   * filter block.
+   */
+  size_t _num_hashes;
+  /**
+   * A private member function that returns the index of the slot in a local or
+   * reservoir table holding the given index, or the table size if it is not
+   * found.
+   * @param table the table to search.
+   * @param fp the fingerprint of the key.
+   * @param idx the ring or reservoir index of the key.
+   * @return The slot index.
+   */
+  size_t find_slot(const std::vector<Slot>& table, boost::uint64_t fp,
+                   size_t idx) const;
+  /**
+   * A private member function that removes the entry at the given slot of a
+   * local or reservoir table, shifting back later entries in its probe
+   * sequence.
+   * @param table the table to remove the entry from.
+   * @param i the index of the slot to empty.
+   */
+  void erase_slot(std::vector<Slot>& table, size_t i);
+  /**
+   * A private member function that adds an entry to a local or reservoir
+   * table.
+   * @param table the table to add the entry to.
+   * @param fp the fingerprint of the key.
+   * @param idx the ring or reservoir index of the key.
+   */
+  void insert_slot(std::vector<Slot>& table, boost::uint64_t fp, size_t idx);
+  /**
+   * A private member function that moves the keys of a full generation into
+   * the reservoir before the generation is cleared.
+   * @param gen the generation to retire.
+   */
+  void retire(const Generation& gen);
+  /**
+   * A private member function that adds a key to the current global
+   * generation, rotating generations if it is full.
+   * @param fp the fingerprint of the key.
+   * @param name the full name of the key.
+   */
+  void push_global(boost::uint64_t fp, const std::string& name);
+  /**
+   * A private member function that tests whether the Bloom filter of a
+   * generation may contain the fingerprint.
+   * @param gen the generation to test.
+   * @param fp the fingerprint of the key.
+   * @return False iff the fingerprint is definitely not in the generation.
    */
-  size_t _global_size;
+  bool bloom_test(const Generation& gen, boost::uint64_t fp) const;
 
  public:
   /**
-   * RobertsFilter constructor sets the size of the sets.
-   * @param local_size the maximum number of keys to store in the local set.
-   * @param global_size the maximum number of keys to store in the global set.
+   * RobertsFilter constructor sets the size of the local window, global
+   * sample and reservoir.
+   * @param local_size the maximum number of keys to store in the local window.
+   * @param global_size the maximum number of keys to store in the global
+   *        sample.
+   * @param fp_rate the target false positive rate of the global Bloom filters.
+   * @param res_size the maximum number of keys to store in the reservoir,
+   *        disabled with 0.
    */
   RobertsFilter(size_t local_size=DEFAULT_LOC_SIZE,
-                size_t global_size=DEFAULT_GLOB_SIZE);
+                size_t global_size=DEFAULT_GLOB_SIZE,
+                double fp_rate=DEFAULT_FP_RATE,
+                size_t res_size=DEFAULT_RES_SIZE);
   /**
-   * A member function that tests for membership of the key in either set. If
-   * not found, the key is added to the local set, possibly pushing the oldest
-   * key in the local set into the global set, which may displace a global key.
-   * @param key the key to be tested for and pushed into the local set.
-   * @return True iff the key is in the local or global set.
+   * A member function that tests for membership of the key in the local
+   * window, global sample or reservoir, confirming fingerprint matches by comparing the
+   * full names. If not found, the key is added to the local window, possibly
+   * pushing the oldest local key into the global sample.
+   * @param key the fingerprint of the name to be tested for and pushed.
+   * @param name the full name to be tested for and pushed.
+   * @return True iff the name is in the local window, global sample or
+   *         reservoir.
    */
-  bool test_and_push(const std::string& key);
+  bool test_and_push(const NameKey& key, const std::string& name);
 };
 
 #endif
@@ -8,11 +8,25 @@
 
 #include "sequence.h"
 #include <cassert>
+#include <boost/functional/hash.hpp>
 #include <boost/math/distributions/binomial.hpp>
 
 using namespace std;
 using namespace boost::math;
 
+const char NUC_CODES[256] = {
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  // 'A' = 65, 'C' = 67, 'G' = 71, 'T' = 84
+  0,0,0,1,0,0,0,2,0,0,0,0,0,0,0,0, 0,0,0,0,3,0,0,0,0,0,0,0,0,0,0,0,
+  // 'a' = 97, 'c' = 99, 'g' = 103, 't' = 116
+  0,0,0,1,0,0,0,2,0,0,0,0,0,0,0,0, 0,0,0,0,3,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
 string Sequence::serialize() {
   vector<char> seq;
   for (size_t i = 0; i < length(); i++) {
@@ -25,10 +39,11 @@ string Sequence::serialize() {
   return string(seq.begin(), seq.end());
 }
 
-SequenceFwd::SequenceFwd():  _ref_seq(NULL), _prob(0), _len(0) {}
+SequenceFwd::SequenceFwd()
+    : _ref_seq(NULL), _words(NULL), _prob(0), _len(0), _capacity(0) {}
 
 SequenceFwd::SequenceFwd(const std::string& seq, bool rev, bool prob)
-    : _prob(prob), _len(seq.length()) {
+    : _words(NULL), _prob(prob), _len(seq.length()), _capacity(0) {
   if (prob) {
     _est_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, 0.001);
     _obs_seq = FrequencyMatrix<float>(seq.length(), NUM_NUCS, LOG_0);
@@ -37,22 +52,45 @@ SequenceFwd::SequenceFwd(const std::string& seq, bool rev, bool prob)
   set(seq, rev);
 }
 
+SequenceFwd::SequenceFwd(const boost::uint64_t* words, size_t len, bool prob)
+    : _words(words), _prob(prob), _len(len), _capacity(0) {
+  if (prob) {
+    size_t n_words = (len + 31) / 32;
+    _ref_seq.reset(new boost::uint64_t[n_words]);
+    std::copy(words, words + n_words, _ref_seq.get());
+    _words = _ref_seq.get();
+    _capacity = n_words * 32;
+    _est_seq = FrequencyMatrix<float>(len, NUM_NUCS, 0.001);
+    _obs_seq = FrequencyMatrix<float>(len, NUM_NUCS, LOG_0);
+    _exp_seq = FrequencyMatrix<float>(len, NUM_NUCS, LOG_0);
+    for (size_t i = 0; i < len; ++i) {
+      _est_seq.increment(i, ref_nuc(i), log((float)2));
+    }
+  }
+}
+
 SequenceFwd::SequenceFwd(const SequenceFwd& other)
-    : _obs_seq(other._obs_seq), _exp_seq(other._exp_seq),
-      _prob(other._prob), _len(other.length()) {
-  if (other._ref_seq) {
-    char* ref_seq = new char[_len];
-    std::copy(other._ref_seq.get(), other._ref_seq.get() + _len, ref_seq);
+    : _words(NULL), _obs_seq(other._obs_seq), _exp_seq(other._exp_seq),
+      _prob(other._prob), _len(other.length()), _capacity(0) {
+  if (other._words) {
+    size_t n_words = (_len + 31) / 32;
+    _capacity = n_words * 32;
+    boost::uint64_t* ref_seq = new boost::uint64_t[n_words];
+    std::copy(other._words, other._words + n_words, ref_seq);
     _ref_seq.reset(ref_seq);
+    _words = ref_seq;
   }
 }
 
 SequenceFwd& SequenceFwd::operator=(const SequenceFwd& other) {
-  if (other._ref_seq) {
+  if (other._words) {
     _len = other.length();
-    char* ref_seq = new char[_len];
-    std::copy(other._ref_seq.get(), other._ref_seq.get() + _len, ref_seq);
+    size_t n_words = (_len + 31) / 32;
+    boost::uint64_t* ref_seq = new boost::uint64_t[n_words];
+    std::copy(other._words, other._words + n_words, ref_seq);
     _ref_seq.reset(ref_seq);
+    _words = ref_seq;
+    _capacity = n_words * 32;
     _obs_seq = other._obs_seq;
     _exp_seq = other._exp_seq;
     _prob = other._prob;
@@ -60,35 +98,43 @@ SequenceFwd& SequenceFwd::operator=(const SequenceFwd& other) {
   return *this;
 }
 
-void SequenceFwd::set(const std::string& seq, bool rev) {
-  char* ref_seq = new char[seq.length()];
-  for (size_t i = 0; i < seq.length(); i++) {
-    ref_seq[i] = (rev) ? complement(ctoi(seq[seq.length()-1-i])) : ctoi(seq[i]);
-    if (_prob) {
-      _est_seq.increment(i, ref_seq[i], log((float)2));
+void SequenceFwd::set(const char* seq, size_t len, bool rev) {
+  size_t n_words = (len + 31) / 32;
+  if (len > _capacity) {
+    _ref_seq.reset(new boost::uint64_t[n_words]);
+    _capacity = n_words * 32;
+  }
+  boost::uint64_t* ref_seq = _ref_seq.get();
+  _words = ref_seq;
+  for (size_t w = 0; w < n_words; ++w) {
+    size_t end = min(len, (w + 1) * 32);
+    boost::uint64_t word = 0;
+    for (size_t i = w * 32; i < end; ++i) {
+      char nuc = (rev) ? complement(ctoi(seq[len-1-i])) : ctoi(seq[i]);
+      word = (word << 2) | nuc;
+      if (_prob) {
+        _est_seq.increment(i, nuc, log((float)2));
+      }
     }
+    // Left-align the final partial word.
+    ref_seq[w] = word << (2 * ((w + 1) * 32 - end));
   }
-  _ref_seq.reset(ref_seq);
-  _len = seq.length();
+  _len = len;
 }
 
-size_t SequenceFwd::operator[](const size_t index) const {
-  assert(index < _len);
-  if (_prob) {
-    return _est_seq.argmax(index);
+boost::uint64_t SequenceFwd::kmer(const size_t index, const size_t k) const {
+  assert(k <= 32 && index + k <= _len);
+  if (k == 0) {
+    return 0;
   }
-  return _ref_seq[index];
-}
-
-size_t SequenceFwd::get_ref(const size_t index) const {
-  assert(index < _len);
-  //assert(_ref_seq[index] == operator[](index));
-  return _ref_seq[index];
-}
-
-float SequenceFwd::get_prob(const size_t index, const size_t nuc) const {
-  assert(_prob);
-  return _est_seq(index, nuc);
+  if (!_prob) {
+    return ref_kmer(index, k);
+  }
+  boost::uint64_t kmer = 0;
+  for (size_t i = index; i < index + k; ++i) {
+    kmer = (kmer << 2) | nuc(i);
+  }
+  return kmer;
 }
 
 float SequenceFwd::get_obs(const size_t index, const size_t nuc) const {
@@ -229,3 +275,76 @@ void SequenceFwd::calc_p_vals(vector<double>& p_vals) const
     }
 }
  */
+
+ReadSequence& ReadSequence::operator=(const ReadSequence& other) {
+  if (this == &other) {
+    return *this;
+  }
+  size_t n_words = (other._len + 31) / 32;
+  if (n_words > INLINE_WORDS) {
+    _overflow.resize(n_words);
+    _words = &_overflow[0];
+  } else {
+    _words = _inline;
+  }
+  std::copy(other._words, other._words + n_words, _words);
+  _len = other._len;
+  return *this;
+}
+
+bool ReadSequence::operator==(const ReadSequence& other) const {
+  return _len == other._len &&
+         std::equal(_words, _words + (_len + 31) / 32, other._words);
+}
+
+size_t ReadSequence::hash() const {
+  size_t seed = _len;
+  boost::hash_range(seed, _words, _words + (_len + 31) / 32);
+  return seed;
+}
+
+void ReadSequence::set(const char* seq, size_t len, bool rev) {
+  size_t n_words = (len + 31) / 32;
+  if (n_words > INLINE_WORDS) {
+    _overflow.resize(n_words);
+    _words = &_overflow[0];
+  } else {
+    _words = _inline;
+  }
+  _len = len;
+  if (!len) {
+    return;
+  }
+
+  for (size_t w = 0; w < n_words; ++w) {
+    const char* p = seq + w * 32;
+    const char* end = seq + min(len, (w + 1) * 32);
+    boost::uint64_t word = 0;
+    for (; p < end; ++p) {
+      word = (word << 2) | (boost::uint64_t)NUC_CODES[(unsigned char)*p];
+    }
+    _words[w] = word << (2 * (seq + (w + 1) * 32 - end));
+  }
+
+  if (!rev) {
+    return;
+  }
+
+  // Reverse complement whole words, then shift out the padding, which is now
+  // at the front.
+  for (size_t w = 0; w < n_words / 2; ++w) {
+    boost::uint64_t tmp = _words[w];
+    _words[w] = rev_comp(_words[n_words - 1 - w], 32);
+    _words[n_words - 1 - w] = rev_comp(tmp, 32);
+  }
+  if (n_words % 2) {
+    _words[n_words / 2] = rev_comp(_words[n_words / 2], 32);
+  }
+  size_t pad = 2 * (n_words * 32 - len);
+  if (pad) {
+    for (size_t w = 0; w + 1 < n_words; ++w) {
+      _words[w] = (_words[w] << pad) | (_words[w + 1] >> (64 - pad));
+    }
+    _words[n_words - 1] <<= pad;
+  }
+}
@@ -9,32 +9,25 @@
 #ifndef express_sequence_h
 #define express_sequence_h
 
+#include <boost/cstdint.hpp>
+#include <cassert>
 #include <boost/scoped_array.hpp>
 #include <string>
+#include <vector>
 #include "frequencymatrix.h"
 
+/**
+ * A global lookup table from nucleotide characters to their 2-bit encodings.
+ * Characters other than A, C, G and T (either case) are encoded as A.
+ */
+extern const char NUC_CODES[256];
 /**
  * Helper function to encode a nucleotide character to a size_t value.
  * @param c the nucleotide character to be encoded.
  * @return A char value encoding the nucleotide.
  */
 inline char ctoi(const char c) {
-  switch(c) {
-    case 'A':
-    case 'a':
-       return 0;
-    case 'C':
-    case 'c':
-       return 1;
-    case 'G':
-    case 'g':
-       return 2;
-    case 'T':
-    case 't':
-       return 3;
-    default:
-       return 0;
-  }
+  return NUC_CODES[(unsigned char)c];
 }
 /**
  * Helper function to return the encoded complement of the given encoded
@@ -45,6 +38,29 @@ inline char ctoi(const char c) {
 inline char complement(const char c) {
   return c^3;
 }
+/**
+ * Helper function to reverse complement a k-mer encoded with 2 bits per
+ * nucleotide, the first nucleotide being the most significant.
+ * @param kmer the encoded k-mer to reverse complement.
+ * @param k the number of nucleotides in the k-mer (<= 32).
+ * @return The encoded reverse complement of the k-mer.
+ */
+inline boost::uint64_t rev_comp(boost::uint64_t kmer, size_t k) {
+  if (k == 0) {
+    return 0;
+  }
+  kmer = ~kmer;
+  kmer = ((kmer >> 2) & 0x3333333333333333ULL) |
+         ((kmer & 0x3333333333333333ULL) << 2);
+  kmer = ((kmer >> 4) & 0x0F0F0F0F0F0F0F0FULL) |
+         ((kmer & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  kmer = ((kmer >> 8) & 0x00FF00FF00FF00FFULL) |
+         ((kmer & 0x00FF00FF00FF00FFULL) << 8);
+  kmer = ((kmer >> 16) & 0x0000FFFF0000FFFFULL) |
+         ((kmer & 0x0000FFFF0000FFFFULL) << 16);
+  kmer = (kmer >> 32) | (kmer << 32);
+  return kmer >> (64 - 2*k);
+}
 
 /**
  * The Sequence class is an abstract class whose implmentations are used to
@@ -89,6 +105,15 @@ class Sequence {
    * @return The encoded reference character at the given index.
    */
   virtual size_t get_ref(const size_t index) const = 0;
+  /**
+   * An accessor for the k-mer starting at the given index, encoded with 2 bits
+   * per nucleotide and the first nucleotide being the most significant. Uses
+   * the same nucleotides as operator[].
+   * @param index the index of the first nucleotide in the k-mer.
+   * @param k the number of nucleotides in the k-mer (<= 32, index+k <= _len).
+   * @return The encoded k-mer.
+   */
+  virtual boost::uint64_t kmer(const size_t index, const size_t k) const = 0;
   /**
    * A member function that updates the posterior nucleotide distribution if
    * probabilistic.
@@ -177,10 +202,16 @@ class Sequence {
 class SequenceFwd: public Sequence
 {
   /**
-   * A char array that stores the encoded sequence (not null terminated).
-   * Deleted with this.
+   * An array of 64-bit words that stores the encoded sequence with 2 bits per
+   * nucleotide, 32 nucleotides to a word, the first being the most
+   * significant. Deleted with this. Empty if the words are borrowed.
    */
-  boost::scoped_array<const char> _ref_seq;
+  boost::scoped_array<boost::uint64_t> _ref_seq;
+  /**
+   * A private pointer to the encoded words that are read, either those in
+   * _ref_seq or words owned by someone else (such as a memory-mapped index).
+   */
+  const boost::uint64_t* _words;
   /**
    * A private FrequencyMatrix to store the posterior nucleotide distributions
    * (if _prob).
@@ -205,6 +236,29 @@ class SequenceFwd: public Sequence
    * A private size_t storing the number of nucleotides in the sequence.
    */
   size_t _len;
+  /**
+   * A private size_t storing the number of nucleotides that fit in _ref_seq.
+   * Allows the array to be reused when a shorter sequence is set.
+   */
+  size_t _capacity;
+  /**
+   * A private member function that extracts a k-mer from the packed reference
+   * sequence, reading at most 2 words.
+   * @param index the index of the first nucleotide in the k-mer.
+   * @param k the number of nucleotides in the k-mer (0 < k <= 32).
+   * @return The encoded reference k-mer.
+   */
+  boost::uint64_t ref_kmer(const size_t index, const size_t k) const {
+    size_t word = index >> 5;
+    size_t off = 2*(index & 31);
+    boost::uint64_t bits = _words[word] << off;
+    if (off && off + 2*k > 64) {
+      bits |= _words[word+1] >> (64 - off);
+    }
+    return bits >> (64 - 2*k);
+  }
+
+  friend class SequenceRev;
 
  public:
   /**
@@ -218,6 +272,15 @@ class SequenceFwd: public Sequence
    *        before encoding.
    */
   SequenceFwd(const std::string& seq, bool rev, bool prob=false);
+  /**
+   * SequenceFwd constructor that uses an already encoded sequence. The words
+   * are borrowed and must outlive this object, unless the sequence is
+   * probabilistic, in which case they are copied.
+   * @param words a pointer to the encoded sequence, in the format of _ref_seq.
+   * @param len the number of nucleotides in the sequence.
+   * @param prob a bool specifying if the sequence is probabilistic.
+   */
+  SequenceFwd(const boost::uint64_t* words, size_t len, bool prob=false);
   /**
    * SequenceFwd copy constructor.
    * @param other the SequenceFwd object to copy.
@@ -228,16 +291,72 @@ class SequenceFwd: public Sequence
    * @param other the Sequence object to copy.
    */
   SequenceFwd& operator=(const SequenceFwd& other);
+  /**
+   * A member function that encodes the given character array and overwrites
+   * the current stored sequence with it. Reuses the stored array if it is large
+   * enough.
+   * @param seq a pointer to the nucleotide sequence to encode and store.
+   * @param len the number of nucleotides in seq.
+   * @param rev a boolean if the sequence should be reverse complemented before
+   *        encoding.
+   */
+  void set(const char* seq, size_t len, bool rev);
+  /**
+   * An accessor for the encoded words of the sequence, for serialization.
+   * @return A pointer to the (len + 31) / 32 encoded words.
+   */
+  const boost::uint64_t* words() const { return _words; }
   // The following methods are documented in the abstract Sequence class.
-  void set(const std::string& seq, bool rev);
-  size_t operator[](const size_t index) const;
-  size_t get_ref(const size_t index) const;
+  void set(const std::string& seq, bool rev) {
+    set(seq.c_str(), seq.length(), rev);
+  }
+  /**
+   * A non-virtual, inlined version of operator[] for loops templated on the
+   * sequence direction.
+   * @param index the index of the encoded nucleotide to return (assumed to be
+   *        < _len).
+   * @return The encoded nucleotide at the given index.
+   */
+  size_t nuc(const size_t index) const {
+    assert(index < _len);
+    if (_prob) {
+      return _est_seq.argmax(index);
+    }
+    return ref_nuc(index);
+  }
+  /**
+   * A non-virtual, inlined version of get_ref that extracts the nucleotide
+   * directly from the packed reference sequence.
+   * @param index the index of the encoded reference nucleotide to return
+   *        (assumed to be < _len).
+   * @return The encoded reference nucleotide at the given index.
+   */
+  size_t ref_nuc(const size_t index) const {
+    assert(index < _len);
+    return (_words[index >> 5] >> (62 - 2*(index & 31))) & 3;
+  }
+  /**
+   * A non-virtual, inlined version of get_prob.
+   * @param index the index of the position to access.
+   * @param n the nucleotide to return the probability of.
+   * @return The logged posterior probability of the given nucleotide at the
+   *         given position.
+   */
+  float nuc_prob(const size_t index, const size_t n) const {
+    assert(_prob);
+    return _est_seq(index, n);
+  }
+  size_t operator[](const size_t index) const { return nuc(index); }
+  size_t get_ref(const size_t index) const { return ref_nuc(index); }
+  boost::uint64_t kmer(const size_t index, const size_t k) const;
   float get_exp(const size_t index, const size_t nuc) const;
   float get_obs(const size_t index, const size_t nuc) const;
   void update_est(const size_t index, const size_t nuc, float mass);
   void update_obs(const size_t index, const size_t nuc, float mass);
   void update_exp(const size_t index, const size_t nuc, float mass);
-  float get_prob(const size_t index, const size_t nuc) const;
+  float get_prob(const size_t index, const size_t nuc) const {
+    return nuc_prob(index, nuc);
+  }
   bool prob() const { return _prob; }
   bool empty() const { return _len==0; }
   size_t length() const { return _len; }
@@ -265,6 +384,14 @@ class SequenceRev: public Sequence {
  public:
   SequenceRev() : _seq(NULL){}
   SequenceRev(SequenceFwd& seq) : _seq(&seq) {}
+  // The following methods are non-virtual, inlined versions of the accessors
+  // documented in the SequenceFwd class.
+  size_t nuc(const size_t index) const {
+    return complement(_seq->nuc(_seq->_len-index-1)); }
+  size_t ref_nuc(const size_t index) const {
+    return complement(_seq->ref_nuc(_seq->_len-index-1)); }
+  float nuc_prob(const size_t index, const size_t n) const {
+    return _seq->nuc_prob(_seq->_len-index-1, complement(n)); }
   size_t length() const {
     if (_seq == NULL) {
 	return 0;
@@ -279,10 +406,10 @@ class SequenceRev: public Sequence {
   }
   // Set is not allowed in this class.
   void set(const std::string& seq, bool rev) { assert(false); exit(1); }
-  size_t operator[](const size_t index) const {
-    return complement(_seq->operator[](length()-index-1)); }
-  size_t get_ref(const size_t index) const {
-    return complement(_seq->get_ref(length()-index-1)); }
+  size_t operator[](const size_t index) const { return nuc(index); }
+  size_t get_ref(const size_t index) const { return ref_nuc(index); }
+  boost::uint64_t kmer(const size_t index, const size_t k) const {
+    return rev_comp(_seq->kmer(length()-index-k, k), k); }
   float get_obs(const size_t index, const size_t nuc) const {
     return _seq->get_obs(length()-index-1, complement(nuc)); }
   float get_exp(const size_t index, const size_t nuc) const {
@@ -294,9 +421,116 @@ class SequenceRev: public Sequence {
   void update_exp(const size_t index, const size_t nuc, float mass) {
     _seq->update_exp(length()-index-1, complement(nuc), mass); }
   float get_prob(const size_t index, const size_t nuc) const {
-    return _seq->get_prob(length()-index-1, complement(nuc)); }
+    return nuc_prob(index, nuc); }
   bool prob() const { return _seq->prob(); }
   void calc_p_vals(std::vector<double>& p_vals) const;
 };
 
+/**
+ * The ReadSequence class is a lightweight, non-virtual store for a fixed
+ * (non-probabilistic) read sequence, packed at 2 bits per nucleotide in the
+ * same layout as SequenceFwd. Reads up to INLINE_NUCS long are stored inline,
+ * so setting a read never touches the heap.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class ReadSequence {
+  /**
+   * The number of 64-bit words stored inline.
+   */
+  static const size_t INLINE_WORDS = 8;
+  /**
+   * A private array of 64-bit words storing reads of up to INLINE_WORDS*32
+   * nucleotides, the first nucleotide being the most significant.
+   */
+  boost::uint64_t _inline[INLINE_WORDS];
+  /**
+   * A private vector of 64-bit words storing reads too long to fit inline. The
+   * capacity is kept for reuse.
+   */
+  std::vector<boost::uint64_t> _overflow;
+  /**
+   * A private pointer to the words currently in use (_inline or _overflow).
+   */
+  boost::uint64_t* _words;
+  /**
+   * A private size_t storing the number of nucleotides in the sequence.
+   */
+  size_t _len;
+
+ public:
+  /**
+   * The maximum number of nucleotides stored inline.
+   */
+  static const size_t INLINE_NUCS = INLINE_WORDS * 32;
+  /**
+   * Dummy ReadSequence constructor.
+   */
+  ReadSequence() : _words(_inline), _len(0) {}
+  /**
+   * ReadSequence copy constructor.
+   * @param other the ReadSequence object to copy.
+   */
+  ReadSequence(const ReadSequence& other) : _words(_inline), _len(0) {
+    *this = other;
+  }
+  /**
+   * ReadSequence assignment operator, copies the given ReadSequence object.
+   * @param other the ReadSequence object to copy.
+   * @return Reference to this object.
+   */
+  ReadSequence& operator=(const ReadSequence& other);
+  /**
+   * A member function that encodes the given nucleotide characters with the
+   * NUC_CODES lookup table and overwrites the stored sequence with them. The
+   * reverse complement is taken on whole words after packing.
+   * @param seq a pointer to the nucleotide sequence to encode and store.
+   * @param len the number of nucleotides in seq.
+   * @param rev a boolean if the sequence should be reverse complemented.
+   */
+  void set(const char* seq, size_t len, bool rev);
+  /**
+   * A member function that encodes the given nucleotide string and overwrites
+   * the stored sequence with it.
+   * @param seq the nucleotide sequence to encode and store.
+   * @param rev a boolean if the sequence should be reverse complemented.
+   */
+  void set(const std::string& seq, bool rev) {
+    set(seq.c_str(), seq.length(), rev);
+  }
+  /**
+   * An accessor for the encoded nucleotide at the given index.
+   * @param index the index of the encoded nucleotide to return (assumed to be
+   *        < _len).
+   * @return The encoded nucleotide at the given index.
+   */
+  size_t nuc(const size_t index) const {
+    assert(index < _len);
+    return (_words[index >> 5] >> (62 - 2*(index & 31))) & 3;
+  }
+  size_t operator[](const size_t index) const { return nuc(index); }
+  /**
+   * An accessor for the length of the encoded sequence.
+   * @return The length of the encoded sequence.
+   */
+  size_t length() const { return _len; }
+  /**
+   * Accessor to determine if the sequence has 0 length.
+   * @return True iff the sequence has 0 length.
+   */
+  bool empty() const { return _len == 0; }
+  /**
+   * A member function that checks whether two sequences are identical.
+   * @param other the sequence to compare to.
+   * @return True iff the sequences have the same length and nucleotides.
+   */
+  bool operator==(const ReadSequence& other) const;
+  /**
+   * A member function that hashes the packed nucleotides of the sequence.
+   * @return A hash value that is equal for identical sequences.
+   */
+  size_t hash() const;
+};
+
 #endif
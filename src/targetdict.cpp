@@ -0,0 +1,204 @@
+//
+//  targetdict.cpp
+//  express
+//
+//  Created by agent on 10/19/26.
+//  Copyright 2026 agent. All rights reserved.
+//
+
+#include "targetdict.h"
+#include "main.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+using namespace std;
+
+/**
+ * The maximum number of seeds tried for a single bucket before the build is
+ * restarted with a new salt.
+ */
+const boost::int32_t MAX_SEEDS = 1 << 16;
+/**
+ * The maximum number of salts tried before giving up.
+ */
+const size_t MAX_SALTS = 64;
+
+/**
+ * A helper functor that orders buckets by decreasing size, so that the largest
+ * are placed while the table is still mostly empty.
+ */
+struct BucketSizeGreater {
+  const vector<vector<boost::uint32_t> >* members;
+  bool operator()(size_t a, size_t b) const {
+    return (*members)[a].size() > (*members)[b].size();
+  }
+};
+
+/**
+ * A helper functor that orders header positions by the rank of their cluster.
+ */
+struct ClusterRankLess {
+  const vector<size_t>* ranks;
+  bool operator()(size_t a, size_t b) const {
+    return (*ranks)[a] < (*ranks)[b];
+  }
+};
+
+TargetDict::TargetDict(const vector<string>& names,
+                       const vector<size_t>& lengths,
+                       const string& cluster_file)
+    : _salt(0) {
+  boost::unordered_set<string> seen;
+  foreach (const string& name, names) {
+    if (!seen.insert(name).second) {
+      logger.severe("Target '%s' appears multiple times in SAM/BAM header.",
+                    name.c_str());
+    }
+  }
+  _header_pos = cluster_order(names, cluster_file);
+  _header_ids.resize(names.size());
+  _names.reserve(names.size());
+  _lengths.reserve(names.size());
+  for (size_t id = 0; id < _header_pos.size(); ++id) {
+    _header_ids[_header_pos[id]] = id;
+    _names.push_back(names[_header_pos[id]]);
+    _lengths.push_back(lengths[_header_pos[id]]);
+  }
+  for (size_t i = 0; i < MAX_SALTS; ++i) {
+    _salt = i * 0xD6E8FEB86659FD93ULL;
+    if (build()) {
+      return;
+    }
+  }
+  logger.severe("Unable to build the target dictionary.");
+}
+
+vector<size_t> TargetDict::cluster_order(const vector<string>& names,
+                                         const string& cluster_file) const {
+  vector<size_t> order(names.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  if (cluster_file.empty()) {
+    return order;
+  }
+
+  ifstream infile(cluster_file.c_str());
+  if (!infile.is_open()) {
+    logger.severe("Unable to open cluster file '%s'.", cluster_file.c_str());
+  }
+  logger.info("Renumbering targets by cluster using '%s'...",
+              cluster_file.c_str());
+  boost::unordered_map<string, string> clusters;
+  string line, cluster, target;
+  while (getline(infile, line)) {
+    istringstream fields(line);
+    if (fields >> cluster >> target) {
+      clusters.insert(make_pair(target, cluster));
+    }
+  }
+
+  // Each cluster is ranked by its first target in the header. Targets that
+  // are not in the file get a rank of their own.
+  boost::unordered_map<string, size_t> cluster_ranks;
+  vector<size_t> ranks(names.size());
+  size_t num_clustered = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    boost::unordered_map<string, string>::const_iterator it =
+        clusters.find(names[i]);
+    if (it == clusters.end()) {
+      ranks[i] = i;
+      continue;
+    }
+    num_clustered++;
+    ranks[i] = cluster_ranks.insert(make_pair(it->second, i)).first->second;
+  }
+  ClusterRankLess less;
+  less.ranks = &ranks;
+  stable_sort(order.begin(), order.end(), less);
+  logger.info("Grouped " SIZE_T_FMT " of " SIZE_T_FMT " targets into "
+              SIZE_T_FMT " clusters.", num_clustered, names.size(),
+              cluster_ranks.size());
+  return order;
+}
+
+bool TargetDict::matches(const vector<string>& names,
+                         const vector<size_t>& lengths) const {
+  if (names.size() != _names.size() || lengths.size() != _lengths.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < names.size(); ++i) {
+    size_t id = _header_ids[i];
+    if (_names[id] != names[i] || _lengths[id] != lengths[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TargetDict::build() {
+  size_t n = _names.size();
+  _displace.assign(n / 2 + 1, 0);
+  _slots.assign(n, 0);
+
+  vector<boost::uint64_t> hashes(n);
+  vector<vector<boost::uint32_t> > members(_displace.size());
+  for (size_t i = 0; i < n; ++i) {
+    hashes[i] = hash(_names[i].data(), _names[i].size());
+    members[bucket(hashes[i])].push_back((boost::uint32_t)i);
+  }
+  vector<size_t> order(members.size());
+  for (size_t b = 0; b < order.size(); ++b) {
+    order[b] = b;
+  }
+  BucketSizeGreater greater;
+  greater.members = &members;
+  stable_sort(order.begin(), order.end(), greater);
+
+  vector<bool> taken(n, false);
+  vector<size_t> placed;
+  size_t next_free = 0;
+  foreach (size_t b, order) {
+    const vector<boost::uint32_t>& bucket_members = members[b];
+    if (bucket_members.empty()) {
+      break;
+    }
+    if (bucket_members.size() == 1) {
+      // Singletons go straight into the remaining free slots.
+      while (taken[next_free]) {
+        next_free++;
+      }
+      taken[next_free] = true;
+      _slots[next_free] = bucket_members[0];
+      _displace[b] = -(boost::int32_t)(next_free + 1);
+      continue;
+    }
+    boost::int32_t seed = 0;
+    for (; seed < MAX_SEEDS; ++seed) {
+      placed.clear();
+      foreach (boost::uint32_t id, bucket_members) {
+        size_t s = slot(hashes[id], seed);
+        if (taken[s] ||
+            std::find(placed.begin(), placed.end(), s) != placed.end()) {
+          break;
+        }
+        placed.push_back(s);
+      }
+      if (placed.size() == bucket_members.size()) {
+        break;
+      }
+    }
+    if (seed == MAX_SEEDS) {
+      return false;
+    }
+    for (size_t j = 0; j < placed.size(); ++j) {
+      taken[placed[j]] = true;
+      _slots[placed[j]] = bucket_members[j];
+    }
+    _displace[b] = seed;
+  }
+  return true;
+}
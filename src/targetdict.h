@@ -0,0 +1,224 @@
+/**
+ *  targetdict.h
+ *  express
+ *
+ *  Created by agent on 10/19/26.
+ *  Copyright 2026 agent. All rights reserved.
+ */
+
+#ifndef express_targetdict_h
+#define express_targetdict_h
+
+#include <boost/cstdint.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * The TargetDict class is an immutable dictionary of the targets named in the
+ * header of an alignment file, mapping each name to its index and length. The
+ * names are placed with a minimal perfect hash (hash and displace), so a lookup
+ * costs a single pass over the name and one comparison against the only
+ * candidate, without building a temporary string. Libraries whose headers
+ * match share a single dictionary.
+ *
+ * The index of a target is normally its position in the header. If a cluster
+ * file is given, the targets are instead renumbered so that those in the same
+ * cluster (such as the isoforms of a gene) have consecutive indices, which
+ * keeps their state close together in memory. The header position of each
+ * target is kept so that positional lookups are unaffected.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class TargetDict {
+  /**
+   * A private vector of the target names, by index.
+   */
+  std::vector<std::string> _names;
+  /**
+   * A private vector of the target lengths, by index.
+   */
+  std::vector<size_t> _lengths;
+  /**
+   * A private vector of the index of the target at each header position.
+   */
+  std::vector<size_t> _header_ids;
+  /**
+   * A private vector of the header position of each target, by index.
+   */
+  std::vector<size_t> _header_pos;
+  /**
+   * A private vector of the displacement of each bucket. Non-negative values
+   * are seeds for the slot hash of the bucket's names, and negative values
+   * store the slot of a single-name bucket directly as -(slot+1).
+   */
+  std::vector<boost::int32_t> _displace;
+  /**
+   * A private vector of the index of the target placed in each slot.
+   */
+  std::vector<boost::uint32_t> _slots;
+  /**
+   * A private 64-bit salt for the name hash, changed if a build fails.
+   */
+  boost::uint64_t _salt;
+  /**
+   * A private static member function that mixes the bits of a 64-bit value.
+   * @param h the value to mix.
+   * @return The mixed value.
+   */
+  static boost::uint64_t mix(boost::uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+  /**
+   * A private member function that hashes a name with the current salt.
+   * @param name a pointer to the characters of the name.
+   * @param len the number of characters in the name.
+   * @return The 64-bit hash of the name.
+   */
+  boost::uint64_t hash(const char* name, size_t len) const {
+    boost::uint64_t h = _salt ^ (len * 0x9E3779B97F4A7C15ULL);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+      boost::uint64_t w;
+      memcpy(&w, name + i, 8);
+      h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+    }
+    for (; i < len; ++i) {
+      h = (h ^ (unsigned char)name[i]) * 0x100000001B3ULL;
+    }
+    return mix(h);
+  }
+  /**
+   * A private member function that returns the bucket of a hashed name.
+   * @param h the hash of the name.
+   * @return The bucket of the name.
+   */
+  size_t bucket(boost::uint64_t h) const {
+    return (size_t)((h >> 32) % _displace.size());
+  }
+  /**
+   * A private member function that returns the slot of a hashed name in a
+   * bucket with the given seed.
+   * @param h the hash of the name.
+   * @param seed the non-negative displacement of the name's bucket.
+   * @return The slot of the name.
+   */
+  size_t slot(boost::uint64_t h, boost::int32_t seed) const {
+    return (size_t)(mix(h + (boost::uint64_t)(seed + 1) *
+                        0x9E3779B97F4A7C15ULL) % _slots.size());
+  }
+  /**
+   * A private member function that tries to place all names with the current
+   * salt.
+   * @return True iff a perfect hash was found.
+   */
+  bool build();
+  /**
+   * A private member function that orders the targets so that those in the
+   * same cluster are consecutive. Clusters are ordered by the header position
+   * of their first target, and targets without a cluster keep their place.
+   * @param names the names of the targets, in header order.
+   * @param cluster_file the path to a file with a cluster and a target name
+   *        on each line, separated by whitespace.
+   * @return The header positions of the targets, in index order.
+   */
+  std::vector<size_t> cluster_order(const std::vector<std::string>& names,
+                                    const std::string& cluster_file) const;
+
+ public:
+  /**
+   * A public size_t returned by find when a name is not in the dictionary.
+   */
+  static const size_t NOT_FOUND = (size_t)-1;
+  /**
+   * TargetDict constructor builds the perfect hash for the given targets.
+   * Exits with an error if a name appears more than once.
+   * @param names the names of the targets, in header order.
+   * @param lengths the lengths of the targets, in header order.
+   * @param cluster_file the path to a file grouping the targets into clusters
+   *        to renumber them by, or an empty string to keep the header order.
+   */
+  TargetDict(const std::vector<std::string>& names,
+             const std::vector<size_t>& lengths,
+             const std::string& cluster_file="");
+  /**
+   * A member function that checks whether the dictionary holds exactly the
+   * given targets in the given order.
+   * @param names the names of the targets, in header order.
+   * @param lengths the lengths of the targets, in header order.
+   * @return True iff the names and lengths match.
+   */
+  bool matches(const std::vector<std::string>& names,
+               const std::vector<size_t>& lengths) const;
+  /**
+   * An accessor for the number of targets in the dictionary.
+   * @return The number of targets.
+   */
+  size_t size() const { return _names.size(); }
+  /**
+   * An accessor for the name of a target.
+   * @param id the index of the target.
+   * @return The name of the target.
+   */
+  const std::string& name(size_t id) const { return _names[id]; }
+  /**
+   * An accessor for the length of a target given in the header.
+   * @param id the index of the target.
+   * @return The length of the target, or 0 if none was given.
+   */
+  size_t length(size_t id) const { return _lengths[id]; }
+  /**
+   * An accessor for the index of the target at a position in the header.
+   * @param pos the position in the header.
+   * @return The index of the target.
+   */
+  size_t header_id(size_t pos) const { return _header_ids[pos]; }
+  /**
+   * An accessor for the position of a target in the header.
+   * @param id the index of the target.
+   * @return The position of the target in the header.
+   */
+  size_t header_pos(size_t id) const { return _header_pos[id]; }
+  /**
+   * A member function that looks up the index of a target by name.
+   * @param name a pointer to the characters of the name.
+   * @param len the number of characters in the name.
+   * @return The index of the target, or NOT_FOUND.
+   */
+  size_t find(const char* name, size_t len) const {
+    if (_names.empty()) {
+      return NOT_FOUND;
+    }
+    boost::uint64_t h = hash(name, len);
+    boost::int32_t d = _displace[bucket(h)];
+    size_t id = _slots[(d < 0) ? (size_t)(-(d + 1)) : slot(h, d)];
+    const std::string& cand = _names[id];
+    if (cand.size() != len || memcmp(cand.data(), name, len)) {
+      return NOT_FOUND;
+    }
+    return id;
+  }
+  /**
+   * A member function that looks up the index of a target by name.
+   * @param name the null-terminated name.
+   * @return The index of the target, or NOT_FOUND.
+   */
+  size_t find(const char* name) const { return find(name, strlen(name)); }
+  /**
+   * A member function that looks up the index of a target by name.
+   * @param name the name.
+   * @return The index of the target, or NOT_FOUND.
+   */
+  size_t find(const std::string& name) const {
+    return find(name.data(), name.size());
+  }
+};
+
+#endif
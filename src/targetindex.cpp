@@ -0,0 +1,227 @@
+//
+//  targetindex.cpp
+//  express
+//
+//  Created by agent on 10/19/26.
+//  Copyright 2026 agent. All rights reserved.
+//
+
+#include "targetindex.h"
+#include "fastaparser.h"
+#include "main.h"
+#include "sequence.h"
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+using namespace std;
+namespace fs = boost::filesystem;
+namespace ip = boost::interprocess;
+
+const char INDEX_MAGIC[8] = {'X', 'P', 'R', 'S', 'I', 'D', 'X', '\0'};
+
+/**
+ * A helper function that rounds a number of bytes up to a multiple of 8.
+ */
+inline size_t align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+/**
+ * The IndexEncoder struct encodes a strided subset of the records of a FASTA
+ * file and counts their k-mers, so that several can run in parallel.
+ */
+struct IndexEncoder {
+  /**
+   * Pointers to the shared inputs and outputs of the encoders.
+   */
+  const FastaParser* fasta;
+  vector<vector<boost::uint64_t> >* words;
+  vector<size_t>* lengths;
+  /**
+   * A size_t for the order of the bias model to count (order+1)-mers for.
+   */
+  size_t order;
+  /**
+   * size_ts for the first record to encode and the stride between records.
+   */
+  size_t first;
+  size_t stride;
+  /**
+   * A vector of the k-mer counts over the records encoded by this encoder.
+   */
+  vector<boost::uint64_t> counts;
+
+  void operator()() {
+    size_t k = order + 1;
+    counts.assign((size_t)1 << (2*k), 0);
+    string seq;
+    const vector<FastaRecord>& records = fasta->records();
+    for (size_t i = first; i < records.size(); i += stride) {
+      fasta->sequence(records[i], seq);
+      SequenceFwd encoded(seq, false);
+      size_t n_words = (seq.length() + 31) / 32;
+      (*words)[i].assign(encoded.words(), encoded.words() + n_words);
+      (*lengths)[i] = seq.length();
+      // Matches the k-mers visited by MarkovModel::fast_learn.
+      for (size_t j = k; j <= seq.length(); ++j) {
+        counts[encoded.kmer(j - k, k)]++;
+      }
+    }
+  }
+};
+
+void TargetIndex::build(const string& fasta_file, size_t bias_order,
+                        size_t num_threads) {
+  FastaParser fasta(fasta_file);
+  const vector<FastaRecord>& records = fasta.records();
+  if (records.empty()) {
+    logger.severe("No targets found in MultiFASTA file '%s'.",
+                  fasta_file.c_str());
+  }
+  boost::unordered_set<string> names;
+  foreach (const FastaRecord& rec, records) {
+    if (!names.insert(rec.name).second) {
+      logger.severe("Target '%s' is duplicated in the input FASTA. Ensure "
+                    "target names are unique and re-map before re-running "
+                    "eXpress.", rec.name.c_str());
+    }
+  }
+
+  vector<vector<boost::uint64_t> > words(records.size());
+  vector<size_t> lengths(records.size());
+  num_threads = max(min(num_threads, records.size()), (size_t)1);
+  vector<IndexEncoder> encoders(num_threads);
+  boost::thread_group threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    IndexEncoder& enc = encoders[t];
+    enc.fasta = &fasta;
+    enc.words = &words;
+    enc.lengths = &lengths;
+    enc.order = bias_order;
+    enc.first = t;
+    enc.stride = num_threads;
+    threads.create_thread(boost::ref(enc));
+  }
+  threads.join_all();
+
+  TargetIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = VERSION;
+  header.bias_order = (boost::uint32_t)bias_order;
+  header.fasta_size = fs::file_size(fasta_file);
+  header.fasta_mtime = (boost::int64_t)fs::last_write_time(fasta_file);
+  header.num_targets = records.size();
+
+  vector<TargetIndexEntry> entries(records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    entries[i].name_offset = header.names_size;
+    entries[i].name_len = records[i].name.size();
+    entries[i].length = lengths[i];
+    entries[i].word_offset = header.num_words;
+    header.names_size += records[i].name.size();
+    header.num_words += words[i].size();
+  }
+
+  vector<boost::uint64_t> counts = encoders[0].counts;
+  for (size_t t = 1; t < num_threads; ++t) {
+    for (size_t j = 0; j < counts.size(); ++j) {
+      counts[j] += encoders[t].counts[j];
+    }
+  }
+
+  string index_name = index_file(fasta_file);
+  ofstream out(index_name.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    logger.severe("Unable to open index file '%s' for writing.",
+                  index_name.c_str());
+  }
+  out.write((const char*)&header, sizeof(header));
+  out.write((const char*)&entries[0], entries.size()*sizeof(entries[0]));
+  out.write((const char*)&counts[0], counts.size()*sizeof(counts[0]));
+  for (size_t i = 0; i < words.size(); ++i) {
+    if (words[i].size()) {
+      out.write((const char*)&words[i][0], words[i].size()*sizeof(words[i][0]));
+    }
+  }
+  foreach (const FastaRecord& rec, records) {
+    out.write(rec.name.c_str(), rec.name.size());
+  }
+  const char padding[8] = {0};
+  out.write(padding, align8(header.names_size) - header.names_size);
+  out.close();
+  if (out.fail()) {
+    logger.severe("Unable to write index file '%s'.", index_name.c_str());
+  }
+  logger.info("Wrote index of " SIZE_T_FMT " targets to '%s'.",
+              records.size(), index_name.c_str());
+}
+
+TargetIndex::TargetIndex()
+    : _header(NULL),
+      _entries(NULL),
+      _counts(NULL),
+      _words(NULL),
+      _names(NULL) {
+}
+
+bool TargetIndex::open(const string& fasta_file) {
+  string index_name = index_file(fasta_file);
+  boost::system::error_code ec;
+  if (!fs::exists(index_name, ec)) {
+    return false;
+  }
+
+  try {
+    _file.reset(new ip::file_mapping(index_name.c_str(), ip::read_only));
+    _region.reset(new ip::mapped_region(*_file, ip::read_only));
+  } catch (ip::interprocess_exception& e) {
+    logger.warn("Unable to map index file '%s'. Loading from FASTA instead.",
+                index_name.c_str());
+    return false;
+  }
+
+  const char* data = (const char*)_region->get_address();
+  size_t size = _region->get_size();
+  const TargetIndexHeader* header = (const TargetIndexHeader*)data;
+  if (size < sizeof(TargetIndexHeader) ||
+      memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+      header->version != VERSION) {
+    logger.warn("Index file '%s' is not a valid version %d index. Loading "
+                "from FASTA instead.", index_name.c_str(), (int)VERSION);
+    return false;
+  }
+  if (header->fasta_size != fs::file_size(fasta_file, ec) ||
+      header->fasta_mtime != (boost::int64_t)fs::last_write_time(fasta_file,
+                                                                 ec)) {
+    logger.warn("Index file '%s' is out of date with the MultiFASTA file. "
+                "Loading from FASTA instead.", index_name.c_str());
+    return false;
+  }
+
+  size_t offset = sizeof(TargetIndexHeader);
+  size_t entries_offset = offset;
+  offset += header->num_targets * sizeof(TargetIndexEntry);
+  size_t counts_offset = offset;
+  offset += ((size_t)1 << (2*(header->bias_order+1))) * sizeof(boost::uint64_t);
+  size_t words_offset = offset;
+  offset += header->num_words * sizeof(boost::uint64_t);
+  size_t names_offset = offset;
+  offset += align8(header->names_size);
+  if (offset != size) {
+    logger.warn("Index file '%s' is truncated. Loading from FASTA instead.",
+                index_name.c_str());
+    return false;
+  }
+
+  _header = header;
+  _entries = (const TargetIndexEntry*)(data + entries_offset);
+  _counts = (const boost::uint64_t*)(data + counts_offset);
+  _words = (const boost::uint64_t*)(data + words_offset);
+  _names = data + names_offset;
+  return true;
+}
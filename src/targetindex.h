@@ -0,0 +1,207 @@
+/**
+ *  targetindex.h
+ *  express
+ *
+ *  Created by agent on 10/19/26.
+ *  Copyright 2026 agent. All rights reserved.
+ */
+
+#ifndef express_targetindex_h
+#define express_targetindex_h
+
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <string>
+
+/**
+ * The TargetIndexHeader struct is stored at the start of a target index file.
+ * It is followed by the entries, the k-mer counts, the encoded sequence words
+ * and finally the packed names, each section starting on an 8-byte boundary.
+ */
+struct TargetIndexHeader {
+  /**
+   * A public array of characters identifying the file type.
+   */
+  char magic[8];
+  /**
+   * A public 32-bit integer for the version of the file format.
+   */
+  boost::uint32_t version;
+  /**
+   * A public 32-bit integer for the order of the bias model the k-mer counts
+   * were computed for.
+   */
+  boost::uint32_t bias_order;
+  /**
+   * A public 64-bit integer for the size of the indexed FASTA file in bytes.
+   */
+  boost::uint64_t fasta_size;
+  /**
+   * A public 64-bit integer for the modification time of the indexed FASTA
+   * file.
+   */
+  boost::int64_t fasta_mtime;
+  /**
+   * A public 64-bit integer for the number of targets in the index.
+   */
+  boost::uint64_t num_targets;
+  /**
+   * A public 64-bit integer for the total number of encoded sequence words.
+   */
+  boost::uint64_t num_words;
+  /**
+   * A public 64-bit integer for the total number of bytes in the names.
+   */
+  boost::uint64_t names_size;
+};
+
+/**
+ * The TargetIndexEntry struct stores the location of a single target within
+ * a target index file.
+ */
+struct TargetIndexEntry {
+  /**
+   * A public 64-bit integer for the offset of the name in the names section.
+   */
+  boost::uint64_t name_offset;
+  /**
+   * A public 64-bit integer for the number of characters in the name.
+   */
+  boost::uint64_t name_len;
+  /**
+   * A public 64-bit integer for the number of nucleotides in the sequence.
+   */
+  boost::uint64_t length;
+  /**
+   * A public 64-bit integer for the offset of the first encoded word of the
+   * sequence in the words section.
+   */
+  boost::uint64_t word_offset;
+};
+
+/**
+ * The TargetIndex class builds and reads a binary index of the targets in a
+ * MultiFASTA file, stored next to it as "<file>.xidx". The index contains the
+ * names, lengths and 2-bit encoded sequences (in the format used by
+ * SequenceFwd) of the targets, along with counts of the k-mers used to learn
+ * the background bias expectations. It is memory mapped read-only, so the
+ * sequences are used in place and shared between concurrent processes
+ * through the page cache.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class TargetIndex {
+  /**
+   * A private pointer to the mapping of the index file.
+   */
+  boost::scoped_ptr<boost::interprocess::file_mapping> _file;
+  /**
+   * A private pointer to the mapped region of the index file.
+   */
+  boost::scoped_ptr<boost::interprocess::mapped_region> _region;
+  /**
+   * A private pointer to the header at the start of the mapped file.
+   */
+  const TargetIndexHeader* _header;
+  /**
+   * A private pointer to the array of entries in the mapped file.
+   */
+  const TargetIndexEntry* _entries;
+  /**
+   * A private pointer to the k-mer counts in the mapped file.
+   */
+  const boost::uint64_t* _counts;
+  /**
+   * A private pointer to the encoded sequence words in the mapped file.
+   */
+  const boost::uint64_t* _words;
+  /**
+   * A private pointer to the packed names in the mapped file.
+   */
+  const char* _names;
+
+ public:
+  /**
+   * A public 32-bit integer for the current version of the file format.
+   * Indices with a different version are ignored.
+   */
+  static const boost::uint32_t VERSION = 1;
+  /**
+   * A static member function that returns the path of the index for the given
+   * FASTA file.
+   * @param fasta_file the path to the MultiFASTA file.
+   * @return The path to the index file.
+   */
+  static std::string index_file(const std::string& fasta_file) {
+    return fasta_file + ".xidx";
+  }
+  /**
+   * A static member function that builds the index for the given FASTA file
+   * and writes it next to it. Exits with an error on failure.
+   * @param fasta_file the path to the MultiFASTA file.
+   * @param bias_order the order of the bias model to count k-mers for.
+   * @param num_threads the number of threads to encode the sequences with.
+   */
+  static void build(const std::string& fasta_file, size_t bias_order,
+                    size_t num_threads);
+  /**
+   * TargetIndex constructor. The index is empty until opened.
+   */
+  TargetIndex();
+  /**
+   * A member function that maps the index of the given FASTA file, if one
+   * exists and is up to date with the file.
+   * @param fasta_file the path to the MultiFASTA file.
+   * @return True iff a valid index was found and mapped.
+   */
+  bool open(const std::string& fasta_file);
+  /**
+   * An accessor for the number of targets in the index.
+   * @return The number of targets.
+   */
+  size_t size() const { return (size_t)_header->num_targets; }
+  /**
+   * An accessor for the header of the index, which identifies the FASTA file
+   * it was built from.
+   * @return A reference to the header.
+   */
+  const TargetIndexHeader& header() const { return *_header; }
+  /**
+   * A member function that returns the name of a target.
+   * @param i the index of the target in the file.
+   * @return The name of the target.
+   */
+  std::string name(size_t i) const {
+    return std::string(_names + _entries[i].name_offset,
+                       (size_t)_entries[i].name_len);
+  }
+  /**
+   * An accessor for the length of a target.
+   * @param i the index of the target in the file.
+   * @return The number of nucleotides in the target sequence.
+   */
+  size_t length(size_t i) const { return (size_t)_entries[i].length; }
+  /**
+   * An accessor for the encoded sequence of a target.
+   * @param i the index of the target in the file.
+   * @return A pointer to the encoded words of the target sequence.
+   */
+  const boost::uint64_t* words(size_t i) const {
+    return _words + _entries[i].word_offset;
+  }
+  /**
+   * An accessor for the order of the bias model the k-mer counts are for.
+   * @return The order of the bias model.
+   */
+  size_t bias_order() const { return (size_t)_header->bias_order; }
+  /**
+   * An accessor for the forward-strand (order+1)-mer counts over all targets.
+   * @return A pointer to the 4^(order+1) counts.
+   */
+  const boost::uint64_t* kmer_counts() const { return _counts; }
+};
+
+#endif
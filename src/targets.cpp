@@ -14,6 +14,11 @@
 #include "mismatchmodel.h"
 #include "mapparser.h"
 #include "library.h"
+#include "fastaparser.h"
+#include "targetindex.h"
+#include "biascache.h"
+#include "threadsafety.h"
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cassert>
@@ -23,68 +28,108 @@
 
 using namespace std;
 
-Target::Target(TargID id, const std::string& name, const std::string& seq,
-               bool prob_seq, double alpha, const Librarian* libs,
-               const BiasBoss* known_bias_boss, const LengthDistribution* known_fld)
+Target::Target(TargID id, TargetState* state, const std::string& name,
+               const std::string& seq, bool prob_seq, double alpha,
+               const Librarian* libs,
+               const BiasBoss* known_bias_boss, const LengthDistribution* known_fld,
+               const BiasCacheEntry* cached_bias)
    : _libs(libs),
      _id(id),
+     _state(state),
      _name(name),
      _seq_f(seq, 0, prob_seq),
      _seq_r(_seq_f),
-     _alpha(log(alpha)),
-     _ret_params(&_curr_params),
-     _uniq_counts(0),
-     _tot_counts(0),
-     _avg_bias(0),
-     _avg_bias_buffer(0),
-     _solvable(false) {
+     _avg_bias_buffer(0) {
+  init(alpha, known_bias_boss, known_fld, cached_bias);
+}
+
+Target::Target(TargID id, TargetState* state, const std::string& name,
+               const boost::uint64_t* words, size_t len, bool prob_seq,
+               double alpha, const Librarian* libs,
+               const BiasBoss* known_bias_boss, const LengthDistribution* known_fld,
+               const BiasCacheEntry* cached_bias)
+   : _libs(libs),
+     _id(id),
+     _state(state),
+     _name(name),
+     _seq_f(words, len, prob_seq),
+     _seq_r(_seq_f),
+     _avg_bias_buffer(0) {
+  init(alpha, known_bias_boss, known_fld, cached_bias);
+}
+
+void Target::init(double alpha, const BiasBoss* known_bias_boss,
+                  const LengthDistribution* known_fld,
+                  const BiasCacheEntry* cached_bias) {
+  _state->alpha = log(alpha);
   if ((_libs->curr_lib()).bias_table) {
-    _start_bias.reset(new std::vector<float>(seq.length(),0));
-    _start_bias_buffer.reset(new std::vector<float>(seq.length(),0));
-    _end_bias.reset(new std::vector<float>(seq.length(),0));
-    _end_bias_buffer.reset(new std::vector<float>(seq.length(),0));
+    _start_bias.reset(new std::vector<float>(length(),0));
+    _start_bias_buffer.reset(new std::vector<float>(length(),0));
+    _end_bias.reset(new std::vector<float>(length(),0));
+    _end_bias_buffer.reset(new std::vector<float>(length(),0));
+  }
+  if (cached_bias) {
+    if (_start_bias_buffer) {
+      copy(cached_bias->start_bias, cached_bias->start_bias + length(),
+           _start_bias_buffer->begin());
+      copy(cached_bias->end_bias, cached_bias->end_bias + length(),
+           _end_bias_buffer->begin());
+      _avg_bias_buffer = cached_bias->avg_bias;
+    }
+    _cached_eff_len_buffer = cached_bias->eff_len;
+  } else {
+    update_target_bias_buffer(known_bias_boss, known_fld);
   }
-  update_target_bias_buffer(known_bias_boss, known_fld);
   swap_bias_parameters();
-  _init_pseudo_mass = _cached_eff_len + _alpha;
+  _state->init_pseudo_mass = _state->cached_eff_len + _state->alpha;
 }
 
 void Target::add_hit(const FragHit& hit, double v, double m) {
+  RoundParams& curr_params = _state->curr_params;
   double p = hit.params()->posterior;
-  _curr_params.mass = log_add(_curr_params.mass, p+m);
-  double mass_with_pseudo = log_add(_ret_params->mass, _init_pseudo_mass);
+  curr_params.mass = log_add(curr_params.mass, p+m);
+  double mass_with_pseudo = log_add(_state->ret_params->mass,
+                                    _state->init_pseudo_mass);
   if (p != LOG_1 || v != LOG_0) {
     if (p != LOG_0) {
-      _curr_params.ambig_mass = log_add(_curr_params.ambig_mass, p+m);
-      _curr_params.tot_ambig_mass = log_add(_curr_params.tot_ambig_mass, m);
+      curr_params.ambig_mass = log_add(curr_params.ambig_mass, p+m);
+      curr_params.tot_ambig_mass = log_add(curr_params.tot_ambig_mass, m);
     }
-    double p_hat = _curr_params.ambig_mass;
-    if (_curr_params.tot_ambig_mass != LOG_0) {
-      p_hat -= _curr_params.tot_ambig_mass;
+    double p_hat = curr_params.ambig_mass;
+    if (curr_params.tot_ambig_mass != LOG_0) {
+      p_hat -= curr_params.tot_ambig_mass;
     } else {
       assert(p_hat == LOG_0);
     }
     assert(p_hat == LOG_0 || p_hat <= LOG_1);
-    _curr_params.var_sum = min(log_add(_curr_params.var_sum, v + m),
-                               _curr_params.tot_ambig_mass + p_hat
-                               + log_sub(LOG_1, p_hat));
+    curr_params.var_sum = min(log_add(curr_params.var_sum, v + m),
+                              curr_params.tot_ambig_mass + p_hat
+                              + log_sub(LOG_1, p_hat));
     double var_update = log_add(p + 2*m, v + 2*m);
-    _curr_params.mass_var = min(log_add(_curr_params.mass_var, var_update),
-                                mass_with_pseudo + log_sub(_bundle->mass(),
-                                                      mass_with_pseudo));
+    curr_params.mass_var = min(log_add(curr_params.mass_var, var_update),
+                               mass_with_pseudo +
+                               log_sub(_state->bundle->mass(),
+                                       mass_with_pseudo));
   }
-  if (_curr_params.haplotype) {
-    _curr_params.haplotype->update_mass(this, hit.frag_name(),
-                                        hit.params()->align_likelihood, p);
+  if (curr_params.haplotype) {
+    curr_params.haplotype->update_mass(this, hit.frag_name_key(),
+                                       hit.params()->align_likelihood, p);
   }
-  (_libs->curr_lib()).targ_table->update_total_fpb(m - _cached_eff_len);
+  (_libs->curr_lib()).targ_table->update_total_fpb(m - _state->cached_eff_len);
+}
+
+void Target::add_unique_mass(double mass) {
+  assert(!_state->curr_params.haplotype);
+  _state->curr_params.mass = log_add(_state->curr_params.mass, mass);
+  (_libs->curr_lib()).targ_table->update_total_fpb(mass -
+                                                   _state->cached_eff_len);
 }
 
 void Target::round_reset() {
-  _last_params = _curr_params;
-  _curr_params = RoundParams();
-  _ret_params = &_last_params;
-  _init_pseudo_mass = LOG_0;
+  _last_params = _state->curr_params;
+  _state->curr_params = RoundParams();
+  _state->ret_params = &_last_params;
+  _state->init_pseudo_mass = LOG_0;
 }
 
 double Target::rho() const {
@@ -98,13 +143,14 @@ double Target::rho() const {
 
 double Target::mass(bool with_pseudo) const {
   if (!with_pseudo) {
-    return _ret_params->mass;
+    return _state->ret_params->mass;
   }
-  return log_add(_ret_params->mass, _alpha+_cached_eff_len+_avg_bias);
+  return log_add(_state->ret_params->mass,
+                 _state->alpha + _state->cached_eff_len + _state->avg_bias);
 }
 
 double Target::mass_var() const {
-  return _ret_params->mass_var;
+  return _state->ret_params->mass_var;
 }
 
 double Target::sample_likelihood(bool with_pseudo,
@@ -177,7 +223,7 @@ double Target::est_effective_length(const LengthDistribution* fld,
   }
   
   if (with_bias) {
-    eff_len += _avg_bias;
+    eff_len += _state->avg_bias;
   }
 
   return eff_len;
@@ -185,9 +231,9 @@ double Target::est_effective_length(const LengthDistribution* fld,
 
 double Target::cached_effective_length(bool with_bias) const {
   if (with_bias) {
-    return _cached_eff_len + _avg_bias;
+    return _state->cached_eff_len + _state->avg_bias;
   }
-  return _cached_eff_len;
+  return _state->cached_eff_len;
 }
 
 void Target::update_target_bias_buffer(const BiasBoss* bias_table,
@@ -201,8 +247,8 @@ void Target::update_target_bias_buffer(const BiasBoss* bias_table,
 }
 
 void Target::swap_bias_parameters() {
-  _cached_eff_len = _cached_eff_len_buffer;
-  _avg_bias = _avg_bias_buffer;
+  _state->cached_eff_len = _cached_eff_len_buffer;
+  _state->avg_bias = _avg_bias_buffer;
   _start_bias.swap(_start_bias_buffer);
   _end_bias.swap(_end_bias_buffer);
 }
@@ -231,7 +277,6 @@ void HaplotypeHandler::commit_buffer() {
 
 HaplotypeHandler::HaplotypeHandler(vector<Target*> targets, double alpha=1)
     : _haplo_taus(1, targets.size(), alpha),
-      _frag_name_buff(""),
       _align_likelihoods_buff(vector<double>(targets.size(), LOG_0)),
       _masses_buff(vector<double>(targets.size(), LOG_0)),
       _committed(true) {
@@ -261,7 +306,7 @@ double HaplotypeHandler::get_mass(const Target* targ, bool with_pseudo) {
   
   double total_mass = LOG_0;
   foreach(const Target* targ, _targets) {
-    total_mass = log_add(total_mass, targ->_ret_params->mass);
+    total_mass = log_add(total_mass, targ->_state->ret_params->mass);
     if (with_pseudo){
       total_mass = log_add(total_mass, targ->cached_effective_length());
     }
@@ -270,11 +315,11 @@ double HaplotypeHandler::get_mass(const Target* targ, bool with_pseudo) {
   return _haplo_taus(0, i) + total_mass;
 }
 
-void HaplotypeHandler::update_mass(const Target* targ, const string& frag_name,
+void HaplotypeHandler::update_mass(const Target* targ, const NameKey& frag_key,
                                    double align_likelihood, double mass) {
-  if (frag_name != _frag_name_buff) {
+  if (frag_key != _frag_key_buff) {
     commit_buffer();
-    _frag_name_buff = frag_name;
+    _frag_key_buff = frag_key;
   } else {
     assert(!_committed);
   }
@@ -289,75 +334,425 @@ void HaplotypeHandler::update_mass(const Target* targ, const string& frag_name,
 }
 
 
+/**
+ * The TargetJob struct stores a FASTA record or indexed sequence to be built
+ * into a Target, along with the result.
+ */
+struct TargetJob {
+  /**
+   * A public string for the name of the target.
+   */
+  std::string name;
+  /**
+   * A public pointer to the FASTA record of the target, or NULL if it is
+   * loaded from an index.
+   */
+  const FastaRecord* record;
+  /**
+   * A public pointer to the encoded sequence of the target in the index, or
+   * NULL if it is loaded from the FASTA file.
+   */
+  const boost::uint64_t* words;
+  /**
+   * A public TargID for the index of the target in the alignment file.
+   */
+  TargID id;
+  /**
+   * A public size_t for the length of the target in the alignment file.
+   */
+  size_t length;
+  /**
+   * A public double for the initial pseudo-counts per bp of the target.
+   */
+  double alpha;
+  /**
+   * A public pointer to the built Target, or NULL if the sequence length did
+   * not match the alignment file.
+   */
+  Target* targ;
+  /**
+   * A public size_t for the length of the sequence in the FASTA file or
+   * index.
+   */
+  size_t seq_length;
+  /**
+   * A public pointer to the cached bias and effective length of the target, or
+   * NULL if they are to be computed.
+   */
+  const BiasCacheEntry* cached_bias;
+  /**
+   * A public 64-bit hash of the sequence of the target, used to find targets
+   * with identical sequences.
+   */
+  boost::uint64_t seq_hash;
+  /**
+   * A public bool that is true once the job has been processed.
+   */
+  bool done;
+};
+
+/**
+ * The TargetBuilder class extracts the sequences of FASTA records (or takes
+ * them from an index) and constructs their Targets on a pool of threads. The
+ * jobs are processed in order, and the caller waits for each in turn, so it
+ * can add the Targets in file order while later ones are still being built.
+ */
+class TargetBuilder {
+  /**
+   * A private pointer to the loaded FASTA file, or NULL if the sequences come
+   * from an index.
+   */
+  const FastaParser* _fasta;
+  /**
+   * A private reference to the jobs, in file order.
+   */
+  std::vector<TargetJob>& _jobs;
+  /**
+   * Private copies of the Target constructor arguments shared by all jobs.
+   */
+  bool _prob_seqs;
+  const Librarian* _libs;
+  const BiasBoss* _known_bias_boss;
+  const LengthDistribution* _known_fld;
+  /**
+   * Private pointers to the storage of the Targets and their hot state, both
+   * indexed by TargID.
+   */
+  CacheAlignedArray<Target>* _targets;
+  CacheAlignedArray<TargetState>* _states;
+  /**
+   * A private size_t for the index of the next job to be taken by a thread.
+   */
+  size_t _next;
+  /**
+   * A private mutex protecting _next and the done flags of the jobs.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable signalled whenever a job is done.
+   */
+  boost::condition_variable _cond;
+  /**
+   * A private vector of pointers to the building threads.
+   */
+  std::vector<boost::thread*> _threads;
+
+  /**
+   * A private member function that extracts the sequence of a job and builds
+   * its Target if the length matches the alignment file.
+   * @param job the job to process.
+   */
+  void build(TargetJob& job) {
+    if (job.words) {
+      if (job.seq_length == job.length) {
+        job.targ = new (_targets->slot(job.id))
+            Target(job.id, &(*_states)[job.id], job.name, job.words,
+                   job.seq_length, _prob_seqs, job.alpha, _libs,
+                   _known_bias_boss, _known_fld, job.cached_bias);
+        _targets->built(job.id);
+      }
+      job.seq_hash = BiasCache::hash((const char*)job.words,
+                                     (job.seq_length + 31) / 32 *
+                                     sizeof(boost::uint64_t));
+      return;
+    }
+    string seq;
+    _fasta->sequence(*job.record, seq);
+    job.seq_length = seq.length();
+    job.seq_hash = BiasCache::hash(seq.data(), seq.size());
+    if (job.seq_length == job.length) {
+      job.targ = new (_targets->slot(job.id))
+          Target(job.id, &(*_states)[job.id], job.name, seq, _prob_seqs,
+                 job.alpha, _libs, _known_bias_boss, _known_fld,
+                 job.cached_bias);
+      _targets->built(job.id);
+    }
+  }
+
+  /**
+   * A private member function run by each thread to process jobs until none
+   * are left.
+   */
+  void run() {
+    while (true) {
+      size_t i;
+      {
+        boost::unique_lock<boost::mutex> lock(_mut);
+        if (_next == _jobs.size()) {
+          return;
+        }
+        i = _next++;
+      }
+      build(_jobs[i]);
+      {
+        boost::unique_lock<boost::mutex> lock(_mut);
+        _jobs[i].done = true;
+      }
+      _cond.notify_all();
+    }
+  }
+
+ public:
+  /**
+   * TargetBuilder constructor starts the threads.
+   * @param num_threads the number of threads to build with. If less than 2,
+   *        jobs are built by wait on the calling thread.
+   */
+  TargetBuilder(const FastaParser* fasta, std::vector<TargetJob>& jobs,
+                bool prob_seqs, const Librarian* libs,
+                const BiasBoss* known_bias_boss,
+                const LengthDistribution* known_fld,
+                CacheAlignedArray<Target>* targets,
+                CacheAlignedArray<TargetState>* states, size_t num_threads)
+      : _fasta(fasta),
+        _jobs(jobs),
+        _prob_seqs(prob_seqs),
+        _libs(libs),
+        _known_bias_boss(known_bias_boss),
+        _known_fld(known_fld),
+        _targets(targets),
+        _states(states),
+        _next(0) {
+    if (num_threads > 1) {
+      num_threads = min(num_threads, jobs.size());
+      for (size_t i = 0; i < num_threads; ++i) {
+        _threads.push_back(new boost::thread(&TargetBuilder::run, this));
+      }
+    }
+  }
+
+  /**
+   * TargetBuilder destructor stops and joins the threads.
+   */
+  ~TargetBuilder() {
+    {
+      boost::unique_lock<boost::mutex> lock(_mut);
+      _next = _jobs.size();
+    }
+    foreach (boost::thread* t, _threads) {
+      t->join();
+      delete t;
+    }
+  }
+
+  /**
+   * A member function that returns the given job once it is done, building it
+   * on the calling thread if there is no thread pool.
+   * @param i the index of the job.
+   * @return A reference to the processed job.
+   */
+  const TargetJob& wait(size_t i) {
+    if (_threads.empty()) {
+      build(_jobs[i]);
+      return _jobs[i];
+    }
+    boost::unique_lock<boost::mutex> lock(_mut);
+    while (!_jobs[i].done) {
+      _cond.wait(lock);
+    }
+    return _jobs[i];
+  }
+};
+
+/**
+ * A helper function that checks whether two targets have identical sequences.
+ * @param t1 one of the targets.
+ * @param t2 the other target.
+ * @return True iff the sequences are identical.
+ */
+bool same_sequence(const Target& t1, const Target& t2) {
+  if (t1.length() != t2.length()) {
+    return false;
+  }
+  size_t n_words = (t1.length() + 31) / 32;
+  return !memcmp(t1.seq_fwd().words(), t2.seq_fwd().words(),
+                 n_words * sizeof(boost::uint64_t));
+}
+
 TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
-                         bool prob_seqs, bool known_aux_params, double alpha,
-                         const AlphaMap* alpha_map, const Librarian* libs)
-    :  _libs(libs) {
+                         bool prob_seqs, const string& aux_param_file,
+                         const string& bias_cache_file, double alpha,
+                         const AlphaMap* alpha_map, const Librarian* libs,
+                         size_t num_threads, bool collapse_identical)
+    :  _libs(libs), _bias_final(false) {
   string info_msg = "Loading target sequences";
   const Library& lib = _libs->curr_lib();
-  const TransIndex& targ_index = lib.map_parser->targ_index();
-  const TransIndex& targ_lengths = lib.map_parser->targ_lengths();
+  bool known_aux_params = aux_param_file.size();
+  // Known auxiliary parameters are never updated, so the bias values of the
+  // targets are final once they are loaded. No other thread is running yet.
+  _bias_final = known_aux_params;
+  const TargetDict& targ_dict = *lib.map_parser->targ_dict();
   if (lib.bias_table && !known_aux_params) {
     info_msg += " and measuring bias background";
   }
   info_msg += "...";
   logger.info(info_msg.c_str());
 
-  size_t num_targs = targ_index.size();
+  size_t num_targs = targ_dict.size();
   _targ_map = vector<Target*>(num_targs, NULL);
+  _rep_ids.resize(num_targs);
+  for (size_t id = 0; id < num_targs; ++id) {
+    _rep_ids[id] = id;
+  }
+  _targ_store.allocate(num_targs);
+  _targ_states.allocate(num_targs);
+  for (size_t id = 0; id < num_targs; ++id) {
+    _targ_states.construct(id);
+  }
   _total_fpb = log(alpha*num_targs);
 
+  // Use the index of the FASTA file if there is an up-to-date one.
+  boost::scoped_ptr<FastaParser> fasta;
+  _index.reset(new TargetIndex());
+  if (_index->open(targ_fasta_file)) {
+    logger.info("Using target index '%s'.",
+                TargetIndex::index_file(targ_fasta_file).c_str());
+  } else {
+    _index.reset(NULL);
+    fasta.reset(new FastaParser(targ_fasta_file));
+  }
+  size_t num_records = (_index) ? _index->size() : fasta->records().size();
+
   boost::unordered_set<string> target_names;
-      
-  ifstream infile (targ_fasta_file.c_str());
-  string line;
-  string seq = "";
-  string name = "";
-  if (infile.is_open()) {
-    while (infile.good()) {
-      getline(infile, line, '\n');
-      if (line.empty()) {
-        continue;
+  vector<TargetJob> jobs;
+  bool all_aligned = true;
+  for (size_t i = 0; i < num_records; ++i) {
+    string name = (_index) ? _index->name(i) : fasta->records()[i].name;
+    if (target_names.count(name)) {
+      logger.severe("Target '%s' is duplicated in the input FASTA. Ensure "
+                    "target names are unique and re-map before re-running "
+                    "eXpress.", name.c_str());
+    }
+    if (alpha_map && !alpha_map->count(name)) {
+      logger.severe("Target '%s' is was not found in the prior parameter "
+                    "file.", name.c_str());
+    }
+    target_names.insert(name);
+
+    size_t id = targ_dict.find(name);
+    if (id == TargetDict::NOT_FOUND) {
+      logger.warn("Target '%s' exists in MultiFASTA but not alignment "
+                  "(SAM/BAM) file.", name.c_str());
+      all_aligned = false;
+      continue;
+    }
+    TargetJob job;
+    job.name = name;
+    job.record = (fasta) ? &fasta->records()[i] : NULL;
+    job.words = (_index) ? _index->words(i) : NULL;
+    job.id = id;
+    job.length = targ_dict.length(id);
+    job.alpha = (alpha_map) ? alpha_map->find(name)->second : alpha;
+    job.targ = NULL;
+    job.seq_length = (_index) ? _index->length(i) : 0;
+    job.cached_bias = NULL;
+    job.seq_hash = 0;
+    job.done = false;
+    jobs.push_back(job);
+  }
+
+  const BiasBoss* known_bias_boss = (known_aux_params) ? lib.bias_table.get()
+                                                       : NULL;
+  const LengthDistribution* known_fld = (known_aux_params) ? lib.fld.get()
+                                                           : NULL;
+  bool update_bias = lib.bias_table && !known_aux_params;
+  // The background k-mer counts in the index cover every target, so they can
+  // only be used if every target is in the alignment file.
+  if (update_bias && _index && all_aligned && !prob_seqs &&
+      _index->bias_order() == lib.bias_table->order()) {
+    lib.bias_table->update_expectations(_index->kmer_counts());
+    update_bias = false;
+  }
+
+  // With known parameters, the target biases and effective lengths only depend
+  // on the sequences and the parameter file, so they can be cached across runs.
+  // The sequences are identified by the header of the index if one is mapped,
+  // which records the size and modification time of the FASTA file, and
+  // otherwise by the FASTA contents already in memory.
+  BiasCache bias_cache;
+  bool cache_hit = false;
+  bool use_cache = known_aux_params && bias_cache_file.size();
+  boost::uint64_t fasta_hash = 0;
+  boost::uint64_t param_hash = 0;
+  if (use_cache) {
+    fasta_hash = (_index) ? BiasCache::hash((const char*)&_index->header(),
+                                            sizeof(TargetIndexHeader))
+                          : BiasCache::hash(fasta->data(), fasta->size());
+    param_hash = BiasCache::hash_file(aux_param_file);
+    if (bias_cache.open(bias_cache_file, fasta_hash, param_hash,
+                        (bool)lib.bias_table) &&
+        bias_cache.entries().size() == jobs.size()) {
+      cache_hit = true;
+      for (size_t i = 0; i < jobs.size() && cache_hit; ++i) {
+        const BiasCacheEntry& entry = bias_cache.entries()[i];
+        cache_hit = (entry.length == jobs[i].length &&
+                     entry.name_hash == BiasCache::hash(jobs[i].name.c_str(),
+                                                        jobs[i].name.size()));
       }
-      if (line[0] == '>') {
-        if (!name.empty()) {
-          if (alpha_map) {
-            alpha = alpha_map->find(name)->second;
+    }
+    if (cache_hit) {
+      logger.info("Using cached target biases from '%s'.",
+                  bias_cache_file.c_str());
+      for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].cached_bias = &bias_cache.entries()[i];
+      }
+    }
+  }
+
+  {
+    // Targets are built in parallel but added in file order, so that bundles
+    // and bias expectations do not depend on the number of threads.
+    TargetBuilder builder(fasta.get(), jobs, prob_seqs, _libs,
+                          known_bias_boss, known_fld, &_targ_store,
+                          &_targ_states, num_threads);
+    // Targets with identical sequences are found by the hash of their
+    // sequences and collapsed into the first one.
+    boost::unordered_multimap<boost::uint64_t, Target*> seq_hashes;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      const TargetJob& job = builder.wait(i);
+      if (!job.targ) {
+        logger.severe("Target '%s' differs in length between MultiFASTA and "
+                      "alignment (SAM/BAM) files (%d  vs. %d).",
+                      job.name.c_str(), job.seq_length, job.length);
+      }
+      Target* rep = NULL;
+      if (collapse_identical) {
+        typedef boost::unordered_multimap<boost::uint64_t, Target*>::iterator
+            SeqIt;
+        pair<SeqIt, SeqIt> range = seq_hashes.equal_range(job.seq_hash);
+        for (SeqIt it = range.first; it != range.second && !rep; ++it) {
+          if (same_sequence(*it->second, *job.targ)) {
+            rep = it->second;
           }
-          add_targ(name, seq, prob_seqs, known_aux_params, alpha, targ_index,
-                   targ_lengths);
-        }
-        name = line.substr(1,line.find(' ')-1);
-        if (target_names.count(name)) {
-          logger.severe("Target '%s' is duplicated in the input FASTA. Ensure "
-                        "target names are unique and re-map before re-running "
-                        "eXpress.", name.c_str());
         }
-        if (alpha_map && !alpha_map->count(name)) {
-          logger.severe("Target '%s' is was not found in the prior parameter "
-                        "file.", name.c_str());
+        if (!rep) {
+          seq_hashes.insert(make_pair(job.seq_hash, job.targ));
         }
-        target_names.insert(name);
-        seq = "";
-      } else {
-        seq += line;
-      }
-    }
-    if (!name.empty()) {
-      if (alpha_map) {
-        alpha = alpha_map->find(name)->second;
       }
-      add_targ(name, seq, prob_seqs, known_aux_params, alpha, targ_index,
-               targ_lengths);
+      add_targ(job.targ, update_bias, rep);
     }
+  }
+  if (lib.bias_table && !known_aux_params) {
+    lib.bias_table->normalize_expectations();
+  }
 
-    infile.close();
-    if (lib.bias_table && !known_aux_params) {
-      lib.bias_table->normalize_expectations();
+  if (use_cache && !cache_hit) {
+    vector<BiasCacheEntry> entries(jobs.size());
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      const Target& targ = *jobs[i].targ;
+      BiasCacheEntry& entry = entries[i];
+      entry.name_hash = BiasCache::hash(jobs[i].name.c_str(),
+                                        jobs[i].name.size());
+      entry.length = targ.length();
+      entry.avg_bias = targ._state->avg_bias;
+      entry.eff_len = targ._state->cached_eff_len;
+      entry.start_bias = (targ._start_bias) ? &(*targ._start_bias)[0] : NULL;
+      entry.end_bias = (targ._end_bias) ? &(*targ._end_bias)[0] : NULL;
+    }
+    if (!BiasCache::write(bias_cache_file, fasta_hash, param_hash, entries)) {
+      logger.warn("Unable to write target bias cache '%s'.",
+                  bias_cache_file.c_str());
     }
-  } else {
-    logger.severe("Unable to open MultiFASTA file '%s'.",
-                  targ_fasta_file.c_str());
   }
 
   if (size() == 0) {
@@ -365,19 +760,28 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
                   targ_fasta_file.c_str());
   }
 
-  for(TransIndex::const_iterator it = targ_index.begin();
-      it != targ_index.end(); ++it) {
-    if (!_targ_map[it->second]) {
+  for (size_t id = 0; id < targ_dict.size(); ++id) {
+    if (!_targ_map[id]) {
       logger.severe("Sequence for target '%s' not found in MultiFASTA file "
-                    "'%s'.", it->first.c_str(), targ_fasta_file.c_str());
+                    "'%s'.", targ_dict.name(id).c_str(),
+                    targ_fasta_file.c_str());
     }
   }
   logger.info("Initialized %d targets.", size());
+  if (_collapsed.size()) {
+    size_t num_collapsed = 0;
+    foreach (const CollapsedMap::value_type& c, _collapsed) {
+      num_collapsed += c.second.size();
+    }
+    logger.info("Collapsed " SIZE_T_FMT " targets with sequences identical to "
+                "another target into " SIZE_T_FMT " representatives.",
+                num_collapsed, _collapsed.size());
+  }
   
   // Load haplotype information, if provided
   if (haplotype_file.size()) {
     logger.info("Loading haplotype information...");
-    infile.open(haplotype_file.c_str());
+    ifstream infile(haplotype_file.c_str());
     size_t num_haplotype_groups = 0;
     if (infile.is_open()) {
       const size_t BUFF_SIZE = 99999;
@@ -392,11 +796,12 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
         vector<Target*> haplotype_targets;
         char *p = strtok(line_buff, ",");
         do {
-          if (targ_index.count(p) == 0) {
+          size_t id = targ_dict.find(p);
+          if (id == TargetDict::NOT_FOUND) {
             logger.severe("Haplotype target '%s' does not exist in MultiFASTA "
                           "or alignment files.", p);
           }
-          haplotype_targets.push_back(_targ_map[targ_index.at(p)]);
+          haplotype_targets.push_back(_targ_map[id]);
           p = strtok(NULL, ",");
         } while (p);
 
@@ -422,41 +827,34 @@ TargetTable::TargetTable(string targ_fasta_file, string haplotype_file,
 }
 
 TargetTable::~TargetTable() {
-  foreach(Target* targ, _targ_map) {
-    delete targ;
-  }
+  _targ_store.clear();
 }
 
-void TargetTable::add_targ(const string& name, const string& seq, bool prob_seq,
-                           bool known_aux_params, double alpha,
-                           const TransIndex& targ_index,
-                           const TransIndex& targ_lengths) {
-  TransIndex::const_iterator it = targ_index.find(name);
-  if (it == targ_index.end()) {
-    logger.warn("Target '%s' exists in MultiFASTA but not alignment "
-                   "(SAM/BAM) file.", name.c_str());
-    return;
-  }
-
-  if (targ_lengths.find(name)->second != seq.length()) {
-    logger.severe("Target '%s' differs in length between MultiFASTA and "
-                  "alignment (SAM/BAM) files (%d  vs. %d).", name.c_str(),
-                  seq.length(), targ_lengths.find(name)->second);
-  }
-
+void TargetTable::add_targ(Target* targ, bool update_bias, Target* rep) {
   const Library& lib = _libs->curr_lib();
-  const BiasBoss* known_bias_boss = (known_aux_params) ? lib.bias_table.get()
-                                                       : NULL;
-  const LengthDistribution* known_fld = (known_aux_params) ? lib.fld.get()
-                                                           : NULL;
-  
-  Target* targ = new Target(it->second, name, seq, prob_seq, alpha, _libs,
-                            known_bias_boss, known_fld);
-  if (lib.bias_table && !known_aux_params) {
+  if (update_bias) {
     (lib.bias_table)->update_expectations(*targ);
   }
   _targ_map[targ->id()] = targ;
-  targ->bundle(_bundle_table.create_bundle(targ));
+  if (!rep) {
+    targ->bundle(_bundle_table.create_bundle(targ));
+    return;
+  }
+  // The representative takes the pseudo-counts of the collapsed target, which
+  // is left out of the bundles.
+  _rep_ids[targ->id()] = rep->id();
+  _collapsed[rep->id()].push_back(targ);
+  TargetState& rep_state = *rep->_state;
+  rep_state.alpha = log_add(rep_state.alpha, targ->_state->alpha);
+  rep_state.init_pseudo_mass = rep_state.cached_eff_len + rep_state.alpha;
+}
+
+const vector<Target*>* TargetTable::collapsed(TargID id) const {
+  if (_collapsed.empty()) {
+    return NULL;
+  }
+  CollapsedMap::const_iterator it = _collapsed.find(id);
+  return (it == _collapsed.end()) ? NULL : &it->second;
 }
 
 Target* TargetTable::get_targ(TargID id) {
@@ -472,6 +870,9 @@ Bundle* TargetTable::merge_bundles(Bundle* b1, Bundle* b2) {
 
 void TargetTable::round_reset() {
   foreach(Target* targ, _targ_map) {
+    if (!targ->bundle()) {
+      continue;
+    }
     targ->round_reset();
     targ->bundle()->incr_mass(targ->mass(false));
   }
@@ -572,11 +973,11 @@ void TargetTable::masses_to_counts() {
       for (size_t i = 0; i < bundle_targ.size(); ++i) {
         Target& targ = *bundle_targ[i];
         double mass = targ.mass(false);
-        targ._curr_params.mass = log((double)targ_counts[i]);
-        targ._curr_params.mass_var = min(targ.mass_var(),
+        targ._state->curr_params.mass = log((double)targ_counts[i]);
+        targ._state->curr_params.mass_var = min(targ.mass_var(),
                                          mass + log_sub(l_bundle_mass, mass))
                                      + l_var_renorm;
-        targ._curr_params.var_sum = targ.var_sum() + l_var_renorm;
+        targ._state->curr_params.var_sum = targ.var_sum() + l_var_renorm;
       }
     }
     
@@ -585,6 +986,14 @@ void TargetTable::masses_to_counts() {
   }
 }
 
+/**
+ * A helper function that orders bundles by the ID of their first target, so
+ * that they are output in the same order in every run.
+ */
+bool bundle_less(const Bundle* b1, const Bundle* b2) {
+  return b1->targets()->front()->id() < b2->targets()->front()->id();
+}
+
 void TargetTable::output_results(string output_dir, size_t tot_counts,
                                  bool output_varcov, bool output_rdds) {
   FILE * expr_file = fopen((output_dir + "/results.xprs").c_str(), "w");
@@ -608,10 +1017,14 @@ void TargetTable::output_results(string output_dir, size_t tot_counts,
   const double l_tot_counts = log((double)tot_counts);
   
   vector<Result> res(size());
-  
+
+  vector<Bundle*> bundles(_bundle_table.bundles().begin(),
+                          _bundle_table.bundles().end());
+  sort(bundles.begin(), bundles.end(), bundle_less);
+
   size_t bundle_id = 0;
   size_t t_id = 0;
-  foreach (Bundle* bundle, _bundle_table.bundles()) {
+  foreach (Bundle* bundle, bundles) {
     ++bundle_id;
 
     const vector<Target*>& bundle_targ = *(bundle->targets());
@@ -780,6 +1193,28 @@ void TargetTable::output_results(string output_dir, size_t tot_counts,
     }
   }
   
+  // Split the estimates of each representative evenly among the targets
+  // collapsed into it. The split itself cannot be identified, so any copy may
+  // hold anything from none to all of the total. The confidence interval
+  // therefore runs from 0 to the upper bound of the total, and the ambiguous
+  // counts are given the uniform distribution used for unsolvable targets.
+  foreach (const CollapsedMap::value_type& c, _collapsed) {
+    Result& rep_res = res[c.first];
+    const double k = (double)(c.second.size() + 1);
+    rep_res.est_counts /= k;
+    rep_res.eff_counts /= k;
+    rep_res.cpb /= k;
+    rep_res.fpkm /= k;
+    rep_res.fpkm_lo = 0;
+    if (rep_res.est_counts > 0) {
+      rep_res.count_alpha = 1;
+      rep_res.count_beta = 1;
+    }
+    foreach (const Target* targ, c.second) {
+      res[targ->id()] = rep_res;
+    }
+  }
+
   // Calculate total counts per base
   double cpb_sum = 0.0;
   for (size_t i = 0; i < size(); ++i) {
@@ -790,7 +1225,7 @@ void TargetTable::output_results(string output_dir, size_t tot_counts,
   const double l_mil = log(1000000.);
   bundle_id = 0;
   t_id = 0;
-  foreach (Bundle* bundle, _bundle_table.bundles()) {
+  foreach (Bundle* bundle, bundles) {
     ++bundle_id;
     
     const vector<Target*>& bundle_targ = *(bundle->targets());
@@ -811,13 +1246,26 @@ void TargetTable::output_results(string output_dir, size_t tot_counts,
         tpm = 0.0;
       }
       
-      fprintf(expr_file, "" SIZE_T_FMT "\t%s\t" SIZE_T_FMT "\t%f\t" SIZE_T_FMT
-              "\t" SIZE_T_FMT "\t%f\t%f\t%e\t%e\t%e\t%e\t%e\t%c\t%e\n",
-              bundle_id, targ.name().c_str(), targ.length(), res[t_id].eff_len,
-              targ.tot_counts(), targ.uniq_counts(), res[t_id].est_counts,
-              res[t_id].eff_counts, res[t_id].count_alpha, res[t_id].count_beta,
-              res[t_id].fpkm, res[t_id].fpkm_lo, res[t_id].fpkm_hi,
-              (targ.solvable())?'T':'F', tpm);
+      // Fragments of a representative are ambiguous among the targets
+      // collapsed into it, which are output with the same estimates.
+      const vector<Target*>* collapsed_targs = collapsed(t_id);
+      size_t uniq_counts = (collapsed_targs) ? 0 : targ.uniq_counts();
+      bool solvable = !collapsed_targs && targ.solvable();
+      vector<const Target*> out_targs(1, &targ);
+      if (collapsed_targs) {
+        out_targs.insert(out_targs.end(), collapsed_targs->begin(),
+                         collapsed_targs->end());
+      }
+      foreach (const Target* out_targ, out_targs) {
+        fprintf(expr_file, "" SIZE_T_FMT "\t%s\t" SIZE_T_FMT "\t%f\t"
+                SIZE_T_FMT "\t" SIZE_T_FMT
+                "\t%f\t%f\t%e\t%e\t%e\t%e\t%e\t%c\t%e\n",
+                bundle_id, out_targ->name().c_str(), out_targ->length(),
+                res[t_id].eff_len, targ.tot_counts(), uniq_counts,
+                res[t_id].est_counts, res[t_id].eff_counts,
+                res[t_id].count_alpha, res[t_id].count_beta, res[t_id].fpkm,
+                res[t_id].fpkm_lo, res[t_id].fpkm_hi, (solvable)?'T':'F', tpm);
+      }
       ++t_id;
     }
   }
@@ -840,7 +1288,8 @@ void TargetTable::update_total_fpb(double incr_amt) {
   _total_fpb = log_add(_total_fpb, incr_amt);
 }
 
-void TargetTable::asynch_bias_update(boost::mutex* mutex) {
+void TargetTable::asynch_bias_update(boost::mutex* mutex,
+                                     BiasUpdateGate* gate) {
   BiasBoss* bg_table = NULL;
   boost::scoped_ptr<BiasBoss> bias_table;
   boost::scoped_ptr<LengthDistribution> fld;
@@ -850,6 +1299,9 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
   const Library& lib = _libs->curr_lib();
 
   while(running) {
+    if (gate && !gate->wait()) {
+      break;
+    }
     if (bg_table) {
       bg_table->normalize_expectations();
     }
@@ -882,8 +1334,12 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
 
     vector<double> fl_cdf = fld->cmf();
 
-    // Buffer results of long computations.
+    // Buffer results of long computations. Collapsed targets are skipped, as
+    // their representatives stand in for them.
     foreach(Target* targ, _targ_map) {
+      if (!targ->bundle()) {
+        continue;
+      }
       targ->lock();
       targ->update_target_bias_buffer(bias_table.get(), fld.get());
       if (bg_table) {
@@ -895,16 +1351,40 @@ void TargetTable::asynch_bias_update(boost::mutex* mutex) {
       boost::unique_lock<boost::mutex> lock(*mutex);
       // Do quick atomic swap
       foreach(Target* targ, _targ_map) {
-        targ->lock();
+        if (targ->bundle()) {
+          targ->lock();
+        }
       }
       foreach(Target* targ, _targ_map) {
-        targ->swap_bias_parameters();
-        targ->unlock();
+        if (targ->bundle()) {
+          targ->swap_bias_parameters();
+          targ->unlock();
+        }
       }
     }
+    if (gate) {
+      gate->finish();
+    }
   }
 
   if (bg_table) {
     delete bg_table;
   }
+  // Only the final update after burn-out ends the loop early. Otherwise the
+  // thread was stopped and may be restarted.
+  if (running) {
+    boost::unique_lock<boost::mutex> lock(_bias_final_mut);
+    _bias_final = true;
+  }
+  // The flag is set before the gate is released, so that the main thread
+  // sees it right after the final pass.
+  if (gate) {
+    gate->finish();
+    gate->close();
+  }
+}
+
+bool TargetTable::bias_final() const {
+  boost::unique_lock<boost::mutex> lock(_bias_final_mut);
+  return _bias_final;
 }
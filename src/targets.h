@@ -20,6 +20,8 @@
 #include <vector>
 #include "main.h"
 #include "bundles.h"
+#include "cachealigned.h"
+#include "fragments.h"
 #include "sequence.h"
 
 class LengthDistribution;
@@ -28,6 +30,9 @@ class BiasBoss;
 class MismatchTable;
 class Librarian;
 class HaplotypeHandler;
+class BiasUpdateGate;
+struct BiasCacheEntry;
+class TargetIndex;
 class TargetTable;
 
 /**
@@ -76,6 +81,79 @@ struct RoundParams {
 
 typedef size_t TargID;
 
+/**
+ * The TargetState struct holds the members of a Target that are read or
+ * written for every fragment during the EM. The TargetTable keeps these for
+ * all targets in a contiguous array indexed by TargID, one or more whole cache
+ * lines per target, so that the processing threads do not false-share them
+ * and so that the rest of the Target (names, sequences, bias vectors) stays
+ * out of the cache.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+struct TargetState {
+  /**
+   * A RoundParams struct that stores the parameters for the current round.
+   */
+  RoundParams curr_params;
+  /**
+   * A pointer to the RoundParams that should be used in any accessors.
+   */
+  RoundParams* ret_params;
+  /**
+   * A double that stores the (logged) pseudo-mass-per-base.
+   */
+  double alpha;
+  /**
+   * A double storing the initial pseudo mass assigned to the target.
+   */
+  double init_pseudo_mass;
+  /**
+   * A double storing the (logged) product of the average 3' and 5' biases for
+   * the target.
+   */
+  double avg_bias;
+  /**
+   * A double storing the most recently updated (logged) effective length as
+   * calculated by the bias updater thread.
+   */
+  double cached_eff_len;
+  /**
+   * A pointer to the Bundle the target is a member of.
+   */
+  Bundle* bundle;
+  /**
+   * A size_t that stores the number of fragments (non-logged) uniquely mapping
+   * to the target.
+   */
+  size_t uniq_counts;
+  /**
+   * A size_t that stores the fragment counts (non-logged) for the bundle. The
+   * total bundle counts is the sum of this value for all targets in the
+   * bundle.
+   */
+  size_t tot_counts;
+  /**
+   * A boolean specifying whether a unique solution exists. True iff a unique
+   * read is mapped to the target or all other targets in a mapping are
+   * solvable.
+   */
+  bool solvable;
+  /**
+   * A mutex to provide thread-safety for variables with threaded update.
+   */
+  mutable boost::mutex mutex;
+  /**
+   * TargetState constructor initializes the state of a target with no
+   * fragments.
+   */
+  TargetState() : ret_params(&curr_params), alpha(LOG_0),
+                  init_pseudo_mass(LOG_0), avg_bias(0), cached_eff_len(LOG_0),
+                  bundle(NULL), uniq_counts(0), tot_counts(0),
+                  solvable(false) {}
+};
+
 /**
  * The Target class is used to store objects for the targets being mapped to.
  * Besides storing basic information about the object (id, length), it also
@@ -99,6 +177,11 @@ class Target {
    * A private TargID that stores the hashed target name.
    */
   TargID _id;
+  /**
+   * A private pointer to the hot state of the target, stored apart from the
+   * rest of the Target by the TargetTable.
+   */
+  TargetState* _state;
   /**
    * A private string that stores the target name.
    */
@@ -111,49 +194,11 @@ class Target {
    * A private Sequence object that stores the reverse target sequence.
    */
   SequenceRev _seq_r;
-  /**
-   * A private double object that stores the pseudo-mass-per-base.
-   */
-  double _alpha;
-  /**
-   * A private RoundParams struct that stores the parameters for the current
-   * round.
-   */
-  RoundParams _curr_params;
   /**
    * A private RoundParams struct that stores the parameters for the previous
    * round.
    */
   RoundParams _last_params;
-  /**
-   * A private pointer to the RoundParams that should be used in any
-   * accessors.
-   */
-  RoundParams* _ret_params;
-  /**
-   * A private size_t that stores the number of fragments (non-logged)
-   * uniquely mapping to this target.
-   */
-  size_t _uniq_counts;
-  /**
-   * A private size_t that stores the fragment counts (non-logged) for the
-   * bundle. The total bundle counts is the sum of this value for all targets
-   * in the bundle.
-   */
-  size_t _tot_counts;
-  /**
-   * A private double storing the initial pseudo mass assigned to the target.
-   */
-  double _init_pseudo_mass;
-  /**
-   * A private pointer to the Bundle this Target is a member of.
-   */
-  Bundle* _bundle;
-  /**
-   * A private mutex to provide thread-safety for variables with threaded
-   * update.
-   */
-  mutable boost::mutex _mutex;
   /**
    * A scoped pointer to a private float vector storing the (logged) 5' bias
    * at each position.
@@ -172,35 +217,36 @@ class Target {
    * Buffers the end bias to allow for atomic updating.
    */
   boost::scoped_ptr<std::vector<float> > _end_bias_buffer;
-  /**
-   * A private double storing the (logged) product of the average 3' and 5'
-   * biases for the target.
-   */
-  double _avg_bias;
   /**
    * Buffers the average bias to allow for atomic updating.
    */
   double _avg_bias_buffer;
-  /**
-   * A private double storing the most recently updated (logged) effective
-   * length as calculated by the bias updater thread.
-   */
-  double _cached_eff_len;
   /**
    * Buffers the cached effective length to allow for atomic updating.
    */
   double _cached_eff_len_buffer;
   /**
-   * A private boolean specifying whether a unique solution exists. True iff
-   * a unique read is mapped to the target or all other targets in a mapping
-   * are solvable.
+   * A private function that allocates the bias vectors and computes the
+   * initial bias and effective length, once the sequence is set.
+   * @param alpha a double that specifies the intial pseudo-counts
+   *        (non-logged).
+   * @param known_bias_boss a pointer to bias parameters provided as input, NULL
+   *        if none given.
+   * @param known_fld a pointer to a fragment length distribution provided as
+   *        input, NULL if none given.
+   * @param cached_bias a pointer to the bias and effective length of the target
+   *        from a BiasCache, or NULL if they should be computed.
    */
-  bool _solvable;
+  void init(double alpha, const BiasBoss* known_bias_boss,
+            const LengthDistribution* known_fld,
+            const BiasCacheEntry* cached_bias);
 
 public:
   /**
    * Target Constructor.
    * @param id a unique TargID identifier.
+   * @param state a pointer to the TargetState of the target, owned by the
+   *        TargetTable.
    * @param name a string that stores the target name.
    * @param seq a string that stores the target sequence.
    * @param prob_seq a bool that specifies if the sequence is to be treated
@@ -213,19 +259,35 @@ public:
    *        if none given.
    * @param known_fld a pointer to a fragment length distribution provided as
    *        input, NULL if none given.
-   */
-  Target(TargID id, const std::string& name, const std::string& seq,
-         bool prob_seq, double alpha, const Librarian* libs,
-         const BiasBoss* known_bias_boss, const LengthDistribution* known_fld);
+   * @param cached_bias a pointer to the bias and effective length of the target
+   *        previously computed from the known parameters, or NULL if none.
+   */
+  Target(TargID id, TargetState* state, const std::string& name,
+         const std::string& seq, bool prob_seq, double alpha,
+         const Librarian* libs,
+         const BiasBoss* known_bias_boss, const LengthDistribution* known_fld,
+         const BiasCacheEntry* cached_bias=NULL);
+  /**
+   * Target Constructor for an already encoded sequence, such as one in a
+   * memory-mapped TargetIndex. The encoded words must outlive the target.
+   * @param words a pointer to the 2-bit encoded target sequence.
+   * @param len the number of nucleotides in the target sequence.
+   * The other parameters are as above.
+   */
+  Target(TargID id, TargetState* state, const std::string& name,
+         const boost::uint64_t* words, size_t len, bool prob_seq,
+         double alpha, const Librarian* libs,
+         const BiasBoss* known_bias_boss, const LengthDistribution* known_fld,
+         const BiasCacheEntry* cached_bias=NULL);
   /**
    * A member function that locks the target mutex to provide thread safety.
    * The lock should be held by any thread that calls a method of the Target.
    */
-  void lock() const { _mutex.lock(); }
+  void lock() const { _state->mutex.lock(); }
   /**
    * A member function that unlocks the target mutex.
    */
-  void unlock() const { _mutex.unlock(); }
+  void unlock() const { _state->mutex.unlock(); }
   /**
    * An accessor for the target name.
    * @return string containing target name.
@@ -258,18 +320,49 @@ public:
     }
     return _seq_f;
   }
+  /**
+   * An accessor for the target's forward sequence by its concrete type, so
+   * that templated loops can use its non-virtual accessors.
+   * @return Const reference to the target's SequenceFwd object.
+   */
+  const SequenceFwd& seq_fwd() const { return _seq_f; }
+  /**
+   * An accessor for the target's forward sequence by its concrete type
+   * (non-const).
+   * @return Non-const reference to the target's SequenceFwd object.
+   */
+  SequenceFwd& seq_fwd() { return _seq_f; }
+  /**
+   * An accessor for the target's reverse complement sequence by its concrete
+   * type, so that templated loops can use its non-virtual accessors.
+   * @return Const reference to the target's SequenceRev object.
+   */
+  const SequenceRev& seq_rev() const { return _seq_r; }
+  /**
+   * An accessor for the target's reverse complement sequence by its concrete
+   * type (non-const).
+   * @return Non-const reference to the target's SequenceRev object.
+   */
+  SequenceRev& seq_rev() { return _seq_r; }
   /**
    * Mutator for the HaplotypeHandler of the target.
    * @param hh a shared pointer to the HaplotypeHandler.
    **/
   void haplotype(boost::shared_ptr<HaplotypeHandler> hh) {
-    _curr_params.haplotype = hh;
+    _state->curr_params.haplotype = hh;
+  }
+  /**
+   * An accessor for whether the target is part of a haplotype group.
+   * @return True iff a HaplotypeHandler is set for the current round.
+   */
+  bool has_haplotype() const {
+    return _state->curr_params.haplotype.get() != NULL;
   }
   /**
    * Mutator for the alpha (prior count) parameter of the target.
    * @param hh non-logged value to set alpha to.
    **/
-  void alpha(double alpha) { _alpha = log(alpha); }
+  void alpha(double alpha) { _state->alpha = log(alpha); }
   /**
    * An accessor for the length of the target sequence.
    * @return The target sequence length.
@@ -299,14 +392,14 @@ public:
    * An accessor for the (logged) weighted sum of the variance on assignments.
    * @return The (logged) weighted sum of the variance on the assignments.
    */
-  double var_sum() const { return _ret_params->var_sum; }
+  double var_sum() const { return _state->ret_params->var_sum; }
   /**
    * An accessor for the the (logged) total mass of ambiguous fragments mapping
    * to the target.
    * @return The (logged) total mass of ambiguous fragments mapping to the
    *         target.
    */
-  double tot_ambig_mass() const { return _ret_params->tot_ambig_mass; }
+  double tot_ambig_mass() const { return _state->ret_params->tot_ambig_mass; }
   /**
    * A member function that prepares the target object for the next round of
    * batch EM.
@@ -317,23 +410,23 @@ public:
    * either uniquely or ambiguously.
    * @return The total fragment count.
    */
-  size_t tot_counts() const { return _tot_counts; }
+  size_t tot_counts() const { return _state->tot_counts; }
   /**
    * An accessor for the the current count of fragments uniquely mapped to this
    * target.
    * @return The unique fragment count.
    */
-  size_t uniq_counts() const { return _uniq_counts; }
+  size_t uniq_counts() const { return _state->uniq_counts; }
   /**
    * An accessor for the pointer to the Bundle this Target is a member of.
    * @return A pointer to the Bundle this target is a member of.
    */
-  Bundle* bundle() const { return _bundle; }
+  Bundle* bundle() const { return _state->bundle; }
   /**
    * A mutator to set the Bundle this Target is a member of.
    * @param b a pointer to the Bundle to set this Target as a member of.
    */
-  void bundle(Bundle* b) { _bundle = b; }
+  void bundle(Bundle* b) { _state->bundle = b; }
   /**
    * A member function that increases the expected fragment counts and
    * variance based on the assignment parameters of the given FagHit.
@@ -344,6 +437,14 @@ public:
    *        mapped.
    */
   void add_hit(const FragHit& h, double v, double mass);
+  /**
+   * A member function that adds the total mass of fragments that map uniquely
+   * to this target, as add_hit does for each of them one at a time. Used to
+   * apply the mass that a processing thread gathered without locking. The
+   * target must be locked, and must not be part of a haplotype group.
+   * @param mass a double specifying the (logged) total mass of the fragments.
+   */
+  void add_unique_mass(double mass);
   /**
    * A member function that increases the count of fragments mapped to this
    * target.
@@ -353,10 +454,10 @@ public:
    */
   void incr_counts(bool uniq, size_t incr_amt = 1) {
     if (uniq) {
-      _solvable = true;
+      _state->solvable = true;
     }
-    _tot_counts += incr_amt;
-    _uniq_counts += incr_amt * uniq;
+    _state->tot_counts += incr_amt;
+    _state->uniq_counts += incr_amt * uniq;
   }
   /**
    * A member function that returns (a value proportional to) the probability
@@ -414,18 +515,18 @@ public:
    */
   void swap_bias_parameters();
   /**
-   * An accessor for the _solvable flag.
+   * An accessor for the solvable flag.
    * @return a boolean specifying whether or not the target has a unique
    *         solution for its abundance estimate.
    */
 
-  bool solvable() const { return _solvable; }
+  bool solvable() const { return _state->solvable; }
   /**
-   * A mutator that sets the _solvable flag.
+   * A mutator that sets the solvable flag.
    * @param a boolean specifying whether or not the target has a unique solution
    *        for its abundance estimate.
    */
-  void solvable(bool s) { _solvable = s; }
+  void solvable(bool s) { _state->solvable = s; }
 };
 
 /**
@@ -454,11 +555,11 @@ class HaplotypeHandler {
    */
   FrequencyMatrix<double> _haplo_taus;
   /**
-   * A buffer to hold the name of the current fragment being processed. The
+   * A buffer to hold the name key of the current fragment being processed. The
    * fragment is not split internally until all aligned targets in the set have
    * their likelihoods calculated in the main thread.
    */
-  std::string _frag_name_buff;
+  NameKey _frag_key_buff;
   /**
    * A buffer to hold the likelihoods that have been calculated for the current
    * fragment.
@@ -498,16 +599,16 @@ class HaplotypeHandler {
    * Buffers the mass and likelihood assigned to the given fragment for the
    * given target.
    */
-  void update_mass(const Target* targ, const std::string& frag_name,
+  void update_mass(const Target* targ, const NameKey& frag_key,
                    double align_likelihood, double mass);
 };
 
 
 typedef std::vector<Target*> TransMap;
-typedef boost::unordered_map<std::string, size_t> TransIndex;
 typedef boost::unordered_map<size_t, float> CovarMap;
 typedef boost::unordered_map<std::string, double> AlphaMap;
 typedef boost::unordered_set<std::vector<Target*> > HaplotypeSet;
+typedef boost::unordered_map<TargID, std::vector<Target*> > CollapsedMap;
 
 /**
  * The TargetTable class is used to keep track of the Target objects for a run.
@@ -523,6 +624,15 @@ class TargetTable {
    * tables (bias_table, mismatch_table, fld).
    */
   const Librarian* _libs;
+  /**
+   * A private array storing the hot state of the targets, indexed by TargID.
+   */
+  CacheAlignedArray<TargetState> _targ_states;
+  /**
+   * A private array storing the Target objects contiguously, indexed by
+   * TargID.
+   */
+  CacheAlignedArray<Target> _targ_store;
   /**
    * A private map to look up pointers to Target objects by their TargID id.
    */
@@ -551,24 +661,53 @@ class TargetTable {
    * A private mutex to make accesses to _total_fpb thread-safe.
    */
   mutable boost::mutex _fpb_mut;
+  /**
+   * A private bool that is true once the bias update thread has made its last
+   * change to the bias values of the targets.
+   */
+  bool _bias_final;
+  /**
+   * A private mutex to make accesses to _bias_final thread-safe, as it is set
+   * by the bias update thread and read by the processing threads.
+   */
+  mutable boost::mutex _bias_final_mut;
 
   /**
-   * A private function that validates and adds a target pointer to the table.
-   * @param name the name of the trancript.
-   * @param seq the sequence of the target.
-   * @param prob_seqs a bool that specifies if the sequence is to be treated
-   *        probablistically, for RDD detection.
-   * @param known_aux_params a bool that is true iff the auxiliary parameters
-   *        (fld, bias) are provided and need not be learned.
-   * @param alpha a double that specifies the initial pseudo-counts for each bp
-   *        of the target (non-logged).
-   * @param targ_index the target-to-index map from the alignment file.
-   * @param targ_lengths the target-to-length map from the alignment file, for
-   *        validation.
-   */
-  void add_targ(const std::string& name, const std::string& seq, bool prob_seqs,
-                bool known_aux_params, double alpha,
-                const TransIndex& targ_index, const TransIndex& targ_lengths);
+   * A private pointer to the memory-mapped index the target sequences were
+   * loaded from, or NULL if they were loaded from the FASTA file. Must outlive
+   * the targets, which borrow its sequences.
+   */
+  boost::scoped_ptr<TargetIndex> _index;
+  /**
+   * A private vector of the TargID of the representative of each target,
+   * which is the target itself unless its sequence is identical to that of an
+   * earlier target.
+   */
+  std::vector<TargID> _rep_ids;
+  /**
+   * A private map from the TargID of each representative to the targets
+   * collapsed into it. Only the representative takes part in the EM, and its
+   * estimates are split evenly among all of them for output.
+   */
+  CollapsedMap _collapsed;
+
+  /**
+   * A private function that adds a built target to the table, creating its
+   * bundle and updating the bias expectations.
+   * @param targ a pointer to the Target to add. Ownership is taken.
+   * @param update_bias a bool that is true iff the background bias
+   *        expectations should be updated with the target's sequence.
+   * @param rep a pointer to an earlier Target with an identical sequence to
+   *        collapse this one into, or NULL if there is none.
+   */
+  void add_targ(Target* targ, bool update_bias, Target* rep=NULL);
+  /**
+   * A private function that returns the targets collapsed into a target.
+   * @param id the TargID of the target.
+   * @return A pointer to the targets collapsed into the given one, or NULL if
+   *         there are none.
+   */
+  const std::vector<Target*>* collapsed(TargID id) const;
 
 public:
   /**
@@ -580,18 +719,30 @@ public:
    *        haplotypes (optional).
    * @param prob_seqs a bool that specifies if the sequence is to be treated
    *        probablistically, for RDD detection.
-   * @param known_aux_params a bool that is true iff the auxiliary parameters
-   *        (fld, bias) are provided and need not be learned.
+   * @param aux_param_file a string storing the path to the file the auxiliary
+   *        parameters (fld, bias) were loaded from, or empty if they are to be
+   *        learned.
+   * @param bias_cache_file a string storing the path to the cache of the
+   *        target biases and effective lengths computed from the auxiliary
+   *        parameter file, or empty if they are not to be cached. The cache is
+   *        read if it matches the targets and parameters, and written
+   *        otherwise.
    * @param alpha a double that specifies the intial pseudo-counts for each bp
    *        of the targets (non-logged).
    * @param alpha_map an optional pointer to a map object that specifies
    *        proportional weights of pseudo-counts for each target.
    * @param libs a pointer to the struct containing pointers to the global
    *        parameter tables (bias_table, mismatch_table, fld).
+   * @param num_threads the number of threads used to extract sequences and
+   *        build the targets.
+   * @param collapse_identical a bool that is true iff targets with identical
+   *        sequences should be collapsed into a single representative.
    */
   TargetTable(std::string targ_fasta_file, std::string haplotype_file,
-              bool prob_seqs, bool known_aux_params, double alpha,
-              const AlphaMap* alpha_map, const Librarian* libs);
+              bool prob_seqs, const std::string& aux_param_file,
+              const std::string& bias_cache_file, double alpha,
+              const AlphaMap* alpha_map, const Librarian* libs,
+              size_t num_threads, bool collapse_identical);
   /**
    * TargetTable Destructor. Deletes all of the target objects in the table.
    */
@@ -602,6 +753,14 @@ public:
    * @return A pointer to the target with the given id.
    */
   Target* get_targ(TargID id);
+  /**
+   * A member function that returns the id of the target that fragments
+   * aligned to the given target are assigned to. This is the target itself
+   * unless it was collapsed into another with an identical sequence.
+   * @param id of the target queried.
+   * @return The id of the representative of the target.
+   */
+  TargID representative(TargID id) const { return _rep_ids[id]; }
   /**
    * A member function that readies all Target objects in the table for the next
    * round of batch EM.
@@ -685,8 +844,18 @@ public:
    * background bias values, target bias values, and target effective lengths.
    * @param mutex a pointer to the mutex to be used to protect the global fld
    *        and bias tables during updates.
+   * @param gate a pointer to the gate that paces the updates, or NULL if they
+   *        run as often as they can.
+   */
+  void asynch_bias_update(boost::mutex* mutex, BiasUpdateGate* gate=NULL);
+  /**
+   * An accessor for whether the bias values of the targets will no longer
+   * change, so that alignment likelihoods can be calculated without locking
+   * the targets.
+   * @return True iff the auxiliary parameters were given or the bias update
+   *         thread has made its last update.
    */
-  void asynch_bias_update(boost::mutex* mutex);
+  bool bias_final() const;
   void enable_bundle_threadsafety() { _bundle_table.threadsafe_mode(true); }
   void disable_bundle_threadsafety() { _bundle_table.threadsafe_mode(false); }
   /**
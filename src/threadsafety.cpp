@@ -13,7 +13,7 @@ ThreadSafeFragQueue::ThreadSafeFragQueue(size_t max_size)
     : _max_size(max_size) {
 }
 
-Fragment* ThreadSafeFragQueue::pop(bool block) {
+FragBatch* ThreadSafeFragQueue::pop(bool block) {
   boost::unique_lock<boost::mutex> lock(_mut);
   while (_queue.empty()) {
     if (!block) {
@@ -23,19 +23,19 @@ Fragment* ThreadSafeFragQueue::pop(bool block) {
   }
 
   _cond.notify_all();
-  Fragment* res = _queue.front();
+  FragBatch* res = _queue.front();
   _queue.pop();
   return res;
 }
 
-void ThreadSafeFragQueue::push(Fragment* frag) {
+void ThreadSafeFragQueue::push(FragBatch* batch) {
   boost::unique_lock<boost::mutex> lock(_mut);
   while (_queue.size() == _max_size) {
     _cond.wait(lock);
   }
 
   _cond.notify_all();
-  return _queue.push(frag);
+  return _queue.push(batch);
 }
 
 bool ThreadSafeFragQueue::is_empty(bool block) {
@@ -48,3 +48,37 @@ bool ThreadSafeFragQueue::is_empty(bool block) {
   }
   return true;
 }
+
+void BiasUpdateGate::step() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  if (_closed) {
+    return;
+  }
+  size_t pass = ++_requested;
+  _cond.notify_all();
+  while (_finished < pass && !_closed) {
+    _cond.wait(lock);
+  }
+}
+
+bool BiasUpdateGate::wait() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  while (_requested == _finished && !_closed) {
+    _cond.wait(lock);
+  }
+  return _requested > _finished;
+}
+
+void BiasUpdateGate::finish() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  if (_finished < _requested) {
+    _finished++;
+  }
+  _cond.notify_all();
+}
+
+void BiasUpdateGate::close() {
+  boost::unique_lock<boost::mutex> lock(_mut);
+  _closed = true;
+  _cond.notify_all();
+}
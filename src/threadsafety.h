@@ -11,23 +11,35 @@
 
 #include <boost/thread.hpp>
 #include <queue>
+#include <vector>
 
 class Fragment;
 
 /**
- * The ThreadSafeFragQueue is a threadsafe queue of Fragment pointers.
+ * A FragBatch is a group of consecutively parsed Fragment pointers that are
+ * passed between threads together so that the cost of synchronization is
+ * amortized over many fragments.
+ */
+typedef std::vector<Fragment*> FragBatch;
+/**
+ * The maximum number of Fragments placed in a single FragBatch by the parser.
+ */
+const size_t FRAG_BATCH_SIZE = 256;
+
+/**
+ * The ThreadSafeFragQueue is a threadsafe queue of FragBatch pointers.
  *  @author    Adam Roberts
  *  @date      2012
  *  @copyright Artistic License 2.0
  **/
 class ThreadSafeFragQueue {
   /**
-   * A private queue of Fragment objects.
+   * A private queue of FragBatch pointers.
    */
-  std::queue<Fragment*> _queue;
+  std::queue<FragBatch*> _queue;
   /**
-   * A private size_t representing the number of Fragments allowed in the queue
-   * before blocking on a push.
+   * A private size_t representing the number of FragBatches allowed in the
+   * queue before blocking on a push.
    */
   size_t _max_size;
   /**
@@ -44,27 +56,26 @@ class ThreadSafeFragQueue {
  public:
   /**
    * ThreadSafeFragQueue Constructor.
-   * @param max_size a size_t representing the number of Fragments allowed in
-
+   * @param max_size a size_t representing the number of FragBatches allowed in
    *        the queue before blocking on a push.
    */
   ThreadSafeFragQueue(size_t max_size);
   /**
-   * A member function that pops the next Fragment pointer off the queue. If
+   * A member function that pops the next FragBatch pointer off the queue. If
    * the queue is empty, returns NULL if block is false, otherwise blocks until
    * one is available.
    * @param block a bool specifying whether or not the function should block if
    *        the queue is empty.
-   * @return The next Fragment pointer on the queue or NULL if the queue is
+   * @return The next FragBatch pointer on the queue or NULL if the queue is
    *         empty and block is false.
    */
-  Fragment* pop(bool block=true);
+  FragBatch* pop(bool block=true);
   /**
-   * A member function that pushes the given Fragment pointer onto the queue.
+   * A member function that pushes the given FragBatch pointer onto the queue.
    * Blocks if the queue is full.
-   * @param frag the Fragment pointer to push onto the queue.
+   * @param batch the FragBatch pointer to push onto the queue.
    */
-  void push(Fragment* frag);
+  void push(FragBatch* batch);
   /**
    * A member function that returns true iff the queue is empty. If block is
    * true, the function blocks until the queue is empty and returns true.
@@ -73,6 +84,74 @@ class ThreadSafeFragQueue {
    * @return True iff the queue is empty.
    */
   bool is_empty(bool block=false);
+  /**
+   * An accessor for the number of FragBatches allowed in the queue before
+   * blocking on a push.
+   * @return The maximum size of the queue.
+   */
+  size_t max_size() const { return _max_size; }
+};
+
+/**
+ * The BiasUpdateGate class runs the auxiliary parameter update thread in
+ * lockstep with the main processing thread. The update thread waits at the
+ * gate before each pass, and the main thread opens it at fixed fragments and
+ * waits for the pass to finish. The updates are then made at the same points
+ * in every run, instead of whenever the update thread gets to them.
+ *  @author    agent
+ *  @date      2026
+ *  @copyright Artistic License 2.0
+ **/
+class BiasUpdateGate {
+  /**
+   * A private size_t for the number of passes requested by the main thread.
+   */
+  size_t _requested;
+  /**
+   * A private size_t for the number of passes finished by the update thread.
+   */
+  size_t _finished;
+  /**
+   * A private bool that is true once the update thread will make no more
+   * passes, either because it is done or because it was stopped.
+   */
+  bool _closed;
+  /**
+   * A private mutex used with _cond to protect the counters.
+   */
+  boost::mutex _mut;
+  /**
+   * A private condition variable used with _mut to signal requested and
+   * finished passes.
+   */
+  boost::condition_variable _cond;
+
+ public:
+  /**
+   * BiasUpdateGate Constructor.
+   */
+  BiasUpdateGate() : _requested(0), _finished(0), _closed(false) {}
+  /**
+   * A member function used by the main thread to request a pass of the update
+   * thread. Blocks until the pass is finished or the gate is closed.
+   */
+  void step();
+  /**
+   * A member function used by the update thread to wait for the next pass to
+   * be requested.
+   * @return False iff the gate was closed before a pass was requested.
+   */
+  bool wait();
+  /**
+   * A member function used by the update thread to signal that its current
+   * pass is finished.
+   */
+  void finish();
+  /**
+   * A member function that closes the gate, releasing both threads. Further
+   * calls to step return immediately and wait returns false.
+   */
+  void close();
 };
 
 /**
@@ -84,26 +163,41 @@ class ThreadSafeFragQueue {
  **/
 struct ParseThreadSafety {
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been parsed
-   * but not pre-processed.
+   * A public ThreadSafeFragQueue of batches of Fragments that have been parsed
+   * and numbered but not processed. Once the auxiliary parameters are burned
+   * out, the processing threads pop directly from this queue.
    */
   ThreadSafeFragQueue proc_in;
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been
-   * pre-processed but not processed.
+   * A public ThreadSafeFragQueue of batches of Fragments that have been
+   * dispatched by the main thread but not processed. Only used when the main
+   * thread must see every Fragment during multi-threaded processing.
    */
   ThreadSafeFragQueue proc_on;
   /**
-   * A public ThreadSafeFragQueue of pointers to Fragments that have been
+   * A public ThreadSafeFragQueue of batches of Fragments that have been
    * processed but not post-processed.
    */
   ThreadSafeFragQueue proc_out;
+  /**
+   * A public size_t for the global number of the next Fragment to be parsed
+   * (starting at 1). Only modified by the parse thread while it is running.
+   */
+  size_t n;
+  /**
+   * A public double for the global mass of the next Fragment to be parsed
+   * (logged). Only modified by the parse thread while it is running.
+   */
+  double mass_n;
   /**
    * PraseThreadSafety constructor intializes queues to the given size.
    * @param q_size the maximum size for the ThreadSafeFragQueues.
+   * @param n the global number of the next Fragment to be parsed.
+   * @param mass_n the global mass of the next Fragment to be parsed.
    */
-  ParseThreadSafety(size_t q_size)
-      : proc_in(q_size), proc_on(q_size), proc_out(q_size) {
+  ParseThreadSafety(size_t q_size, size_t n=1, double mass_n=0)
+      : proc_in(q_size), proc_on(q_size), proc_out(q_size), n(n),
+        mass_n(mass_n) {
   }
 };
 
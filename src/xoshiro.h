@@ -0,0 +1,116 @@
+/**
+ *  xoshiro.h
+ *  express
+ *
+ *  Created by agent on 10/19/26.
+ *  Port of xoshiro256** and splitmix64 by David Blackman and Sebastiano Vigna
+ *  (2018), dedicated by them to the public domain.
+ */
+
+#ifndef express_xoshiro_h
+#define express_xoshiro_h
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+
+/**
+ * The Xoshiro class is a small, fast pseudo-random number generator, a port
+ * of xoshiro256** by Blackman and Vigna, seeded with their splitmix64. Each
+ * thread owns its own generator, so no lock is taken to draw a number.
+ * Generators built from the same seed with different stream numbers produce
+ * non-overlapping sequences, which keeps runs with a fixed seed reproducible.
+ *  @author    David Blackman and Sebastiano Vigna (algorithm), agent (port)
+ *  @date      2018 (algorithm), 2026 (port)
+ *  @copyright Public domain (algorithm), Artistic License 2.0 (port)
+ **/
+class Xoshiro {
+  /**
+   * A private array storing the 256-bit state of the generator.
+   */
+  boost::uint64_t _s[4];
+  /**
+   * A private static member function that rotates a 64-bit value left.
+   * @param x the value to rotate.
+   * @param k the number of bits to rotate by.
+   * @return The rotated value.
+   */
+  static boost::uint64_t rotl(boost::uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+ public:
+  /**
+   * Xoshiro constructor seeds the generator.
+   * @param seed the seed of the generator.
+   * @param stream the number of the stream to use for this seed.
+   */
+  explicit Xoshiro(boost::uint64_t seed=0, size_t stream=0) {
+    this->seed(seed, stream);
+  }
+  /**
+   * A member function that reseeds the generator. The state is filled from the
+   * seed with splitmix64 and then advanced by 2^128 draws per stream.
+   * @param seed the seed of the generator.
+   * @param stream the number of the stream to use for this seed.
+   */
+  void seed(boost::uint64_t seed, size_t stream=0) {
+    for (size_t i = 0; i < 4; ++i) {
+      seed += 0x9E3779B97F4A7C15ULL;
+      boost::uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      _s[i] = z ^ (z >> 31);
+    }
+    for (size_t i = 0; i < stream; ++i) {
+      jump();
+    }
+  }
+  /**
+   * A member function that returns the next 64 random bits.
+   * @return A uniformly distributed 64-bit integer.
+   */
+  boost::uint64_t next() {
+    boost::uint64_t result = rotl(_s[1] * 5, 7) * 9;
+    boost::uint64_t t = _s[1] << 17;
+    _s[2] ^= _s[0];
+    _s[3] ^= _s[1];
+    _s[1] ^= _s[2];
+    _s[0] ^= _s[3];
+    _s[2] ^= t;
+    _s[3] = rotl(_s[3], 45);
+    return result;
+  }
+  /**
+   * A member function that returns a random double in [0, 1).
+   * @return A uniformly distributed double.
+   */
+  double uniform() {
+    return (double)(next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+  /**
+   * A member function that advances the generator by 2^128 draws, so that it
+   * continues on a sequence that does not overlap the previous one.
+   */
+  void jump() {
+    static const boost::uint64_t JUMP[] = { 0x180EC6D33CFD0ABAULL,
+                                            0xD5A61266F0C9392CULL,
+                                            0xA9582618E03FC9AAULL,
+                                            0x39ABDC4529B1661CULL };
+    boost::uint64_t s[4] = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < 4; ++i) {
+      for (int b = 0; b < 64; ++b) {
+        if (JUMP[i] & ((boost::uint64_t)1 << b)) {
+          for (size_t j = 0; j < 4; ++j) {
+            s[j] ^= _s[j];
+          }
+        }
+        next();
+      }
+    }
+    for (size_t j = 0; j < 4; ++j) {
+      _s[j] = s[j];
+    }
+  }
+};
+
+#endif